@@ -14,37 +14,114 @@
 #include <iterator>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "peripherals/ngmp3.hpp"
 #include "nxp/nggpio.hpp"
+#include "nxp/ngi2c.hpp"
 #include "peripherals/nghbrtos.hpp"
+#include "peripherals/ngadesto.hpp"
+#include "player/ngpipeline.hpp"
+#include "player/ngbuttons.hpp"
+#include "player/ngplayerfsm.hpp"
+#include "player/nglibrary.hpp"
+#include "player/ngplaylist.hpp"
+#include "player/ngresume.hpp"
+#include "player/ngflashcache.hpp"
+#include "player/ngserialsource.hpp"
+#include "player/ngremote.hpp"
+#include "player/ngcontrol.hpp"
 
 //The amount of RAM for each task
 #define SONG_TASK_RAM 		512
 #define SCAN_TASK_RAM			512
-#define DISPLAY_TASK_RAM 	512
-#define EVENT_TASK_RAM		512
-
-//Button listener ISRs
-void PauseButtonISR();
-void NextButtonISR();
-void SelButtonISR();
-void PrevButtonISR();
-//Play the song
+#define CONTROL_TASK_RAM	512
+#define READ_TASK_RAM			512
+#define FISH_TASK_RAM			256
+#define CHECKPOINT_TASK_RAM	256
+#define REMOTE_TASK_RAM		512
+#define STATUS_TASK_RAM		256
+
+//Notification bits for xPlaySong
+//Set by the DREQ ISR when the decoder can take another block of data
+#define NOTIFY_DREQ				(1 << 0)
+//Set when the song is unpaused
+#define NOTIFY_RESUME			(1 << 1)
+//Set by the controller to start playing the song at the playlist's position
+#define NOTIFY_PLAY				(1 << 2)
+//Set by the controller to stop the song early
+#define NOTIFY_STOP				(1 << 3)
+//How far each fast forward or rewind jumps, in seconds
+#define SEEK_JUMP					10
+//The playlist double tapping sel in the menu plays
+#define PLAYLIST_FILE			"/playlist.m3u"
+//The longest xPlaySong sleeps before checking DREQ again, in case an edge
+//is ever missed
+#define DREQ_TIMEOUT			10
+//How often the checkpoint task writes down where the player is, in ms
+#define CHECKPOINT_PERIOD	5000
+
+//Button edge ISR, shared by every button
+void ButtonISR();
+//Called by the button sampler whenever a button makes a gesture
+void ButtonGesture(uint8_t button, Buttons::Gesture gesture);
+//Decoder data request ISR
+void DreqISR();
+//Play songs
 void xPlaySong(void* p);
-//Menu to choose a song
-void xSongMenu(void* p);
+//Read songs into the pipeline
+void xReadSong(void* p);
+//Run the player state machine
+void xPlayerController(void* p);
 //Scan the directory
 void xScanDir(void* p);
-//Listen for button presses during song playback
-void xEventListener(void *p);
 //Flop the fish!
 void xFishFlop(void *p);
+//Save where the player is to the flash
+void xCheckpoint(void* p);
+//Answer the remote control
+void xRemote(void* p);
+//Keep the I2C status registers up to date
+void xPublishStatus(void* p);
+//A master wrote one of the I2C control registers
+void ControlWrite(uint8_t reg, const uint8_t* data, uint8_t len);
+//Put an event in the player queue
+bool PostEvent(PlayerFsm::Event event, uint16_t arg=0);
+//Set the decoder's volume or bass, and remember it for status
+void SetVolume(uint8_t volume);
+void SetBass(uint8_t bass);
+//Show the play or pause icon
+void ShowPaused(bool paused);
+//Show the continuous, shuffle and repeat indicators
+void ShowModes();
+//Open the song after the reader's current one
+bool OpenNextSong(uint16_t* track);
 
-//The handles to various tasks. Some tasks don't need handlesprev_sem
-TaskHandle_t xPlaySongHandle;
-TaskHandle_t xEventListenerHandle;
+//Every task lives for the whole session, so they're all allocated statically.
+//Nothing gets created or deleted once the scheduler is running
+TaskHandle_t xPlaySongHandle = NULL;
+TaskHandle_t xReadSongHandle;
 TaskHandle_t xFishFlopHandle;
+TaskHandle_t xScanDirHandle;
+TaskHandle_t xCheckpointHandle;
+TaskHandle_t xRemoteHandle;
+TaskHandle_t xPublishStatusHandle = NULL;
+StaticTask_t xPlaySongTcb;
+StaticTask_t xReadSongTcb;
+StaticTask_t xFishFlopTcb;
+StaticTask_t xScanDirTcb;
+StaticTask_t xPlayerControllerTcb;
+StaticTask_t xCheckpointTcb;
+StaticTask_t xRemoteTcb;
+StaticTask_t xPublishStatusTcb;
+StackType_t xPlaySongStack[SONG_TASK_RAM];
+StackType_t xReadSongStack[READ_TASK_RAM];
+StackType_t xFishFlopStack[FISH_TASK_RAM];
+StackType_t xScanDirStack[SCAN_TASK_RAM];
+StackType_t xPlayerControllerStack[CONTROL_TASK_RAM];
+StackType_t xCheckpointStack[CHECKPOINT_TASK_RAM];
+StackType_t xRemoteStack[REMOTE_TASK_RAM];
+StackType_t xPublishStatusStack[STATUS_TASK_RAM];
 
 //The OLED terminal object, so we can print stuff on the screen
 OledTerminal oled_terminal;
@@ -58,12 +135,22 @@ GPIO func_led(1, 24);
 Motor body;
 Motor mouth;
 
-//Semaphores to monitor the status of the buttons
-//When a semaphore is given by a button ISR, the button has been pressed
-SemaphoreHandle_t prev_sem;
-SemaphoreHandle_t next_sem;
-SemaphoreHandle_t pause_sem;
-SemaphoreHandle_t sel_sem;
+//Debounces the buttons and turns them into gestures
+Buttons buttons;
+
+//An event for the controller, with an optional argument
+struct PlayerMsg{
+	PlayerFsm::Event event;
+	uint16_t arg;
+};
+//Every event the player controller cares about goes into this queue: button
+//gestures, the song list being ready, songs ending
+QueueHandle_t player_queue;
+#define PLAYER_QUEUE_LEN	8
+
+//The player state machine, only run by xPlayerController. The remote control
+//task peeks at its state
+PlayerFsm player_fsm;
 
 //Mutex to make sure we don't interrupt SD Card Transfers
 SemaphoreHandle_t sd_mutex;
@@ -71,20 +158,94 @@ SemaphoreHandle_t sd_mutex;
 //Mutex to make sure we don't interrupt an MP3 data transfer
 SemaphoreHandle_t mp3_mutex;
 
+//Given by xPlaySong when it's done stopping a song for the controller
+SemaphoreHandle_t song_stopped;
+
+//True from when the controller starts a song until xPlaySong is done with it
+volatile bool song_active = 0;
+//Set by the controller to stop the song early
+volatile bool stop_requested = 0;
+//Set by xPlaySong to make the reader stop at the next buffer
+volatile bool reader_stop = 0;
+//Seconds to jump, set by the controller and picked up by the reader
+volatile int16_t seek_request = 0;
+//Set by the controller when it asks for a seek. xPlaySong throws away the
+//audio from before the seek until the reader's first block after it shows up
+volatile bool seeking = 0;
+//True to open the next song in the queue before the last one ends, so there's
+//no gap between them
+volatile bool continuous = 0;
+//Bumped for every song, so the controller can ignore a song end event from a
+//song it has already moved on from
+uint16_t song_gen = 0;
+//When the user last skipped, to measure how long it takes to hear the new song
+TickType_t skip_tick = 0;
+//True while the fish should be flopping
+volatile bool fish_on = 0;
+
 //The MP3 object for the VS1053 chip
 Mp3 mp3;
 
-//A list of all the songs. It's a list of char pointers, each pointer points
-//to a null terminated string containing the song name
-char** song_list = NULL;
+//The volume and bass the decoder was last set to. Nothing but this firmware
+//sets them, so status never has to ask the decoder
+volatile uint8_t volume_level = 0;
+volatile uint8_t bass_level = 0;
+
+//Buffers between the SD card reader and the decoder feeder
+Pipeline pipeline;
+
+//Every song on the SD card
+SongLibrary library;
+
+//The order songs play in
+Playlist playlist;
+
+//The ID of the song under the menu cursor. This corresponds to the index of
+//the song in the library
+uint16_t song_id = 0;
+
+//The onboard SPI flash. It's on the SD card's bus
+Adesto flash;
+
+//Where the player was, saved in the flash
+ResumeLog resume;
+
+//The rest of the flash holds the start of recently played songs and the
+//library index
+FlashCache flash_cache;
+
+//The flash cache tag of the song the reader is reading
+uint32_t reader_tag = 0;
+
+//Song data streamed in over a UART
+SerialSource serial_source;
+
+//True while playing from the serial source instead of the SD card
+volatile bool serial_mode = 0;
+//How long the serial source can go quiet before the song is over, in ticks
+#define SERIAL_IDLE_TIMEOUT	2000
 
-//The total number of songs found on the SD card
-uint8_t num_songs = 0;
-//The ID of the song being played. This corresponds to the index of the song
-//in song_list. Ex: The string for song_id = 3 is song_list[3]
-uint8_t song_id = 0;
-//Bool that holds state of the function button
-bool func_key = 1;
+//Commands and status from a host, over UART3
+RemoteLink remote_link;
+
+//The registers a master MCU sees over I2C, see ngcontrol.hpp
+RegisterFile control_regs;
+I2C control_i2c(CONTROL_I2C_ADDR);
+
+//The checkpoint found at boot
+ResumeLog::Record resume_record;
+
+//Set by the controller when the next song should start from resume_record
+//instead of the beginning
+volatile bool resume_pending = 0;
+
+//The song xPlaySong is feeding to the decoder, its place in the play queue,
+//and how far into its file the decoder has been fed. Empty when nothing is
+//playing. Only changed with the scheduler suspended, so the checkpoint task
+//never sees half of a song change
+char playing_path[LIBRARY_NAME_SIZE];
+uint16_t playing_pos = 0;
+uint32_t fed_pos = 0;
 
 namespace{
 	CommandList_t<32> command_list;
@@ -102,14 +263,18 @@ namespace{
 int main()
 {
 	//Whole bunch of setup
-	//Attach the interrupts for all the buttons
-	prev.AttachIsrHandle(PrevButtonISR, GPIO::Edge::kRising);
-	next.AttachIsrHandle(NextButtonISR, GPIO::Edge::kRising);
-	sel.AttachIsrHandle(SelButtonISR, GPIO::Edge::kFalling);
-	pause.AttachIsrHandle(PauseButtonISR, GPIO::Edge::kFalling);
+	//Attach the interrupts for all the buttons. Both edges wake up the
+	//debouncer, which works out what the button is actually doing
+	prev.AttachIsrHandle(ButtonISR, GPIO::Edge::kBoth);
+	next.AttachIsrHandle(ButtonISR, GPIO::Edge::kBoth);
+	sel.AttachIsrHandle(ButtonISR, GPIO::Edge::kBoth);
+	pause.AttachIsrHandle(ButtonISR, GPIO::Edge::kBoth);
 	//Fully initialize the MP3 chip.
 	mp3.FullInit();
-	//Max the volume of the MP3 chipkIntPorts
+	//Wake xPlaySong whenever the decoder asks for more data
+	mp3.RegisterDREQInterrupt(DreqISR);
+	//Max the volume of the MP3 chipkIntPorts. The mutex doesn't exist yet, and
+	//volume_level already starts at 0
 	mp3.SetVolume(0x00);
 	//Init the OLED screen
 	oled_terminal.Initialize();
@@ -124,18 +289,40 @@ int main()
 	pause.SetPulldown();
 	prev.SetPulldown();
 	next.SetPulldown();
+	//The function LED is on while the function key is off
 	func_led.SetHigh();
-	func_led.Set(func_key);
 	body.Init(1, 29, 1, 14);
 	mouth.Init(1, 20, 1, 31);
-	//Setup all the semaphores for the buttons. When a semaphore can be taken,
-	//that means a button has been pressed.
-	prev_sem = xSemaphoreCreateBinary();
-	next_sem = xSemaphoreCreateBinary();
-	pause_sem = xSemaphoreCreateBinary();
-	sel_sem = xSemaphoreCreateBinary();
+	//Set up the button debouncer. The buttons have to be added in the order
+	//PlayerFsm expects. Holding pause is a shortcut back to the menu
+	player_queue = xQueueCreate(PLAYER_QUEUE_LEN, sizeof(PlayerMsg));
+	buttons.Init(ButtonGesture);
+	//Holding prev or next rewinds or fast forwards
+	buttons.Add(&prev, Buttons::kUseLong);
+	//Double tapping sel turns continuous play on and off, holding it shuffles.
+	//Double tapping pause changes the repeat mode
+	buttons.Add(&sel, Buttons::kUseLong | Buttons::kUseDouble);
+	buttons.Add(&pause, Buttons::kUseLong | Buttons::kUseDouble);
+	buttons.Add(&next, Buttons::kUseLong);
 	sd_mutex = xSemaphoreCreateMutex();
 	mp3_mutex = xSemaphoreCreateMutex();
+	song_stopped = xSemaphoreCreateBinary();
+	//The library shares the SD card with the song reader
+	library.Init(sd_mutex);
+	playlist.Init(&library, sd_mutex);
+	//Set up the song buffers
+	pipeline.Init();
+	//Get the serial port ready for songs streamed from a host
+	serial_source.Init();
+	//And the one for remote control
+	remote_link.Init();
+	//Answer masters on the I2C bus. Writes go straight into the player queue,
+	//so it has to exist first
+	control_regs.SetCallback(control::kPlaying, ControlWrite);
+	control_regs.SetCallback(control::kVolume, ControlWrite);
+	control_regs.SetCallback(control::kBass, ControlWrite);
+	control_regs.SetCallback(control::kTrack, ControlWrite);
+	control_i2c.InitI2CSlave(&control_regs);
 	//Actually turn on the interrupts. We only enable once, but because of the way
 	//the GPIO library is written this enables interrupts on all the buttons
 	prev.EnableInterrupts();
@@ -144,326 +331,1049 @@ int main()
 	ci.AddCommand(&rtos_command);
 	ci.Initialize();
 
-	//On bootup, start scanning the SD card for songs.
-	xTaskCreate(xScanDir, "scan_task", SCAN_TASK_RAM, NULL, tskIDLE_PRIORITY + 2, NULL);
+	//Start every task up front. They all sleep until someone gives them work.
+	//The controller runs the whole show. It sits above the players so button
+	//presses get handled right away
+	xTaskCreateStatic(xPlayerController, "controller", CONTROL_TASK_RAM, NULL, tskIDLE_PRIORITY + 2, xPlayerControllerStack, &xPlayerControllerTcb);
+	xPlaySongHandle = xTaskCreateStatic(xPlaySong, "playsong_task", SONG_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xPlaySongStack, &xPlaySongTcb);
+	xReadSongHandle = xTaskCreateStatic(xReadSong, "readsong_task", READ_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xReadSongStack, &xReadSongTcb);
+	xFishFlopHandle = xTaskCreateStatic(xFishFlop, "xFishFlop", FISH_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xFishFlopStack, &xFishFlopTcb);
+	//On bootup, the scanner starts scanning the SD card for songs.
+	xScanDirHandle = xTaskCreateStatic(xScanDir, "scan_task", SCAN_TASK_RAM, NULL, tskIDLE_PRIORITY + 2, xScanDirStack, &xScanDirTcb);
+	//Saves where the player is to the flash every few seconds
+	xCheckpointHandle = xTaskCreateStatic(xCheckpoint, "checkpoint", CHECKPOINT_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xCheckpointStack, &xCheckpointTcb);
+	//Listens for the remote control. Everything it asks for that touches the
+	//song goes through the controller
+	xRemoteHandle = xTaskCreateStatic(xRemote, "remote", REMOTE_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xRemoteStack, &xRemoteTcb);
+	//Refreshes what I2C masters read
+	xPublishStatusHandle = xTaskCreateStatic(xPublishStatus, "status", STATUS_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, xPublishStatusStack, &xPublishStatusTcb);
 	//Set up the commandline stuff so we can monitor CPU usage
 	//xTaskCreate(TerminalTask, "Terminal", 1024, nullptr, tskIDLE_PRIORITY + 1, nullptr);
 	vTaskStartScheduler();
 }
 
-//Show a menu and have a user choose a song on the OLED display
-void xSongMenu(void* p){
-	//Clear out the oled terminal and prompt the user to choose a song
-	oled_terminal.Clear();
-	oled_terminal.printf("Choose a song\n");
-	//Loop forever until the user chooses a song
-	for(;;){
-		//Scan the buttons once every 10th of a second
-		vTaskDelay(100);
-		//Reset the cursor at the top of the loop and print the song
-		oled_terminal.SetCursor(0, 1);
-		oled_terminal.printf("%s               \n", song_list[song_id]);
-		//Check to see if the next button is pressed
-		if(xSemaphoreTake(next_sem, 0)){
-			//When the next button is pressed, select the next song. Make sure to loop
-			//back to the beginning of the song list
-			if(song_id >= num_songs - 1){
-				song_id = 0;
+//Put an event in the player queue
+//@return bool: False if the queue was full and the event got dropped
+bool PostEvent(PlayerFsm::Event event, uint16_t arg){
+	PlayerMsg msg = {event, arg};
+	return xQueueSend(player_queue, &msg, 0) == pdTRUE;
+}
+
+//Draw the song under the menu cursor
+void ShowMenu(bool clear){
+	if(clear){
+		//Clear out the oled terminal and prompt the user to choose a song
+		oled_terminal.Clear();
+		oled_terminal.printf("Choose a song\n");
+	}
+	oled_terminal.SetCursor(0, 1);
+	char name[LIBRARY_NAME_SIZE];
+	library.GetName(song_id, name);
+	oled_terminal.printf("%s               \n", SongLibrary::BaseName(name));
+}
+
+//Move the menu cursor forward or back a song, looping around the ends of the
+//list
+void StepSong(bool forward){
+	if(forward){
+		song_id = (song_id >= library.GetCount() - 1) ? 0 : song_id + 1;
+	}
+	else{
+		song_id = (song_id <= 0) ? library.GetCount() - 1 : song_id - 1;
+	}
+}
+
+//Tell xPlaySong to start playing the song at the playlist's position
+void StartSong(){
+	//Remember where we are in case the power goes
+	playlist.Save();
+	mp3.SetPaused(0);
+	song_gen++;
+	song_active = 1;
+	xTaskNotify(xPlaySongHandle, NOTIFY_PLAY, eSetBits);
+}
+
+//Stop the song that's playing, if there is one, and wait for xPlaySong to be
+//ready for the next one
+void StopSong(){
+	//Check and flag with the scheduler suspended, so xPlaySong can't finish
+	//the song on its own in between
+	vTaskSuspendAll();
+	bool active = song_active;
+	if(active){
+		stop_requested = 1;
+	}
+	xTaskResumeAll();
+	if(active){
+		xTaskNotify(xPlaySongHandle, NOTIFY_STOP, eSetBits);
+		xSemaphoreTake(song_stopped, portMAX_DELAY);
+	}
+}
+
+//Set the decoder's volume and remember it
+void SetVolume(uint8_t volume){
+	//Don't interrupt an MP3 transfer
+	xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+	mp3.SetVolume(volume);
+	volume_level = volume;
+	xSemaphoreGive(mp3_mutex);
+}
+
+//Set the decoder's bass and remember it. Only the bottom 4 bits count, same
+//as in the decoder
+void SetBass(uint8_t bass){
+	xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+	mp3.SetBass(bass);
+	bass_level = bass & 0x0F;
+	xSemaphoreGive(mp3_mutex);
+}
+
+//Start or stop the fish
+void SetFish(bool on){
+	fish_on = on;
+	if(on){
+		xTaskNotifyGive(xFishFlopHandle);
+	}
+}
+
+//Show the play or pause icon
+void ShowPaused(bool paused){
+	oled_terminal.SetCursor(0, 7);
+	oled_terminal.printf(paused ? "||" : "> ");
+}
+
+//Show whether songs will play one after another, whether they're shuffled,
+//and the repeat mode
+void ShowModes(){
+	static const char* const kRepeat[] = {"  ", "RA", "R1"};
+	oled_terminal.SetCursor(3, 7);
+	oled_terminal.printf("%c %c %s", continuous ? 'C' : ' ', playlist.GetShuffle() ? 'S' : ' ',
+	                     kRepeat[playlist.GetRepeat()]);
+}
+
+//Do whatever the state machine asks for
+//@param action: What to do
+//@param arg: The argument of the event that led to it
+void RunAction(PlayerFsm::Action action, uint16_t arg){
+	switch(action){
+		case PlayerFsm::kNone :
+			break;
+
+		case PlayerFsm::kShowMenu :
+			ShowMenu(1);
+			break;
+
+		case PlayerFsm::kMenuNext :
+			StepSong(1);
+			ShowMenu(0);
+			break;
+
+		case PlayerFsm::kMenuPrev :
+			StepSong(0);
+			ShowMenu(0);
+			break;
+
+		case PlayerFsm::kPlaySelected :
+		case PlayerFsm::kPlayPlaylist :
+			skip_tick = xTaskGetTickCount();
+			//Queue up the library from the cursor, or the playlist file. A playlist
+			//that can't be read falls back to the library
+			if(action == PlayerFsm::kPlaySelected){
+				playlist.UseLibrary(song_id);
 			}
 			else{
-				song_id++;
+				playlist.LoadM3u(PLAYLIST_FILE);
 			}
-		}
-		//When the previous button is pressed, select to the previous song. Make
-		//sure to loop back to the end of the list
-		if(xSemaphoreTake(prev_sem, 0)){
-			if(song_id <= 0){
-				song_id = num_songs - 1;
+			StartSong();
+			SetFish(1);
+			break;
+
+		case PlayerFsm::kNextTrack :
+		case PlayerFsm::kPrevTrack :
+			//The host decides what plays next over serial. Skipping from kPaused has
+			//still moved the state machine to kPlaying, so carry on playing to match
+			if(serial_mode){
+				if(mp3.CheckPaused()){
+					mp3.SetPaused(0);
+					ShowPaused(0);
+					xTaskNotify(xPlaySongHandle, NOTIFY_RESUME, eSetBits);
+				}
+				break;
+			}
+			//Skipping is just a stop and a start, no tasks get killed
+			skip_tick = xTaskGetTickCount();
+			StopSong();
+			if(action == PlayerFsm::kNextTrack){
+				playlist.Next();
 			}
 			else{
-				song_id--;
+				playlist.Prev();
 			}
-		}
-		//When the select button is pressed, the user has made their choice. Exit
-		//the loop
-		if(xSemaphoreTake(sel_sem, 0)){
+			StartSong();
 			break;
+
+		case PlayerFsm::kPlayNext :
+			//The last song is already over, so there's nothing to stop
+			playlist.SetPosition(arg);
+			StartSong();
+			break;
+
+		case PlayerFsm::kPauseSong :
+		case PlayerFsm::kResumeSong :
+			mp3.SetPaused(action == PlayerFsm::kPauseSong);
+			ShowPaused(mp3.CheckPaused());
+			//Wake the player back up if it's sleeping on the pause
+			if(!mp3.CheckPaused()){
+				xTaskNotify(xPlaySongHandle, NOTIFY_RESUME, eSetBits);
+			}
+			break;
+
+		case PlayerFsm::kStopSong :
+			StopSong();
+			SetFish(0);
+			serial_mode = 0;
+			//Write down that nothing's playing now, so the next boot goes to the menu
+			xTaskNotifyGive(xCheckpointHandle);
+			//Check the SD card for changes, prompt the user to choose another song
+			xTaskNotifyGive(xScanDirHandle);
+			break;
+
+		case PlayerFsm::kBassUp :
+		case PlayerFsm::kBassDown :
+			SetBass(bass_level + ((action == PlayerFsm::kBassUp) ? 1 : -1));
+			break;
+
+		case PlayerFsm::kSeekForward :
+		case PlayerFsm::kSeekBack :
+		case PlayerFsm::kSeekBy :
+			//A stream can't seek
+			if(serial_mode){
+				break;
+			}
+			//The reader does the actual seek, since it owns the file position.
+			//Jumps add up if the button is held again before the reader gets to it
+			taskENTER_CRITICAL();
+			if(action == PlayerFsm::kSeekBy){
+				seek_request += (int16_t)arg;
+			}
+			else{
+				seek_request += (action == PlayerFsm::kSeekForward) ? SEEK_JUMP : -SEEK_JUMP;
+			}
+			seeking = 1;
+			taskEXIT_CRITICAL();
+			break;
+
+		case PlayerFsm::kToggleContinuous :
+			continuous = !continuous;
+			ShowModes();
+			break;
+
+		case PlayerFsm::kToggleShuffle :
+			//The song that's playing stays put, the rest of the queue moves
+			playlist.SetShuffle(!playlist.GetShuffle());
+			playlist.Save();
+			ShowModes();
+			break;
+
+		case PlayerFsm::kCycleRepeat :
+			playlist.SetRepeat((Playlist::Repeat)((playlist.GetRepeat() + 1) % (Playlist::kRepeatOne + 1)));
+			playlist.Save();
+			ShowModes();
+			break;
+
+		case PlayerFsm::kResumePlayback :
+			//The play queue was restored along with the library, so just start the
+			//song from the checkpoint and let xPlaySong jump into it
+			skip_tick = xTaskGetTickCount();
+			continuous = resume_record.flags & ResumeLog::kContinuous;
+			playlist.SetPosition(resume_record.position);
+			resume_pending = 1;
+			StartSong();
+			SetFish(1);
+			break;
+
+		case PlayerFsm::kPlaySerial :
+			//Play whatever the host streams in, until it goes quiet
+			skip_tick = xTaskGetTickCount();
+			serial_mode = 1;
+			StartSong();
+			SetFish(1);
+			break;
+
+		case PlayerFsm::kSetVolume :
+		case PlayerFsm::kSetBass :
+			if(action == PlayerFsm::kSetVolume){
+				SetVolume(arg);
+			}
+			else{
+				SetBass(arg);
+			}
+			break;
+
+		case PlayerFsm::kPlayRemote :
+			//Whatever was playing, the stream included, makes way. The new song
+			//queues up the library from there, like picking it from the menu
+			skip_tick = xTaskGetTickCount();
+			StopSong();
+			serial_mode = 0;
+			song_id = arg;
+			playlist.UseLibrary(song_id);
+			StartSong();
+			SetFish(1);
+			break;
+
+		case PlayerFsm::kFuncOn :
+		case PlayerFsm::kFuncOff :
+			break;
+	}
+	//The function LED is on while the function key is off
+	func_led.Set(!player_fsm.CheckFunc());
+	//Let I2C masters see the change without waiting for the next refresh
+	if(action != PlayerFsm::kNone){
+		xTaskNotifyGive(xPublishStatusHandle);
+	}
+}
+
+//The player controller. Sleeps on the player queue, runs every event through
+//the state machine, and carries out whatever it says to do. This is the only
+//task that starts and stops songs
+void xPlayerController(void* p){
+	PlayerMsg msg;
+	for(;;){
+		xQueueReceive(player_queue, &msg, portMAX_DELAY);
+		//Ignore news about a song we've already moved on from
+		if((msg.event == PlayerFsm::kTrackEnd || msg.event == PlayerFsm::kTrackFailed) &&
+			 msg.arg != song_gen){
+			continue;
+		}
+		//An I2C master can ask for any song, check it's there before the state
+		//machine moves on
+		if(msg.event == PlayerFsm::kRemotePlay && msg.arg >= library.GetCount()){
+			continue;
+		}
+		//The play queue and repeat mode pick the next song whether or not
+		//continuous play is on. Continuous play only takes out the gap, by having
+		//the reader open the next song early
+		if(msg.event == PlayerFsm::kTrackEnd && !serial_mode){
+			uint16_t next = playlist.GetPosition();
+			if(playlist.Peek(&next)){
+				msg.event = PlayerFsm::kQueueNext;
+				msg.arg = next;
+			}
+		}
+		RunAction(player_fsm.Handle(msg.event), msg.arg);
+	}
+}
+
+//Check whether the player was in the middle of a song when the power went out,
+//and that the song is still where the play queue says it is
+//@return bool: True if resume_record has a song to pick back up
+bool CheckResume(){
+	if(!resume.GetLatest(&resume_record)){
+		return 0;
+	}
+	//Put the sound back how it was, even if we end up at the menu
+	SetVolume(resume_record.volume);
+	SetBass(resume_record.bass);
+	if(!(resume_record.flags & ResumeLog::kPlaying) || resume_record.position >= playlist.GetCount()){
+		return 0;
+	}
+	char name[LIBRARY_NAME_SIZE];
+	if(!playlist.GetPath(resume_record.position, name) || strcmp(name, resume_record.path)){
+		LOG_INFO("Resume: %s has moved", resume_record.path);
+		return 0;
+	}
+	return 1;
+}
+
+//Bring the library up to date with the SD card. This only walks the directory
+//if the card has changed since the library was last saved
+void ScanDir(){
+	bool ok = library.Load();
+	if(!ok || library.GetCount() == 0){
+		//If the SD card can't be read, show an error and halt
+		oled_terminal.printf(ok ? "No songs found!\n" : "Cannot read SD card!\n");
+		vTaskSuspend(NULL);
+	}
+	//Anything cached from before the card changed is no good
+	flash_cache.SetKey(library.GetKey());
+	//Keep the cursor on the list if it shrank
+	if(song_id >= library.GetCount()){
+		song_id = 0;
+	}
+	//Pick the play queue back up from before the power went out
+	static bool restored = 0;
+	if(!restored){
+		restored = 1;
+		if(playlist.Restore()){
+			LOG_INFO("Restored the play queue at %d of %d", playlist.GetPosition(), playlist.GetCount());
+		}
+		//The flash is on the SD card's bus, which is only set up once the card is
+		//mounted
+		xSemaphoreTake(sd_mutex, portMAX_DELAY);
+		flash.Init();
+		xSemaphoreGive(sd_mutex);
+		resume.Init(&flash, sd_mutex);
+		flash_cache.Init(&flash, sd_mutex);
+		flash_cache.SetKey(library.GetKey());
+		library.SetFlashCache(&flash_cache);
+		xTaskNotifyGive(xCheckpointHandle);
+		//Skip the menu if a song was cut off
+		if(CheckResume()){
+			PostEvent(PlayerFsm::kResumeReady);
+			return;
 		}
-		//Yield the task after a poll
-		taskYIELD();
 	}
-	//Play the song at the song_id the user selected
-	xTaskCreate(xPlaySong, "playsong_task", SONG_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, &xPlaySongHandle);
-	//Delete this task
-	vTaskDelete(NULL);
+	//Tell the controller the song list is ready
+	PostEvent(PlayerFsm::kLibraryReady);
 }
 
-//Scan the root of the SD card and enumerate all the files to song_list
+//Scan the SD card at boot, then check it again every time the controller asks
 void xScanDir(void* p){
-	//Initialize all the special FATFS variables
-	FILINFO fno;
-	FRESULT res;
-	DIR dir;
-	UINT i;
-	//Check the root directory
-  char path[] = {"/"};
-	//Open the directory
-	res = f_opendir(&dir, path);
-	if (res == FR_OK) {
-		uint8_t i = 0;
-		num_songs = 0;
-		//Loop over all the directory items
-		for (;;) {
-				//Read a directory item
-				res = f_readdir(&dir, &fno);
-				//Break if there's an error or no more files
-				if (res != FR_OK || fno.fname[0] == 0) break;
-				//Increase the number of songs found
-				num_songs++;
+	for(;;){
+		ScanDir();
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+}
+
+//Sleep until the decoder wants data and the song isn't paused. DREQ going high
+//fires DreqISR, which wakes us up, so we don't burn any CPU while the
+//decoder's FIFO is full
+//@return bool: False if the controller wants the song stopped
+bool WaitForDecoder(){
+	while(!mp3.CheckDreq() || mp3.CheckPaused()){
+		if(stop_requested){
+			return 0;
+		}
+		xTaskNotifyWait(0, NOTIFY_DREQ | NOTIFY_RESUME | NOTIFY_STOP, NULL, DREQ_TIMEOUT);
+	}
+	return !stop_requested;
+}
+
+//Stream a buffer to the decoder one DREQ block at a time
+//@return bool: False if the controller wants the song stopped
+bool FeedDecoder(uint8_t* buf, uint16_t len){
+	//SDI goes out in 8 bit frames, so blocks of any length pass straight through.
+	//Reads after an ID3 skip or a seek start at odd offsets and come back odd
+	for(uint16_t i = 0; i < len; i += SDI_BLOCK_SIZE){
+		uint16_t chunk = (len - i < SDI_BLOCK_SIZE) ? (len - i) : SDI_BLOCK_SIZE;
+		//Sleep until the decoder can take a whole block
+		if(!WaitForDecoder()){
+			return 0;
 		}
-		//Allocate the song list in memory
-		song_list = (char**)malloc(num_songs*sizeof(char*)); //TODO: Free song_list later
-		//Open the directory again
-		f_opendir(&dir, path);
-			for (;;) {
-					//Read a song
-					res = f_readdir(&dir, &fno);
-					//Break on an error or if there are no more songs
-					if (res != FR_OK || fno.fname[0] == 0) break;
-					//Allocate space for new song names
-					song_list[i] = new char[strlen(fno.fname)]; //TODO: free this char later
-					//Copy the name of the song into the song list
-					strncpy(song_list[i], fno.fname, 50);
-					i++;
-			}
-			//Close the directory cleanly
-			f_closedir(&dir);
+		//The rest of this buffer is from before a seek, don't bother with it
+		if(seeking){
+			return 1;
+		}
+		//Don't let anyone else talk to the chip in the middle of a block
+		xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+		//Pull XDCS low, tell the chip we have song data for it
+		mp3.StartSdi();
+		//Send our buffer
+		mp3.SendSongBlock(&buf[i], chunk);
+		//Pull the XDCS back high to sync and end the data transaction
+		mp3.EndSdi();
+		//Give back the MP3 mutex when it's done
+		xSemaphoreGive(mp3_mutex);
+	}
+	return 1;
+}
+
+//Jump from where the decoder is now. Called by the reader between buffers
+//@param jump: Seconds to jump, negative to go back
+void Seek(int16_t jump){
+	xSemaphoreTake(sd_mutex, portMAX_DELAY);
+	xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+	//The decoder's clock is where the listener is, the file is a few buffers
+	//ahead of that
+	int32_t target = (int32_t)mp3.GetPlayTime() + jump;
+	int32_t landed = mp3.Seek((target < 0) ? 0 : target * 1000);
+	xSemaphoreGive(mp3_mutex);
+	xSemaphoreGive(sd_mutex);
+	if(landed < 0){
+		LOG_WARNING("This song can't seek");
 	}
 	else{
-		//If the SD card can't be opened, show an error and halt
-		oled_terminal.printf("Cannot read SD card!\n");
-		vTaskDelete(NULL);
+		LOG_INFO("Seeked %d s to %ld ms", jump, landed);
 	}
-	//Prompt the user to choose a song that this task has found
-	xTaskCreate(xSongMenu, "song_menu", DISPLAY_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, NULL);
-	//Delete this task
-	vTaskDelete(NULL);
 }
 
-void xPlaySong(void* p){
+//Read the serial source into the pipeline until the host goes quiet or
+//xPlaySong says stop. Same deal as reading a song: exactly one kEnd block
+void ReadSerial(){
+	TickType_t heard = xTaskGetTickCount();
+	bool over = 0;
+	while(!over){
+		uint8_t* buf = pipeline.GetFree(portMAX_DELAY);
+		uint16_t len = 0;
+		//Fill a whole buffer, checking for a stop every DREQ_TIMEOUT
+		while(len < PIPE_BUF_SIZE && !over){
+			uint16_t got = serial_source.Read(&buf[len], PIPE_BUF_SIZE - len, DREQ_TIMEOUT);
+			if(got){
+				heard = xTaskGetTickCount();
+				len += got;
+			}
+			over = reader_stop || xTaskGetTickCount() - heard >= SERIAL_IDLE_TIMEOUT;
+		}
+		pipeline.Commit(buf, len, over ? Pipeline::kEnd : Pipeline::kNone);
+	}
+}
+
+//Read the open song from the SD card into the pipeline, staying as far ahead
+//of xPlaySong as there are free buffers. Every song ends with exactly one
+//kEnd block, whether it ran out of data or xPlaySong told us to stop
+void xReadSong(void* p){
 	FRESULT fr;
-	//Clear the OLED screen
+	UINT bytes_read;
+	for(;;){
+		//Sleep until xPlaySong opens a song
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if(serial_mode){
+			ReadSerial();
+			continue;
+		}
+		//The song being read, which runs ahead of the one being heard
+		uint16_t track = playlist.GetPosition();
+		uint8_t flags = Pipeline::kNone;
+		uint16_t arg = 0;
+		for(;;){
+			//Wait for xPlaySong to hand back a buffer
+			uint8_t* buf = pipeline.GetFree(portMAX_DELAY);
+			if(reader_stop){
+				pipeline.Commit(buf, 0, Pipeline::kEnd);
+				break;
+			}
+			//Pick up a seek from the controller
+			taskENTER_CRITICAL();
+			int16_t jump = seek_request;
+			seek_request = 0;
+			taskEXIT_CRITICAL();
+			if(jump){
+				Seek(jump);
+				//Even if the song can't seek, this ends xPlaySong's skipping
+				flags |= Pipeline::kSeek;
+			}
+			//Read up to the next buffer sized boundary in the file. The audio
+			//usually starts part way into a sector after the tags are skipped, so
+			//the first read is short and every read after it is sector aligned
+			FIL* file = mp3.GetFileHandle();
+			uint32_t pos = f_tell(file);
+			uint32_t end = mp3.GetSongInfo()->audio_end;
+			UINT want = PIPE_BUF_SIZE - (pos % PIPE_BUF_SIZE);
+			//Stop before any tag at the end of the file
+			bool last = (end <= pos + want);
+			if(last){
+				want = (end > pos) ? end - pos : 0;
+			}
+			//Only the start of each song is ever in the flash cache
+			xSemaphoreTake(sd_mutex, portMAX_DELAY);
+			bool cached = pos + want <= FLASH_CACHE_CHUNK && flash_cache.Read(reader_tag, pos, buf, want);
+			if(cached){
+				fr = f_lseek(file, pos + want);
+				bytes_read = want;
+			}
+			else{
+				fr = f_read(file, buf, want, &bytes_read);
+			}
+			xSemaphoreGive(sd_mutex);
+			if(cached){
+				flags |= Pipeline::kCached;
+			}
+			//A short read or an error means the song is over
+			bool over = fr || last || bytes_read < want;
+			//In continuous play, open the next song while this one still has a
+			//pipeline's worth of audio to go, and keep the data coming without a
+			//break. The decoder never sees the songs change
+			if(over && continuous && !reader_stop && OpenNextSong(&track)){
+				pipeline.Commit(buf, fr ? 0 : bytes_read, flags, arg, pos);
+				flags = Pipeline::kTrackStart;
+				arg = track;
+				continue;
+			}
+			if(over){
+				pipeline.Commit(buf, fr ? 0 : bytes_read, flags | Pipeline::kEnd, arg, pos);
+				break;
+			}
+			pipeline.Commit(buf, bytes_read, flags, arg, pos);
+			flags = Pipeline::kNone;
+			arg = 0;
+		}
+	}
+}
+
+//Close the song the reader just finished and open the one after it
+//@param track: The song that finished, changed to the new song
+//@return bool: True if the next song is open
+bool OpenNextSong(uint16_t* track){
+	//The playlist decides what's next, and whether there is a next
+	uint16_t next = *track;
+	char name[LIBRARY_NAME_SIZE];
+	if(!playlist.Peek(&next) || !playlist.GetPath(next, name)){
+		return 0;
+	}
+	xSemaphoreTake(sd_mutex, portMAX_DELAY);
+	mp3.StopSong();
+	bool ok = mp3.OpenSong(name);
+	if(ok){
+		reader_tag = FlashCache::Tag(name, f_size(mp3.GetFileHandle()));
+		flash_cache.Request(name, reader_tag, 0);
+	}
+	xSemaphoreGive(sd_mutex);
+	if(ok){
+		const SongInfo* info = mp3.GetSongInfo();
+		LOG_INFO("Up next: %s, encoder delay %d, padding %d", SongLibrary::BaseName(name),
+		         info->enc_delay, info->enc_padding);
+		*track = next;
+	}
+	return ok;
+}
+
+//Tell the checkpoint task which song is playing now
+//@param position: The song's place in the play queue
+//@param name: The song's path, or NULL when nothing is playing
+//@param pos: Where in the song's file the decoder is starting
+void SetPlaying(uint16_t position, const char* name, uint32_t pos){
+	vTaskSuspendAll();
+	playing_pos = position;
+	fed_pos = pos;
+	if(name){
+		strcpy(playing_path, name);
+	}
+	else{
+		playing_path[0] = 0;
+	}
+	xTaskResumeAll();
+}
+
+//Draw the playing screen for the song at the playlist's position
+//@param name: The song's path, for when it doesn't have a title
+void ShowPlaying(const char* name){
 	oled_terminal.Clear();
+	//Print the title of the song being played, or the file name if it doesn't
+	//have one, and the Play icon
+	//The tags are from the last song off the SD card when playing the serial
+	//source
+	const SongInfo* info = mp3.GetSongInfo();
+	bool tags = !serial_mode;
+	oled_terminal.printf("Playing\n%s\n", (tags && info->title[0]) ? info->title : SongLibrary::BaseName(name));
+	if(tags && info->artist[0]){
+		oled_terminal.printf("%s\n", info->artist);
+	}
+	ShowPaused(mp3.CheckPaused());
+	ShowModes();
+	oled_terminal.SetCursor(0, 0);
+}
+
+//Open the song at the playlist's position and get the decoder ready for it
+//@param name: A LIBRARY_NAME_SIZE buffer, filled in with the song's path
+//@return bool: False if the song couldn't be opened
+bool OpenFirstSong(char* name){
+	bool ok = playlist.GetPath(playlist.GetPosition(), name);
 	//Prepare a song for play
-	if(!mp3.PrepareSong(song_list[song_id])){
+	bool jump = resume_pending;
+	resume_pending = 0;
+	xSemaphoreTake(sd_mutex, portMAX_DELAY);
+	xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+	ok = ok && mp3.PrepareSong(name);
+	//Pick up where the power went out. The checkpoint has the exact byte the
+	//decoder was fed up to, so go straight there and let the decoder resync.
+	//Seeking by time could mean walking every frame from the start
+	if(ok && jump){
+		mp3.JumpTo(resume_record.offset, resume_record.ms);
+	}
+	//Serve the start of the song from the flash if it's there, and put it
+	//there for next time if it isn't
+	if(ok){
+		reader_tag = FlashCache::Tag(name, f_size(mp3.GetFileHandle()));
+		flash_cache.Request(name, reader_tag, 0);
+	}
+	//A library song that isn't there any more means the card changed behind the
+	//library's back, ex: a rename in a folder. Have the next scan find it
+	bool missing = !ok && name[0] && playlist.FromLibrary() && f_stat(name, NULL) != FR_OK;
+	xSemaphoreGive(mp3_mutex);
+	xSemaphoreGive(sd_mutex);
+	if(missing){
+		library.MarkStale();
+	}
+	if(ok && jump){
+		LOG_INFO("Resumed %s at %lu ms", SongLibrary::BaseName(name), resume_record.ms);
+	}
+	if(ok){
+		SetPlaying(playlist.GetPosition(), name, f_tell(mp3.GetFileHandle()));
+	}
+	return ok;
+}
+
+//Get the decoder ready for a stream from the serial source, which could
+//start anywhere in a frame
+//@param name: Filled in with a name for the screen
+//@return bool: False if the serial source couldn't start
+bool OpenSerial(char* name){
+	strcpy(name, "Serial input");
+	xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+	mp3.SetResync(MP3_RESYNC_AUTO);
+	mp3.ResetPlayTime();
+	xSemaphoreGive(mp3_mutex);
+	return serial_source.Start();
+}
+
+//Stream the song at the playlist's position, or the serial source, through
+//the pipeline
+//@return bool: False if the song couldn't be opened
+bool PlayOneSong(){
+	//Clear the OLED screen
+	oled_terminal.Clear();
+	char name[LIBRARY_NAME_SIZE];
+	bool ok = serial_mode ? OpenSerial(name) : OpenFirstSong(name);
+	if(!ok){
 		//If the song can't be played, notify the user with a message for 2 seconds
-		//and then prompt them to choose a new song instead
-		oled_terminal.printf("Unable to play %s\n", song_list[song_id]);
+		oled_terminal.printf("Unable to play %s\n", SongLibrary::BaseName(name));
 		vTaskDelay(2000);
-		xTaskCreate(xScanDir, "scan_task", SCAN_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, NULL);
-		vTaskDelete(NULL);
+		return 0;
 	}
-	//Print the name of the song being played and the Play icon
-	oled_terminal.printf("Playing\n%s\n", song_list[song_id]);
-	oled_terminal.SetCursor(0, 7);
-	oled_terminal.printf("> " );
-	oled_terminal.SetCursor(0, 0);
-	//Start the event listener so we can listen for the buttons
-	xTaskCreate(xEventListener, "event_listener", EVENT_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, &xEventListenerHandle);
-	//Start floppin the fish
-	xTaskCreate(xFishFlop, "xFishFlop", 512, NULL, tskIDLE_PRIORITY + 1, &xFishFlopHandle);
-	//Buffer to store the data to stream to the decoder
-  uint8_t buf[SONG_BUF_SIZE];
-  //Store the bytes read
-  UINT bytes_read = SONG_BUF_SIZE;
-  //Start streaming song data
-  //If we ever read less than 32 bytes, we've hit the end of the song
-  while(bytes_read >= SONG_BUF_SIZE){
-		//Take the SD card mutex
-		if(xSemaphoreTake(sd_mutex, 0)){
-			//Read 32 bytes from the SD card, store in buffer
-			fr = f_read(mp3.GetFileHandle(), buf, SONG_BUF_SIZE, &bytes_read);
-			xSemaphoreGive(sd_mutex);
-			//Send the buffer in 32 byte chunks
-			for(uint16_t i = 0; i < SONG_BUF_SIZE/32; i++){
-				//Pull XDCS low, tell the chip we have song data for it
-				xSemaphoreTake(mp3_mutex, 0);
-				//Start the data transaction
-				mp3.StartSdi();
-				//Send our buffer
-				for(uint8_t j = 0; j < 32; j+=2){
-					//Don't send if the chip is full or the song is paused
-					while(!mp3.CheckDreq() || mp3.CheckPaused()){
-						mp3.EndSdi();
-						//Check once, then yield
-						taskYIELD();
-						mp3.StartSdi();
-					}
-					//Send the two bytes
-					mp3.SendSongData((buf[i*32 + j] << 8) | (buf[i*32 + j + 1]));
-				}
-				//Pull the XDCS back high to sync and end the data transaction
-				mp3.EndSdi();
-				//Give back the MP3 mutex when it's done
-				xSemaphoreGive(mp3_mutex);
-			}
+	ShowPlaying(name);
+	//Start reading the song into the pipeline
+	pipeline.ResetWatermarks();
+	reader_stop = 0;
+	seek_request = 0;
+	seeking = 0;
+	xTaskNotifyGive(xReadSongHandle);
+	//Stream full buffers to the decoder until the reader says the song is over
+	Pipeline::Block block;
+	bool first = 1;
+	do{
+		pipeline.GetFull(&block, portMAX_DELAY);
+		//The reader has jumped, everything from here on is the new spot
+		if(block.flags & Pipeline::kSeek){
+			seeking = 0;
 		}
-  }
+		//The reader has moved on to the next song. Its audio follows straight on
+		//from the last song's, all that changes is the clock and the screen
+		if(block.flags & Pipeline::kTrackStart){
+			playlist.SetPosition(block.arg);
+			xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+			mp3.ResetPlayTime();
+			xSemaphoreGive(mp3_mutex);
+			playlist.GetPath(block.arg, name);
+			SetPlaying(block.arg, name, block.pos);
+			ShowPlaying(name);
+			playlist.Save();
+		}
+		//Once we're told to stop, just hand buffers back until the reader notices.
+		//Same for the old audio still in the pipeline after a seek
+		if(!reader_stop && !seeking && !FeedDecoder(block.data, block.len)){
+			reader_stop = 1;
+		}
+		//A 32 bit write, the checkpoint task can read it any time
+		if(!reader_stop && !seeking){
+			fed_pos = block.pos + block.len;
+		}
+		pipeline.Release(&block);
+		if(first){
+			LOG_INFO("Skip to first audio: %lu ms, from the %s", (xTaskGetTickCount() - skip_tick) * portTICK_PERIOD_MS,
+			         (block.flags & Pipeline::kCached) ? "flash" : serial_mode ? "serial port" : "SD card");
+			first = 0;
+		}
+	}while(!(block.flags & Pipeline::kEnd));
+	//Report how well the reader kept up
+	pipeline.LogWatermarks();
+	flash_cache.LogStats();
 	//Gracefully end the song and close the file when it's done
+	if(serial_mode){
+		serial_source.Stop();
+	}
+	xSemaphoreTake(sd_mutex, portMAX_DELAY);
 	mp3.StopSong();
-	//Stop the button state machine
-	vTaskDelete(xEventListenerHandle);
-	//Stop flopping the fish
-	vTaskDelete(xFishFlopHandle);
-	//Scan the SD card again, prompt the user to choose another song
-	xTaskCreate(xScanDir, "scan_task", SCAN_TASK_RAM, NULL, tskIDLE_PRIORITY + 2, NULL);
-	//Delete this task
-	vTaskDelete(NULL);
-}
-
-//Pause Song
-void xPauseSong(void *p){
-	//Toggle the pause variable
-	mp3.TogglePause();
-	//If the song is paused, show the pause icon
-	if(mp3.CheckPaused()){
-		oled_terminal.SetCursor(0, 7);
-		oled_terminal.printf("||" );
-	}
-	//If the song is playing, show the play icon
-	else{
-		oled_terminal.SetCursor(0, 7);
-		oled_terminal.printf("> " );
-	}
-	//Delete this task
-	vTaskDelete(NULL);
-}
-
-//Massive state machine for the buttons during song playback.
-//The function key doubles the amount of functions that the other buttons
-//can do. For example:
-//Pause = Pause Song
-//Prev = Previous Song
-//Next = Next Song
-//Pause + Func = Exit to Menu
-//Prev + Func = Decrease Bass
-//Next + Func = Increase Bass
-//Sel = Function Toggle
-void xEventListener(void *p){
-	//Quick delay to wait for switch to debounce
-	vTaskDelay(400);
-	while(1){
-			//Poll the buttons once every tenth of a second
-			vTaskDelay(100);
-			//Try to take the next button's semaphore
-			if(xSemaphoreTake(next_sem, 0)){
-				if(func_key){
-					//Increase the song id (or loop it back to zero)
-					if(song_id >= num_songs - 1){
-						song_id = 0;
-					}
-					else{
-						song_id++;
-					}
-					//Wait for the SD card to be free
-					if(xSemaphoreTake(sd_mutex, 1000)){
-						//Clear the OLED screen
-						oled_terminal.Clear();
-						//Kill the xPlaySong task
-						vTaskDelete(xPlaySongHandle);
-						//Close the mp3 file
-						mp3.StopSong();
-						//Release the SD card mutex
-						xSemaphoreGive(sd_mutex);
-						//Start a new xPlaySong, this time with the new song_id
-						xTaskCreate(xPlaySong, "playsong_task", SONG_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, &xPlaySongHandle);
-						//Delete the xEventListener task, xPlaySong will spawn a new one
-						vTaskDelete(NULL);
-					}
-				}
-				else{
-					//Don't interrupt an MP3 transfer
-					xSemaphoreTake(mp3_mutex, 1000);
-					//Increase the bass by one
-					mp3.SetBass(mp3.GetBass() + 1);
-					//Give back the mutex
-					xSemaphoreGive(mp3_mutex);
-				}
+	xSemaphoreGive(sd_mutex);
+	return 1;
+}
+
+//Plays a song every time the controller says so, then goes back to sleep
+void xPlaySong(void* p){
+	uint32_t bits;
+	for(;;){
+		//Sleep until the controller starts a song. Throw away any leftover DREQ
+		//or stop bits while we're at it
+		xTaskNotifyWait(0, 0xFFFFFFFF, &bits, portMAX_DELAY);
+		if(!(bits & NOTIFY_PLAY)){
+			continue;
+		}
+		uint16_t gen = song_gen;
+		bool ok = PlayOneSong();
+		//Either hand the controller its stop, or tell it the song is over. Done
+		//with the scheduler suspended so StopSong sees one or the other
+		SetPlaying(0, NULL, 0);
+		vTaskSuspendAll();
+		song_active = 0;
+		if(stop_requested){
+			stop_requested = 0;
+			xSemaphoreGive(song_stopped);
+		}
+		else{
+			PostEvent(ok ? PlayerFsm::kTrackEnd : PlayerFsm::kTrackFailed, gen);
+		}
+		xTaskResumeAll();
+	}
+}
+
+//Flop the fish while a song is playing, sleep the rest of the time
+void xFishFlop(void* p){
+	for(;;){
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		while(fish_on){
+			body.Forward(300);
+			body.Backward(150);
+		}
+	}
+}
+
+//Write down where the player is every few seconds, so it can pick back up
+//after the power goes out, and fill the flash cache in between. The flash is
+//only written when something changed, and the SD card's bus is never held
+//while the flash is busy, so this never holds up the reader
+void xCheckpoint(void* p){
+	static ResumeLog::Record record;
+	//Wait for the scanner to find the last checkpoint
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	for(;;){
+		//The controller wakes us early when a song stops
+		ulTaskNotifyTake(pdTRUE, CHECKPOINT_PERIOD);
+		memset(&record, 0, sizeof(record));
+		vTaskSuspendAll();
+		bool playing = playing_path[0];
+		//Paths too long for a checkpoint get cut off, and won't resume
+		strncpy(record.path, playing_path, sizeof(record.path) - 1);
+		record.position = playing_pos;
+		record.offset = fed_pos;
+		xTaskResumeAll();
+		record.flags = (playing ? ResumeLog::kPlaying : 0) | (continuous ? ResumeLog::kContinuous : 0);
+		record.volume = volume_level;
+		record.bass = bass_level;
+		xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+		record.ms = playing ? mp3.GetPlayTime() * 1000UL : 0;
+		xSemaphoreGive(mp3_mutex);
+		resume.Append(&record);
+		//Copy whatever the flash cache has been asked for. Each copy takes a
+		//while, but the bus is free most of that time
+		while(flash_cache.Fill()){
+			continue;
+		}
+	}
+}
+
+//Fill in the status the remote control and I2C masters see
+void GetRemoteStatus(remote::Status* status){
+	status->state = player_fsm.GetState();
+	status->paused = mp3.CheckPaused();
+	status->position = playing_pos;
+	status->count = playlist.GetCount();
+	status->underruns = pipeline.GetUnderruns();
+	status->volume = volume_level;
+	status->bass = bass_level;
+	//The play time is the only thing the decoder has to be asked for, and
+	//only while there's a song
+	status->play_time = 0;
+	if(playing_path[0]){
+		xSemaphoreTake(mp3_mutex, portMAX_DELAY);
+		status->play_time = mp3.GetPlayTime();
+		xSemaphoreGive(mp3_mutex);
+	}
+}
+
+//Carry out one remote control command. Anything that starts or moves the song
+//is handed to the controller, the sound settings are set right here
+//@param op: The command
+//@param args: Its args, still in the frame
+//@param len: The number of bytes of args
+//@param period: How often to send status, changed by kOpSubscribe
+//@return remote::Result: How it went
+remote::Result RunRemoteCommand(uint8_t op, const uint8_t* args, uint8_t len, TickType_t* period){
+	//Paths get looked up with a terminator, and don't fit on the stack
+	static char path[LIBRARY_NAME_SIZE];
+	uint16_t id;
+	int16_t jump;
+	uint16_t ms;
+	switch(op){
+		case remote::kOpPlay :
+			if(len == 0 || len >= LIBRARY_NAME_SIZE){
+				return remote::kBadArgs;
 			}
-			//Try to take the prev button's semaphore
-			if(xSemaphoreTake(prev_sem, 0)){
-				if(func_key){
-					//Decrease the song ID (or loop it back to the end)
-					if(song_id <= 0){
-						song_id = num_songs - 1;
-					}
-					else{
-						song_id--;
-					}
-					//Wait for the SD card to be free
-					if(xSemaphoreTake(sd_mutex, 1000)){
-						//Clear the OLED screen
-						oled_terminal.Clear();
-						//Kill the xPlaySong task
-						vTaskDelete(xPlaySongHandle);
-						//Close the mp3 file
-						mp3.StopSong();
-						//Release the SD card mutex
-						xSemaphoreGive(sd_mutex);
-						//Start a new xPlaySong, this time with the new song_id
-						xTaskCreate(xPlaySong, "playsong_task", SONG_TASK_RAM, NULL, tskIDLE_PRIORITY + 1, &xPlaySongHandle);
-						//Delete the xEventListener task, xPlaySong will spawn a new one
-						vTaskDelete(NULL);
-					}
-				}
-				else{
-					//Don't interrupt an MP3 Transfer
-					xSemaphoreTake(mp3_mutex, 1000);
-					//Decrease the bass by one
-					mp3.SetBass(mp3.GetBass() - 1);
-					//Give back the mutex
-					xSemaphoreGive(mp3_mutex);
-				}
+			//The library is being rebuilt
+			if(player_fsm.GetState() == PlayerFsm::kScanning){
+				return remote::kBusy;
 			}
+			memcpy(path, args, len);
+			path[len] = 0;
+			if(!library.Find(path, &id)){
+				return remote::kNotFound;
+			}
+			return PostEvent(PlayerFsm::kRemotePlay, id) ? remote::kOk : remote::kBusy;
 
-			if(xSemaphoreTake(sel_sem, 0)){
-				func_key = !func_key;
-				func_led.Set(func_key);
+		case remote::kOpSeek :
+			if(len != sizeof(jump)){
+				return remote::kBadArgs;
 			}
-			if(xSemaphoreTake(pause_sem, 0)){
-				if(func_key){
-					xTaskCreate(xPauseSong, "pausesong_task", SONG_TASK_RAM, NULL, tskIDLE_PRIORITY + 3, NULL);
-				}
-				else{
-					//Toggle function and shut off the LED
-					func_key = !func_key;
-					func_led.Set(func_key);
-					//Stop the song machine
-					vTaskDelete(xPlaySongHandle);
-					//Stop floppin the fish
-					vTaskDelete(xFishFlopHandle);
-					//Scan the SD card again, prompt the user to choose another song
-					xTaskCreate(xScanDir, "scan_task", SCAN_TASK_RAM, NULL, tskIDLE_PRIORITY + 2, NULL);
-					//Delete this task
-					vTaskDelete(NULL);
+			memcpy(&jump, args, sizeof(jump));
+			return PostEvent(PlayerFsm::kRemoteSeek, (uint16_t)jump) ? remote::kOk : remote::kBusy;
+
+		case remote::kOpVolume :
+		case remote::kOpBass :
+			if(len != 1 || (op == remote::kOpBass && args[0] > 15)){
+				return remote::kBadArgs;
+			}
+			if(op == remote::kOpVolume){
+				SetVolume(args[0]);
+			}
+			else{
+				SetBass(args[0]);
+			}
+			return remote::kOk;
+
+		case remote::kOpStatus :
+			return len ? remote::kBadArgs : remote::kOk;
+
+		case remote::kOpSubscribe :
+			if(len != sizeof(ms)){
+				return remote::kBadArgs;
+			}
+			memcpy(&ms, args, sizeof(ms));
+			*period = pdMS_TO_TICKS(ms);
+			return remote::kOk;
+
+		default :
+			return remote::kUnknownOp;
+	}
+}
+
+//Answer the remote control. Every frame from the host gets one frame back,
+//with an ack for each command in it. Status goes out on a timer as well if
+//the host has subscribed. Sits at the bottom so it never gets in the way of
+//playback
+void xRemote(void* p){
+	static uint8_t reply[REMOTE_MAX_PAYLOAD];
+	remote::Status status;
+	//0 while nobody's subscribed
+	TickType_t period = 0;
+	TickType_t last = xTaskGetTickCount();
+	for(;;){
+		//Sleep until a frame comes in or the next status is due
+		TickType_t wait = portMAX_DELAY;
+		if(period){
+			TickType_t since = xTaskGetTickCount() - last;
+			wait = (since < period) ? period - since : 0;
+		}
+		const uint8_t* payload;
+		int16_t len = remote_link.Receive(&payload, wait);
+		if(len >= 0){
+			uint16_t used = 0;
+			uint16_t pos = 0;
+			uint8_t op;
+			const uint8_t* args;
+			uint8_t args_len;
+			//Commands past what the answer has room for are dropped without an ack.
+			//Every command needs room for its ack, and maybe a status record too
+			while(used + REMOTE_ACK_SIZE + REMOTE_RECORD_HEADER + sizeof(status) <= REMOTE_MAX_PAYLOAD &&
+			      remote::NextRecord(payload, len, &pos, &op, &args, &args_len)){
+				uint8_t ack[2] = {op, RunRemoteCommand(op, args, args_len, &period)};
+				remote::AddRecord(reply, &used, remote::kOpAck, ack, sizeof(ack));
+				if(op == remote::kOpStatus && ack[1] == remote::kOk){
+					GetRemoteStatus(&status);
+					remote::AddRecord(reply, &used, remote::kOpStatusReport, &status, sizeof(status));
 				}
 			}
-			//Yield the task once all the buttons have been polled
-			taskYIELD();
+			remote_link.Release();
+			remote_link.Send(reply, used);
+		}
+		if(period && xTaskGetTickCount() - last >= period){
+			last = xTaskGetTickCount();
+			uint16_t used = 0;
+			GetRemoteStatus(&status);
+			remote::AddRecord(reply, &used, remote::kOpStatusReport, &status, sizeof(status));
+			remote_link.Send(reply, used);
+		}
 	}
 }
 
-void xFishFlop(void* p){
-	while(true){
-		body.Forward(300);
-		body.Backward(150);
-	}
-}
-//These are the button ISR's. They're tied to the falling edges of buttons so
-//they trigger on button release.
-//When the button is pressed, signal to the rest of the program by giving that
-//button's semaphore
-void NextButtonISR(){xSemaphoreGiveFromISR(next_sem, NULL);}
-void PrevButtonISR(){xSemaphoreGiveFromISR(prev_sem, NULL);}
-void SelButtonISR(){xSemaphoreGiveFromISR(sel_sem, NULL);}
-void PauseButtonISR(){xSemaphoreGiveFromISR(pause_sem, NULL);}
+//I2C writes land here, in the ISR. Each one just becomes an event for the
+//controller, so a master can't hold up playback, and the ISR never waits. A
+//write only counts for the register it starts at
+void ControlWrite(uint8_t reg, const uint8_t* data, uint8_t len){
+	PlayerMsg msg = {PlayerFsm::kRemoteVolume, data[0]};
+	switch(reg){
+		case control::kPlaying :
+			msg.event = data[0] ? PlayerFsm::kRemoteResume : PlayerFsm::kRemotePause;
+			break;
+		case control::kVolume :
+			break;
+		case control::kBass :
+			//The decoder would just keep the bottom 4 bits. Drop it, like the UART
+			//remote does
+			if(data[0] > 15){
+				return;
+			}
+			msg.event = PlayerFsm::kRemoteBass;
+			break;
+		case control::kTrack :
+			if(len < 2){
+				return;
+			}
+			msg.event = PlayerFsm::kRemotePlay;
+			msg.arg = data[0] | (data[1] << 8);
+			break;
+		default :
+			return;
+	}
+	BaseType_t woken = pdFALSE;
+	xQueueSendFromISR(player_queue, &msg, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+//Copy the player's status into the I2C registers and publish it all at once.
+//This is the only task that Sets them. Runs on a timer, and whenever the
+//controller has done something
+void xPublishStatus(void* p){
+	remote::Status status;
+	uint8_t sequence = 0;
+	const uint8_t total = PIPE_BUF_COUNT;
+	control_regs.Set(control::kBufferTotal, &total, 1);
+	for(;;){
+		GetRemoteStatus(&status);
+		uint8_t playing = status.state == PlayerFsm::kPlaying || status.state == PlayerFsm::kFuncPlaying;
+		uint8_t full = pipeline.GetFullCount();
+		uint8_t low = pipeline.GetLowWatermark();
+		sequence++;
+		control_regs.Set(control::kState, &status.state, 1);
+		control_regs.Set(control::kPlaying, &playing, 1);
+		control_regs.Set(control::kVolume, &status.volume, 1);
+		control_regs.Set(control::kBass, &status.bass, 1);
+		control_regs.Set(control::kTrack, &status.position, 2);
+		control_regs.Set(control::kTrackCount, &status.count, 2);
+		control_regs.Set(control::kDecodeTime, &status.play_time, 2);
+		control_regs.Set(control::kBufferFull, &full, 1);
+		control_regs.Set(control::kBufferLow, &low, 1);
+		control_regs.Set(control::kSequence, &sequence, 1);
+		control_regs.Set(control::kUnderruns, &status.underruns, 2);
+		control_regs.Publish();
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONTROL_STATUS_PERIOD));
+	}
+}
+
+//Every button edge lands here. The debouncer takes it from there
+void ButtonISR(){buttons.WakeFromISR();}
+
+//The debouncer calls this from the timer task with a finished gesture. Hand it
+//to the controller
+void ButtonGesture(uint8_t button, Buttons::Gesture gesture){
+	PostEvent(PlayerFsm::ButtonEvent(button, gesture));
+}
+
+//DREQ goes high when the decoder has room for at least 32 more bytes. Wake up
+//xPlaySong so it can send the next block
+void DreqISR(){
+	BaseType_t woken = pdFALSE;
+	//The interrupt is registered before the tasks are created
+	if(xPlaySongHandle != NULL){
+		xTaskNotifyFromISR(xPlaySongHandle, NOTIFY_DREQ, eSetBits, &woken);
+	}
+	portYIELD_FROM_ISR(woken);
+}
@@ -0,0 +1,163 @@
+#include "nggpdma.hpp"
+
+GPDMA::Handler GPDMA::handlers[kChannels];
+bool GPDMA::initialized = 0;
+
+LPC_GPDMACH_TypeDef *DMA_CH[GPDMA::kChannels] = { LPC_GPDMACH0,
+                                                  LPC_GPDMACH1,
+                                                  LPC_GPDMACH2,
+                                                  LPC_GPDMACH3,
+                                                  LPC_GPDMACH4,
+                                                  LPC_GPDMACH5,
+                                                  LPC_GPDMACH6,
+                                                  LPC_GPDMACH7};
+
+//CControl fields
+#define DMA_SBSIZE(x)   ((x) << 12)
+#define DMA_DBSIZE(x)   ((x) << 15)
+#define DMA_SWIDTH(x)   ((x) << 18)
+#define DMA_DWIDTH(x)   ((x) << 21)
+#define DMA_SI          (1 << 26)
+#define DMA_DI          (1 << 27)
+#define DMA_TC_INT      (1UL << 31)
+//CConfig fields
+#define DMA_ENABLE      (1 << 0)
+#define DMA_SRC_PER(x)  ((x) << 1)
+#define DMA_DST_PER(x)  ((x) << 6)
+#define DMA_M2P         (0b001 << 11)
+#define DMA_P2M         (0b010 << 11)
+#define DMA_IE          (1 << 14)
+#define DMA_ITC         (1 << 15)
+#define DMA_ACTIVE      (1 << 17)
+#define DMA_HALT        (1 << 18)
+
+void GPDMA::Init(){
+  //Power on the GPDMA
+  LPC_SC->PCONP |= (1 << 29);
+  //Clear out anything left over
+  LPC_GPDMA->IntTCClear = 0xFF;
+  LPC_GPDMA->IntErrClr = 0xFF;
+  //Enable the controller, little endian
+  LPC_GPDMA->Config = (1 << 0);
+  //Send every channel interrupt through our ISR
+  RegisterIsr(DMA_IRQn, DmaIsr);
+  NVIC_EnableIRQ(DMA_IRQn);
+  initialized = 1;
+}
+
+int8_t GPDMA::AllocChannel(Handler handler){
+  if(!initialized){
+    Init();
+  }
+  //Channel 0 has the highest priority, hand them out in order
+  for(uint8_t i = 0; i < kChannels; i++){
+    if(handlers[i] == NULL){
+      handlers[i] = handler;
+      LOG_DEBUG("Allocated DMA channel %d", i);
+      return i;
+    }
+  }
+  LOG_ERROR("No free DMA channels!");
+  return -1;
+}
+
+void GPDMA::FreeChannel(uint8_t channel){
+  Stop(channel);
+  handlers[channel] = NULL;
+}
+
+void GPDMA::SelectRequest(Request req){
+  //Only the shared request lines need DMAREQSEL set
+  if(req & kAlt){
+    LPC_SC->DMAREQSEL |= (1 << (req & ~kAlt));
+  }
+}
+
+void GPDMA::Start(uint8_t channel, const volatile void *src,
+                  volatile void *dst, uint32_t control, uint32_t config,
+                  uint32_t lli){
+  LPC_GPDMACH_TypeDef *ch = DMA_CH[channel];
+  //Make sure the channel is off and clear any old interrupts
+  ch->CConfig = 0;
+  LPC_GPDMA->IntTCClear = (1 << channel);
+  LPC_GPDMA->IntErrClr = (1 << channel);
+  ch->CSrcAddr = (uint32_t)src;
+  ch->CDestAddr = (uint32_t)dst;
+  ch->CLLI = lli;
+  ch->CControl = control;
+  //Unmask the error and terminal count interrupts and go
+  ch->CConfig = config | DMA_IE | DMA_ITC | DMA_ENABLE;
+}
+
+void GPDMA::MemToPeriph(uint8_t channel, const volatile void *src,
+                        volatile void *dst, uint16_t len, Width width,
+                        Burst burst, Request req){
+  SelectRequest(req);
+  uint8_t per = req & ~kAlt;
+  uint32_t control = (len & kMaxTransfer) | DMA_SBSIZE(burst) | DMA_DBSIZE(burst) |
+                     DMA_SWIDTH(width) | DMA_DWIDTH(width) | DMA_SI | DMA_TC_INT;
+  Start(channel, src, dst, control, DMA_DST_PER(per) | DMA_M2P);
+}
+
+void GPDMA::PeriphToMem(uint8_t channel, const volatile void *src,
+                        volatile void *dst, uint16_t len, Width width,
+                        Burst burst, Request req, bool increment){
+  SelectRequest(req);
+  uint8_t per = req & ~kAlt;
+  uint32_t control = (len & kMaxTransfer) | DMA_SBSIZE(burst) | DMA_DBSIZE(burst) |
+                     DMA_SWIDTH(width) | DMA_DWIDTH(width) | DMA_TC_INT;
+  if(increment){
+    control |= DMA_DI;
+  }
+  Start(channel, src, dst, control, DMA_SRC_PER(per) | DMA_P2M);
+}
+
+void GPDMA::PeriphToRing(uint8_t channel, const volatile void *src, uint8_t *ring,
+                         uint16_t half, Lli *lli, Request req){
+  SelectRequest(req);
+  uint8_t per = req & ~kAlt;
+  //Every half ends with a terminal count interrupt
+  uint32_t control = (half & kMaxTransfer) | DMA_SBSIZE(kBurst1) | DMA_DBSIZE(kBurst1) |
+                     DMA_SWIDTH(kByte) | DMA_DWIDTH(kByte) | DMA_DI | DMA_TC_INT;
+  lli[0].src = (uint32_t)src;
+  lli[0].dst = (uint32_t)ring;
+  lli[0].next = (uint32_t)&lli[1];
+  lli[0].control = control;
+  lli[1].src = (uint32_t)src;
+  lli[1].dst = (uint32_t)(ring + half);
+  lli[1].next = (uint32_t)&lli[0];
+  lli[1].control = control;
+  //The channel starts on the first half itself, then follows the links
+  Start(channel, src, ring, control, DMA_SRC_PER(per) | DMA_P2M, (uint32_t)&lli[1]);
+}
+
+uint32_t GPDMA::GetDestAddr(uint8_t channel){
+  return DMA_CH[channel]->CDestAddr;
+}
+
+void GPDMA::Stop(uint8_t channel){
+  DMA_CH[channel]->CConfig &= ~DMA_ENABLE;
+  LPC_GPDMA->IntTCClear = (1 << channel);
+  LPC_GPDMA->IntErrClr = (1 << channel);
+}
+
+bool GPDMA::IsActive(uint8_t channel){
+  return LPC_GPDMA->EnbldChns & (1 << channel);
+}
+
+void GPDMA::DmaIsr(){
+  uint32_t tc = LPC_GPDMA->IntTCStat;
+  uint32_t err = LPC_GPDMA->IntErrStat;
+  //Clear everything we're about to service
+  LPC_GPDMA->IntTCClear = tc;
+  LPC_GPDMA->IntErrClr = err;
+  uint32_t pending = tc | err;
+  //Same trick as the GPIO handler, find the highest pending channel with CLZ
+  while(pending){
+    uint8_t channel = 31 - __builtin_clz(pending);
+    pending &= ~(1 << channel);
+    if(handlers[channel] != NULL){
+      handlers[channel](channel, err & (1 << channel));
+    }
+  }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "L0_LowLevel/LPC40xx.h"
+#include "L0_LowLevel/interrupt.hpp"
+#include "utility/log.hpp"
+
+#include <cstdint>
+
+//A thin wrapper around the LPC40xx General Purpose DMA controller. Drivers
+//grab a channel, start transfers on it, and get a callback from the DMA ISR
+//when the transfer is done.
+class GPDMA{
+public:
+  static constexpr uint8_t kChannels = 8;
+  //The biggest transfer a single channel can do without a linked list
+  static constexpr uint16_t kMaxTransfer = 0xFFF;
+
+  //Width of each element the DMA moves
+  enum Width : uint8_t
+  {
+    kByte     = 0b000,
+    kHalfWord = 0b001,
+    kWord     = 0b010
+  };
+
+  //The number of elements moved per DMA request
+  enum Burst : uint8_t
+  {
+    kBurst1 = 0b000,
+    kBurst4 = 0b001,
+    kBurst8 = 0b010
+  };
+
+  //DMA request lines (UM10562 Table 687). Lines with kAlt set are shared, and
+  //need their DMAREQSEL bit set to select the peripheral listed here
+  enum Request : uint8_t
+  {
+    kAlt      = (1 << 7),
+    kSsp0Tx   = 1,
+    kSsp0Rx   = 2,
+    kSsp1Tx   = 3,
+    kSsp1Rx   = 4,
+    kSsp2Tx   = 5,
+    kSsp2Rx   = 6,
+    kUart3Tx  = 9  | kAlt,
+    kUart3Rx  = 10 | kAlt,
+    kUart2Tx  = 13,
+    kUart2Rx  = 14
+  };
+
+  //One link of a linked list transfer. The DMA loads these on its own, so
+  //they have to stay put for as long as the transfer runs
+  struct Lli{
+    uint32_t src;
+    uint32_t dst;
+    uint32_t next;
+    uint32_t control;
+  };
+
+  //Called from the DMA ISR when a channel finishes or fails
+  //@param channel: The channel that caused the interrupt
+  //@param error: True if the transfer failed
+  typedef void (*Handler)(uint8_t channel, bool error);
+
+  //Grab a free channel and attach a handler to it. Turns on the DMA
+  //controller the first time it's called.
+  //@return int8_t: The channel number, or -1 if they're all taken
+  static int8_t AllocChannel(Handler handler);
+
+  //Give a channel back
+  static void FreeChannel(uint8_t channel);
+
+  //Start moving memory into a peripheral's FIFO
+  //@param channel: The channel to use
+  //@param src: The memory to read from, it gets incremented
+  //@param dst: The peripheral register to write to
+  //@param len: The number of elements to move, up to kMaxTransfer
+  static void MemToPeriph(uint8_t channel, const volatile void *src,
+                          volatile void *dst, uint16_t len, Width width,
+                          Burst burst, Request req);
+
+  //Start moving data out of a peripheral's FIFO into memory
+  //@param channel: The channel to use
+  //@param src: The peripheral register to read from
+  //@param dst: The memory to write to
+  //@param len: The number of elements to move, up to kMaxTransfer
+  //@param increment: Set to false to throw every element into the same spot
+  static void PeriphToMem(uint8_t channel, const volatile void *src,
+                          volatile void *dst, uint16_t len, Width width,
+                          Burst burst, Request req, bool increment=true);
+
+  //Start filling a ring buffer with bytes from a peripheral's FIFO, forever.
+  //The ring is filled in two halves that link to each other, and the handler
+  //gets called every time a half fills
+  //@param channel: The channel to use
+  //@param src: The peripheral register to read from
+  //@param ring: The memory to fill
+  //@param half: The size of each half, up to kMaxTransfer
+  //@param lli: Two links for the DMA, which have to outlive the transfer
+  static void PeriphToRing(uint8_t channel, const volatile void *src, uint8_t *ring,
+                           uint16_t half, Lli *lli, Request req);
+
+  //Get the address a channel will write to next
+  static uint32_t GetDestAddr(uint8_t channel);
+
+  //Stop a channel, throwing away anything it hasn't moved yet
+  static void Stop(uint8_t channel);
+
+  //Check to see if a channel is still moving data
+  static bool IsActive(uint8_t channel);
+
+private:
+  //Turn on the DMA controller
+  static void Init();
+  //Point a DMA request line at the right peripheral
+  static void SelectRequest(Request req);
+  //Program and enable a channel
+  //@param lli: The link to load once this transfer is done, 0 for none
+  static void Start(uint8_t channel, const volatile void *src,
+                    volatile void *dst, uint32_t control, uint32_t config,
+                    uint32_t lli=0);
+  //Service every channel that has an interrupt pending
+  static void DmaIsr();
+
+  static Handler handlers[kChannels];
+  static bool initialized;
+};
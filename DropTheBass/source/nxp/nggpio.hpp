@@ -111,3 +111,56 @@ private:
   //to it, and calls the interrupt.
   static void gpio_int_handler();
 };
+
+//A GPIO pin that's fixed at compile time. The register block and the pin mask
+//are constants, so SetHigh/SetLow/ReadBool compile down to a single load or
+//store with no table lookups. Use this on hot paths, and the GPIO class for
+//everything else (interrupts, pullups, pins picked at runtime).
+template <uint8_t kPort, uint8_t kPin>
+class FastGPIO{
+public:
+  static_assert(kPort < 6, "Invalid GPIO port");
+  static_assert(kPin < GPIO::kPins, "Invalid GPIO pin");
+  static constexpr uint32_t kMask = (1UL << kPin);
+
+  //Set the pin as an input
+  static inline void SetAsInput(){
+    Regs()->DIR &= ~kMask;
+  }
+
+  //Set the pin as an output
+  static inline void SetAsOutput(){
+    Regs()->DIR |= kMask;
+  }
+
+  //Set the pin output voltage to 3v3
+  static inline void SetHigh(){
+    Regs()->SET = kMask;
+  }
+
+  //Set the pin output voltage to GND
+  static inline void SetLow(){
+    Regs()->CLR = kMask;
+  }
+
+  //Set the pin output based on a bool
+  static inline void Set(bool state){
+    if(state){
+      SetHigh();
+    }
+    else{
+      SetLow();
+    }
+  }
+
+  //Get the state of the GPIO as a bool
+  static inline bool ReadBool(){
+    return Regs()->PIN & kMask;
+  }
+
+private:
+  //The GPIO port register blocks are 0x20 apart, starting at GPIO0
+  static inline LPC_GPIO_TypeDef *Regs(){
+    return (LPC_GPIO_TypeDef *)(LPC_GPIO0_BASE + (kPort * 0x20));
+  }
+};
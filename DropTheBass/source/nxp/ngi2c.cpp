@@ -1,7 +1,6 @@
 #include "ngi2c.hpp"
 
-//Initialize the I2C Memory
-uint8_t I2C::i2c_memory[256] = {0};
+RegisterFile* I2C::regs = NULL;
 
 I2C::I2C(uint8_t address){
   if(address > 0b01111111){
@@ -10,22 +9,24 @@ I2C::I2C(uint8_t address){
   _addr = address;
 }
 
-void I2C::InitI2CSlave(){
+void I2C::InitI2CSlave(RegisterFile* registers){
+  regs = registers;
 	//Note: On reset, all i2c interfaces are enabled. Just to be safe, re-enable them
 	//We're using I2C2 so set PCI2C2, bit 26
 	LPC_SC->PCONP |= (1 << 26);
 
-	//Set the IOCON registers on P0_10 and P0_11 to use I2C2
-	PinconSetFunc(0, 10, 0b010);
-	PinconSetFunc(0, 11, 0b010);
+	//Set the IOCON registers on P4_20 and P4_21 to use I2C2. P0_10 and P0_11
+	//can do I2C2 too, but they're the decoder's chip select and reset
+	PinconSetFunc(4, 20, 0b010);
+	PinconSetFunc(4, 21, 0b010);
 
   //Turn off the pullup/pulldowns
-  PinconPulloff(0, 10);
-  PinconPulloff(0, 11);
+  PinconPulloff(4, 20);
+  PinconPulloff(4, 21);
 
   //Turn on open drain
-  PinconOpendrain(0, 10, true);
-  PinconOpendrain(0, 11, true);
+  PinconOpendrain(4, 20, true);
+  PinconOpendrain(4, 21, true);
 
 	//Setting up slave mode
 	//Bits must be set as follows
@@ -68,59 +69,43 @@ void I2C::InitI2CSlave(){
 }
 
 void I2C::I2CStateHandler(){
-  //The number of bytes we have recieved so far
-  static uint8_t data_index = 0;
-  //The working register
-  static uint8_t reg = 0;
   //The status register
   uint8_t i2cstat = LPC_I2C2->STAT;
-  LPC_I2C2->CONCLR = (Ctrl::kInt);
   switch(i2cstat){
     //Addressed on SLA+W
     case(SRStates::kGotSLAW) :{
-      //Reset the data index back to 0
-      data_index = 0;
+      regs->StartWrite();
       //Send back an ACK
       LPC_I2C2->CONSET = (Ctrl::kAsrtAck);
       break;
     }
     //Got data over SLA+W
     case(SRStates::kSLAWGotData) :{
+      //I2C always sends the register first, the register file sorts out which
+      //byte is which
+      regs->WriteByte(LPC_I2C2->DAT);
       //Send back an ACK
       LPC_I2C2->CONSET = (Ctrl::kAsrtAck);
-      if(data_index == 0){
-        //I2C always sends the register first, so save first recieved byte as
-        //the working register
-        reg = LPC_I2C2->DAT;
-      }
-      else{
-        //If this isn't the first data byte, we're doing a write
-        //Use the first byte sent as the register, write this current byte to it
-        //Use data index as an offest for multi byte writes
-        I2C::i2c_memory[(reg + (data_index - 1))] = LPC_I2C2->DAT;
-      }
-      //Increment the data index
-      data_index++;
       break;
     }
     //Got a Stop or Repeated Start
     case(SRStates::kGotSSr) :{
+      regs->Stop();
+      LPC_I2C2->CONSET = (Ctrl::kAsrtAck);
       break;
     }
     //Master is asking for a byte
     case(STStates::kGotSLAR) :{
       //Send the byte from the previously requested register
-      LPC_I2C2->DAT = I2C::i2c_memory[reg];
-      //Increment the data index
-      data_index++;
+      LPC_I2C2->DAT = regs->StartRead();
+      LPC_I2C2->CONSET = (Ctrl::kAsrtAck);
       break;
     }
     //The master got the byte we transmitted, wants more
     case(STStates::kSentDataACK) :{
-      //Send the next byte offset with the data index
-      LPC_I2C2->DAT = I2C::i2c_memory[reg + (data_index - 1)];
-      //Increment the data index
-      data_index++;
+      //Send the next register
+      LPC_I2C2->DAT = regs->ReadByte();
+      LPC_I2C2->CONSET = (Ctrl::kAsrtAck);
       break;
     }
     //Master got our data, told us not to send any more
@@ -136,4 +121,7 @@ void I2C::I2CStateHandler(){
       break;
     }
   }
+  //Clear SI last. The bus is held until then, and DAT has to be loaded
+  //before it goes
+  LPC_I2C2->CONCLR = (Ctrl::kInt);
 }
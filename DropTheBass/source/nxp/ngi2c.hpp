@@ -5,6 +5,7 @@
 #include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
 #include "L0_LowLevel/interrupt.hpp"
 #include "utility/log.hpp"
+#include "ngregfile.hpp"
 
 #include <iterator>
 
@@ -43,10 +44,14 @@ public:
   };
 
   I2C(uint8_t address);
-  void InitI2CSlave();
+
+  //Start answering as a slave on I2C2
+  //@param registers: The registers masters read and write
+  void InitI2CSlave(RegisterFile* registers);
 
 private:
   static void I2CStateHandler();
-  static uint8_t i2c_memory[256];
+  //The registers the ISR serves. There's only one slave
+  static RegisterFile* regs;
   uint8_t _addr;
 };
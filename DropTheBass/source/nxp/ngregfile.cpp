@@ -0,0 +1,78 @@
+#include "ngregfile.hpp"
+
+#include <string.h>
+
+RegisterFile::RegisterFile(){
+  memset(_banks, 0, sizeof(_banks));
+  memset(_callbacks, 0, sizeof(_callbacks));
+}
+
+void RegisterFile::SetCallback(uint8_t reg, WriteCallback callback){
+  _callbacks[reg] = callback;
+}
+
+void RegisterFile::Set(uint8_t reg, const void* data, uint8_t len){
+  const uint8_t* bytes = (const uint8_t*)data;
+  for(uint8_t i = 0; i < len; i++){
+    _banks[_shadow][(uint8_t)(reg + i)] = bytes[i];
+  }
+}
+
+void RegisterFile::Get(uint8_t reg, void* data, uint8_t len){
+  uint8_t* bytes = (uint8_t*)data;
+  for(uint8_t i = 0; i < len; i++){
+    bytes[i] = _banks[_shadow][(uint8_t)(reg + i)];
+  }
+}
+
+void RegisterFile::Publish(){
+  uint8_t published = _shadow;
+  //Whatever was waiting and never got picked up becomes the new shadow. The
+  //ISR has moved on from it, or never had it
+  _shadow = _ready.exchange(published | kFresh, std::memory_order_acq_rel) & ~kFresh;
+  //Carry everything over so the next Set starts from what's published.
+  //Nobody writes a published bank, so it's safe to copy even if the ISR
+  //picks it up part way through
+  memcpy(_banks[_shadow], _banks[published], sizeof(_banks[0]));
+}
+
+void RegisterFile::StartWrite(){
+  _need_reg = 1;
+  _write_len = 0;
+}
+
+void RegisterFile::WriteByte(uint8_t byte){
+  if(_need_reg){
+    _reg = byte;
+    _need_reg = 0;
+  }
+  else if(_write_len < REGFILE_MAX_WRITE){
+    _write[_write_len++] = byte;
+  }
+}
+
+void RegisterFile::Stop(){
+  //A write with just the register byte only moves the pointer, ex: before a
+  //repeated start and a read
+  if(_write_len){
+    if(_callbacks[_reg] != NULL){
+      _callbacks[_reg](_reg, _write, _write_len);
+    }
+    _reg += _write_len;
+    _write_len = 0;
+  }
+  _need_reg = 0;
+}
+
+uint8_t RegisterFile::StartRead(){
+  //Only swap when there's something new. Otherwise _ready is a bank that
+  //has already been read, and the application might be about to reuse it
+  if(_ready.load(std::memory_order_acquire) & kFresh){
+    _reading = _ready.exchange(_reading, std::memory_order_acq_rel) & ~kFresh;
+  }
+  return ReadByte();
+}
+
+uint8_t RegisterFile::ReadByte(){
+  return _banks[_reading][_reg++];
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//The most bytes a master can write in one go. Anything past this is still
+//acked, but dropped
+#ifndef REGFILE_MAX_WRITE
+#define REGFILE_MAX_WRITE   16
+#endif
+
+//256 byte registers for an I2C slave, shared between the application and the
+//I2C ISR without locks.
+//
+//The registers a master reads are triple buffered. The application writes
+//into its own shadow bank and publishes it with one atomic swap. The ISR
+//takes the newest published bank at the start of every read, and keeps
+//reading from it until the master lets go, so a multi byte value is never
+//half old and half new. Neither side ever waits on the other.
+//
+//What a master writes doesn't land in the banks. It's handed to the callback
+//for the register the write started at, once the master is done, and the
+//application publishes whatever it makes of it. Registers without a callback
+//are read only.
+//
+//Register addresses wrap from 0xFF back to 0x00 in both directions. Nothing
+//in here touches the hardware, so the transaction calls can be driven by
+//hand.
+class RegisterFile{
+public:
+  //Called from the ISR when a master writes
+  //@param reg: The register the write started at
+  //@param data: The bytes written
+  //@param len: How many
+  typedef void (*WriteCallback)(uint8_t reg, const uint8_t* data, uint8_t len);
+
+  RegisterFile();
+
+  //Application: Watch a register for writes. Set these up before the I2C
+  //interrupt is turned on
+  void SetCallback(uint8_t reg, WriteCallback callback);
+
+  //Application: Change registers in the shadow bank. Masters don't see the
+  //change until Publish
+  //@param reg: The first register
+  //@param data: The new values, little endian for anything multi byte
+  //@param len: How many registers
+  void Set(uint8_t reg, const void* data, uint8_t len);
+
+  //Application: Read registers back out of the shadow bank
+  void Get(uint8_t reg, void* data, uint8_t len);
+
+  //Application: Let masters see everything Set since the last Publish, all at
+  //once
+  void Publish();
+
+  //ISR: The master addressed us to write
+  void StartWrite();
+
+  //ISR: The master wrote a byte. The first one picks the register
+  void WriteByte(uint8_t byte);
+
+  //ISR: The master sent a stop or repeated start. Hands a finished write to
+  //its callback
+  void Stop();
+
+  //ISR: The master addressed us to read. Takes the newest published bank
+  //@return uint8_t: The byte to send first
+  uint8_t StartRead();
+
+  //ISR: The master wants the next byte
+  uint8_t ReadByte();
+
+private:
+  //Set on _ready when it holds a bank the ISR hasn't picked up yet
+  static constexpr uint8_t kFresh = 0x80;
+
+  uint8_t _banks[3][256];
+  //The bank the application writes, only touched by the application
+  uint8_t _shadow = 0;
+  //The last published bank, waiting to be picked up. Swapped by both sides
+  std::atomic<uint8_t> _ready{1};
+  //The bank the ISR reads, only touched by the ISR
+  uint8_t _reading = 2;
+
+  WriteCallback _callbacks[256];
+
+  //The transaction in progress. ISR only
+  //The register the next byte goes to or comes from
+  uint8_t _reg = 0;
+  //True until the register byte of a write shows up
+  bool _need_reg = 0;
+  uint8_t _write[REGFILE_MAX_WRITE];
+  uint8_t _write_len = 0;
+};
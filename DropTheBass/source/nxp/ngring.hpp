@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//A lock free ring of bytes for exactly one producer and one consumer, ex: an
+//ISR and a task. The producer only ever moves the head and the consumer only
+//ever moves the tail, so neither side needs to turn interrupts off.
+//@param kSize: The size of the ring. Has to be a power of 2, and one byte is
+//always left empty to tell a full ring from an empty one
+template<uint16_t kSize>
+class Ring{
+  static_assert(kSize >= 2 && (kSize & (kSize - 1)) == 0, "The ring size has to be a power of 2");
+public:
+  //Producer: Add a byte
+  //@return bool: False if the ring is full and the byte was dropped
+  bool Push(uint8_t byte){
+    uint16_t head = _head.load(std::memory_order_relaxed);
+    uint16_t next = (head + 1) & (kSize - 1);
+    if(next == _tail.load(std::memory_order_acquire)){
+      return 0;
+    }
+    _buf[head] = byte;
+    //Publish the byte before the new head
+    _head.store(next, std::memory_order_release);
+    return 1;
+  }
+
+  //Consumer: Take a byte
+  //@param byte: Filled in with the byte
+  //@return bool: False if the ring is empty
+  bool Pop(uint8_t *byte){
+    uint16_t tail = _tail.load(std::memory_order_relaxed);
+    if(tail == _head.load(std::memory_order_acquire)){
+      return 0;
+    }
+    *byte = _buf[tail];
+    _tail.store((tail + 1) & (kSize - 1), std::memory_order_release);
+    return 1;
+  }
+
+  //Consumer: Get the bytes waiting without taking them. Hands back the run up
+  //to the end of the buffer, so a wrapped ring takes two calls
+  //@param data: Filled in with a pointer to the oldest byte
+  //@return uint16_t: How many bytes are there in a row
+  uint16_t Peek(const uint8_t **data){
+    uint16_t tail = _tail.load(std::memory_order_relaxed);
+    uint16_t head = _head.load(std::memory_order_acquire);
+    *data = &_buf[tail];
+    return (head >= tail) ? head - tail : kSize - tail;
+  }
+
+  //Consumer: Throw away bytes that were looked at with Peek
+  //@param len: How many, no more than Peek handed back
+  void Skip(uint16_t len){
+    uint16_t tail = _tail.load(std::memory_order_relaxed);
+    _tail.store((tail + len) & (kSize - 1), std::memory_order_release);
+  }
+
+  //Get the number of bytes waiting. Either side can call this, the answer is
+  //only a snapshot
+  uint16_t GetCount(){
+    return (_head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire)) & (kSize - 1);
+  }
+
+  //Get the number of bytes that can still be added
+  uint16_t GetFree(){
+    return kSize - 1 - GetCount();
+  }
+
+  //Check to see if there's nothing waiting
+  bool IsEmpty(){
+    return GetCount() == 0;
+  }
+
+  //Throw everything away. Only call this when neither side is running
+  void Reset(){
+    _head.store(0, std::memory_order_relaxed);
+    _tail.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  uint8_t _buf[kSize];
+  std::atomic<uint16_t> _head{0};
+  std::atomic<uint16_t> _tail{0};
+};
@@ -5,13 +5,21 @@ volatile uint32_t* SSP_SR[3]    = {&LPC_SSP0->SR,   &LPC_SSP1->SR,    &LPC_SSP2-
 volatile uint32_t* SSP_CR0[3]   = {&LPC_SSP0->CR0,  &LPC_SSP1->CR0,   &LPC_SSP2->CR0};
 volatile uint32_t* SSP_CR1[3]   = {&LPC_SSP0->CR1,  &LPC_SSP1->CR1,   &LPC_SSP2->CR1};
 volatile uint32_t* SSP_CPSR[3]  = {&LPC_SSP0->CPSR, &LPC_SSP1->CPSR,  &LPC_SSP2->CPSR};
+volatile uint32_t* SSP_DMACR[3] = {&LPC_SSP0->DMACR, &LPC_SSP1->DMACR, &LPC_SSP2->DMACR};
+
+SSP *SSP::dma_owner[GPDMA::kChannels];
+uint16_t SSP::dma_sink;
 
 SSP::SSP(uint8_t data_size_select, FrameModes format, uint8_t divide, uint8_t ssp_num){
   _dss = data_size_select - 1;
   _ssp_num = ssp_num;
   _format = format;
   _div = divide;
-
+  _scr = 1;
+  _dma_tx = -1;
+  _dma_rx = -1;
+  _dma_done = NULL;
+  _dma_callback = NULL;
 
   LOG_DEBUG("scr = %b", scr);
   LOG_DEBUG("dss = %b", _dss);
@@ -22,7 +30,7 @@ SSP::SSP(uint8_t data_size_select, FrameModes format, uint8_t divide, uint8_t ss
 
 void SSP::Init(){
   uint8_t form = 0;
-  uint16_t scr = (0b01 << 8);
+  uint16_t scr = (_scr << 8);
 
   switch (_format)
   {
@@ -150,6 +158,61 @@ void SSP::Recv(uint8_t *buf, uint32_t len){
   }
 }
 
+template <typename T>
+void SSP::Burst(const T *buf, uint32_t len){
+  //I'm the TRASHMAN. I throw TRASH all over the ring! And then, I start eatin GARBAGE
+  uint16_t trashman = 0;
+  uint32_t sent = 0;
+  uint32_t trashed = 0;
+  //Start with an empty receive FIFO so every frame we trash is one of ours
+  while(!RFIFOIsEmpty()){
+    trashman = *SSP_DR[GetPort()];
+  }
+  while(trashed < len){
+    uint8_t status = GetStatus();
+    //Keep pushing frames while there's room. Never have more than a FIFO's
+    //worth in flight, or the receive FIFO would overrun
+    if(sent < len && (status & (1 << 1)) && (sent - trashed) < kFifoDepth){
+      *SSP_DR[GetPort()] = buf[sent];
+      sent++;
+    }
+    //Trash garbage frames as they show up
+    if(status & (1 << 2)){
+      trashman = *SSP_DR[GetPort()];
+      trashed++;
+    }
+  }
+}
+
+void SSP::SendBurst(const uint16_t *buf, uint32_t len){
+  Burst(buf, len);
+}
+
+void SSP::SendBurst(const uint8_t *buf, uint32_t len){
+  Burst(buf, len);
+}
+
+void SSP::RecvBurst(uint8_t *buf, uint32_t len, uint8_t fill){
+  uint32_t sent = 0;
+  uint32_t got = 0;
+  //Start with an empty receive FIFO so every frame we keep is one of ours
+  while(!RFIFOIsEmpty()){
+    buf[0] = *SSP_DR[GetPort()];
+  }
+  while(got < len){
+    uint8_t status = GetStatus();
+    //Same as Burst, never more than a FIFO's worth in flight
+    if(sent < len && (status & (1 << 1)) && (sent - got) < kFifoDepth){
+      *SSP_DR[GetPort()] = fill;
+      sent++;
+    }
+    if(status & (1 << 2)){
+      buf[got] = *SSP_DR[GetPort()];
+      got++;
+    }
+  }
+}
+
 //Send a single packet, recieve a single packet
 uint16_t SSP::Transfer(uint16_t send){
   uint16_t buf;
@@ -177,6 +240,11 @@ bool SSP::TFIFOIsEmpty(){
   return GetStatus() & (1 << 0);
 }
 
+bool SSP::TFIFOIsNotFull(){
+  //The 1st bit is the TNF bit
+  return GetStatus() & (1 << 1);
+}
+
 void SSP::BusyRFIFOWait(){
   while(RFIFOIsEmpty()){
     continue;
@@ -194,3 +262,169 @@ void SSP::BusyWait(){
 uint8_t SSP::GetPort(){
   return _ssp_num;
 }
+
+void SSP::SetDataSize(uint8_t data_size_select){
+  uint8_t dss = data_size_select - 1;
+  if(dss == _dss){
+    return;
+  }
+  _dss = dss;
+  //Let the last frame go out, then turn the SSP off while we change the format
+  BusyWait();
+  *SSP_CR1[GetPort()] &= ~(1 << 1);
+  *SSP_CR0[GetPort()] = (*SSP_CR0[GetPort()] & ~0x0F) | _dss;
+  *SSP_CR1[GetPort()] |= (1 << 1);
+}
+
+SSP::Config SSP::GetConfig(){
+  Config config = {*SSP_CR0[GetPort()], *SSP_CPSR[GetPort()]};
+  return config;
+}
+
+void SSP::SetConfig(Config config){
+  //Let the last frame go out, then turn the SSP off while we change the format
+  BusyWait();
+  *SSP_CR1[GetPort()] &= ~(1 << 1);
+  *SSP_CR0[GetPort()] = config.cr0;
+  *SSP_CPSR[GetPort()] = config.cpsr;
+  *SSP_CR1[GetPort()] |= (1 << 1);
+  _dss = config.cr0 & 0x0F;
+  _scr = (config.cr0 >> 8) & 0xFF;
+  _div = config.cpsr;
+}
+
+bool SSP::DmaInit(){
+  if(_dma_tx >= 0){
+    return 1;
+  }
+  _dma_tx = GPDMA::AllocChannel(DmaHandler);
+  _dma_rx = GPDMA::AllocChannel(DmaHandler);
+  if(_dma_tx < 0 || _dma_rx < 0){
+    //Give back whatever we got, we need both
+    if(_dma_tx >= 0){
+      GPDMA::FreeChannel(_dma_tx);
+    }
+    if(_dma_rx >= 0){
+      GPDMA::FreeChannel(_dma_rx);
+    }
+    _dma_tx = -1;
+    _dma_rx = -1;
+    return 0;
+  }
+  dma_owner[_dma_tx] = this;
+  dma_owner[_dma_rx] = this;
+  _dma_done = xSemaphoreCreateBinary();
+  return 1;
+}
+
+bool SSP::SendDma(const void *buf, uint16_t len, IsrPointer done){
+  if(!DmaInit()){
+    return 0;
+  }
+  //Trash anything sitting in the receive FIFO so the RX channel's count lines
+  //up with the frames we send
+  uint16_t trashman = 0;
+  while(!RFIFOIsEmpty()){
+    trashman = *SSP_DR[GetPort()];
+  }
+  _dma_callback = done;
+  //Byte sized frames come out of a byte buffer, everything else out of uint16_t
+  GPDMA::Width width = (_dss < 8) ? GPDMA::kByte : GPDMA::kHalfWord;
+  //SSPn TX and RX requests are numbered 2n+1 and 2n+2
+  GPDMA::Request tx_req = (GPDMA::Request)(GPDMA::kSsp0Tx + 2*GetPort());
+  GPDMA::Request rx_req = (GPDMA::Request)(GPDMA::kSsp0Rx + 2*GetPort());
+  //The RX channel finishes after the last frame is clocked out, so that's the
+  //one that tells us we're done. Start it first so it never misses a frame
+  GPDMA::PeriphToMem(_dma_rx, SSP_DR[GetPort()], &dma_sink, len, width, GPDMA::kBurst4, rx_req, false);
+  GPDMA::MemToPeriph(_dma_tx, buf, SSP_DR[GetPort()], len, width, GPDMA::kBurst4, tx_req);
+  //Turn on the TX and RX DMA requests
+  *SSP_DMACR[GetPort()] = 0b11;
+  return 1;
+}
+
+bool SSP::IsDmaBusy(){
+  return (_dma_rx >= 0) && GPDMA::IsActive(_dma_rx);
+}
+
+bool SSP::WaitDma(TickType_t wait){
+  if(_dma_done == NULL){
+    return 1;
+  }
+  return xSemaphoreTake(_dma_done, wait);
+}
+
+void SSP::DmaHandler(uint8_t channel, bool error){
+  SSP *ssp = dma_owner[channel];
+  if(ssp == NULL){
+    return;
+  }
+  //The TX side finishing isn't interesting unless it failed, in which case the
+  //RX side will never finish on its own
+  if(channel == ssp->_dma_tx){
+    if(!error){
+      return;
+    }
+    GPDMA::Stop(ssp->_dma_rx);
+  }
+  //Turn the DMA requests back off
+  *SSP_DMACR[ssp->GetPort()] = 0;
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(ssp->_dma_done, &woken);
+  if(ssp->_dma_callback != NULL){
+    ssp->_dma_callback();
+  }
+  portYIELD_FROM_ISR(woken);
+}
+
+void SSP::SetClock(uint8_t cpsr, uint8_t scr){
+  //The prescaler has to be even and at least 2
+  cpsr &= ~0x01;
+  if(cpsr < 2){
+    cpsr = 2;
+  }
+  _div = cpsr;
+  _scr = scr;
+  //Don't change the clock in the middle of a frame
+  BusyWait();
+  *SSP_CPSR[GetPort()] = _div;
+  *SSP_CR0[GetPort()] = (*SSP_CR0[GetPort()] & ~(0xFF << 8)) | (_scr << 8);
+}
+
+uint32_t SSP::FindClock(uint32_t hz, uint8_t *cpsr, uint8_t *scr){
+  //Start with the slowest clock possible and look for something faster
+  uint32_t best = SSP_PCLK / (254 * 256);
+  *cpsr = 254;
+  *scr = 255;
+  for(uint16_t c = 2; c <= 254; c+=2){
+    //The smallest divider that doesn't go over the target. c * hz runs past
+    //32 bits for fast targets
+    uint64_t step = (uint64_t)c * hz;
+    uint32_t div = (SSP_PCLK + step - 1) / step;
+    if(div < 1){
+      div = 1;
+    }
+    if(div > 256){
+      continue;
+    }
+    uint32_t rate = SSP_PCLK / (c * div);
+    if(rate <= hz && rate > best){
+      best = rate;
+      *cpsr = c;
+      *scr = div - 1;
+    }
+  }
+  return best;
+}
+
+uint32_t SSP::SetFrequency(uint32_t hz){
+  uint8_t cpsr;
+  uint8_t scr;
+  uint32_t rate = FindClock(hz, &cpsr, &scr);
+  SetClock(cpsr, scr);
+  LOG_DEBUG("SSP%x clock = %lu Hz (CPSR = %d, SCR = %d)", GetPort(), rate, cpsr, scr);
+  return rate;
+}
+
+uint32_t SSP::GetFrequency(){
+  return SSP_PCLK / (_div * (_scr + 1));
+}
@@ -2,10 +2,27 @@
 
 #include "L0_LowLevel/LPC40xx.h"
 #include "ngpincon.hpp"
+#include "nggpdma.hpp"
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+#include "L0_LowLevel/interrupt.hpp"
 #include "utility/log.hpp"
 
+//The peripheral clock feeding the SSP prescalers
+#define SSP_PCLK 48000000
+
 class SSP{
 public:
+  //Both hardware FIFOs are 8 frames deep
+  static constexpr uint8_t kFifoDepth = 8;
+
+  //The frame format and clock, for drivers sharing an SSP with another driver
+  //that sets it up its own way
+  struct Config{
+    uint32_t cr0;
+    uint32_t cpsr;
+  };
+
   enum FrameModes
   {
     kSPI = 0b00,
@@ -41,6 +58,22 @@ public:
   //Read data from the SPI device, 8 bit aligned
   void Recv(uint8_t *buf, uint32_t len=1);
 
+  //Send data to the SSP device, 16 bit aligned. Keeps the transmit FIFO full
+  //instead of waiting for each frame, and throws away whatever comes back
+  void SendBurst(const uint16_t *buf, uint32_t len);
+
+  //Send data to the SSP device, 8 bit aligned. Keeps the transmit FIFO full
+  //instead of waiting for each frame, and throws away whatever comes back
+  void SendBurst(const uint8_t *buf, uint32_t len);
+
+  //Read data from the SSP device, 8 bit aligned. Keeps the transmit FIFO full
+  //of filler frames instead of waiting for each frame, so the clock never
+  //stops between frames
+  //@param buf: Filled in with the frames that come back
+  //@param len: The number of frames to read
+  //@param fill: What to send while reading
+  void RecvBurst(uint8_t *buf, uint32_t len, uint8_t fill=0xFF);
+
   //Get the status register for the associated SSP device
   uint8_t GetStatus();
 
@@ -59,15 +92,85 @@ public:
   //Check to see if the transmit FIFO is empty
   bool TFIFOIsEmpty();
 
+  //Check to see if there's room in the transmit FIFO
+  bool TFIFOIsNotFull();
+
   //Wait for data in the Recieve FIFO
   void BusyRFIFOWait();
 
   //Wait for the transmit FIFO to be empty
   void BusyTFIFOWait();
 
+  //Set the SSP clock to SSP_PCLK / (cpsr * (scr + 1))
+  //@param cpsr: The prescaler, an even number from 2 to 254
+  //@param scr: The serial clock rate divider, 0 to 255
+  void SetClock(uint8_t cpsr, uint8_t scr);
+
+  //Find the prescaler and divider for the fastest clock that isn't faster
+  //than a target frequency
+  //@param hz: The target frequency
+  //@param cpsr: Filled in with the prescaler
+  //@param scr: Filled in with the serial clock rate divider
+  //@return uint32_t: The frequency the SSP will actually run at
+  static uint32_t FindClock(uint32_t hz, uint8_t *cpsr, uint8_t *scr);
+
+  //Set the SSP clock as close to a target as possible without going over
+  //@param hz: The target frequency
+  //@return uint32_t: The frequency the SSP will actually run at
+  uint32_t SetFrequency(uint32_t hz);
+
+  //Get the frequency the SSP is running at
+  uint32_t GetFrequency();
+
+  //Get the frame format and clock the SSP is set to right now
+  Config GetConfig();
+
+  //Set the frame format and clock all at once, ex: to put back what
+  //GetConfig returned
+  void SetConfig(Config config);
+
+  //Change the number of bits in each frame
+  //@param data_size_select: The amount of bits to transfer at a time
+  void SetDataSize(uint8_t data_size_select);
+
+  //Start sending a buffer with the DMA and return right away. Whatever the
+  //device sends back is thrown away by a second DMA channel.
+  //@param buf: The frames to send. Bytes if frames are 8 bits or less,
+  //uint16_t otherwise. Don't touch it until the transfer is done
+  //@param len: The number of frames to send, up to GPDMA::kMaxTransfer
+  //@param done: Optional function to call from the DMA ISR when it's done
+  //@return bool: False if there are no DMA channels left. Nothing was sent
+  bool SendDma(const void *buf, uint16_t len, IsrPointer done=NULL);
+
+  //Check to see if a DMA transfer is still going
+  bool IsDmaBusy();
+
+  //Block until the last DMA transfer is done
+  //@param wait: The number of ticks to wait
+  //@return bool: True if the transfer finished
+  bool WaitDma(TickType_t wait=portMAX_DELAY);
+
 private:
   uint8_t _dss;
   FrameModes _format;
   uint8_t _div;
+  uint8_t _scr;
   uint8_t _ssp_num;
+  //DMA channels, -1 until the first DMA transfer
+  int8_t _dma_tx;
+  int8_t _dma_rx;
+  //Given by the DMA ISR when a transfer is done
+  SemaphoreHandle_t _dma_done;
+  IsrPointer _dma_callback;
+  //Grab the DMA channels
+  bool DmaInit();
+  //Shared code for the SendBurst variants
+  template <typename T>
+  void Burst(const T *buf, uint32_t len);
+  //Which SSP object owns each DMA channel
+  static SSP *dma_owner[GPDMA::kChannels];
+  //Garbage frames from the receive FIFO get thrown in here
+  static uint16_t dma_sink;
+  //Called by the DMA ISR when one of our channels is done
+  static void DmaHandler(uint8_t channel, bool error);
 };
@@ -11,13 +11,32 @@ uint8_t UART_TX_PIN_NUM[]   = {22, 28};
 uint8_t UART_RX_PORT_NUM[]  = {4,  4};
 uint8_t UART_RX_PIN_NUM[]   = {23, 29};
 IRQn_Type UART_IRQ_MAP [] =   {UART2_IRQn, UART3_IRQn};
+//The transmit FIFO is 16 bytes deep
+#define UART_FIFO_DEPTH 16
 
-UART::UART(uint8_t port, uint16_t dl){
+UART *UART::isr_owner[2];
+UART *UART::dma_owner[GPDMA::kChannels];
+
+//The rates the player uses have to come out close enough for the far end to
+//frame them. Checked here so a clock change breaks the build, not the link
+static_assert(UART::FindDivisor(9600).GetErrorPpm() < 1000, "9600 baud is too far off");
+static_assert(UART::FindDivisor(115200).GetErrorPpm() < 1000, "115200 baud is too far off");
+static_assert(UART::FindDivisor(460800).GetErrorPpm() < 5000, "460800 baud is too far off");
+static_assert(UART::FindDivisor(921600).GetErrorPpm() < 5000, "921600 baud is too far off");
+static_assert(UART::FindDivisor(1000000).GetErrorPpm() == 0, "1 Mbaud is off");
+static_assert(UART::FindDivisor(3000000).GetErrorPpm() == 0, "3 Mbaud is off");
+//The fractional divider never runs with a divisor latch under 3
+static_assert(UART::FindDivisor(2000000).divaddval == 0 || UART::FindDivisor(2000000).dl >= 3, "Bad fractional divider");
+
+UART::UART(uint8_t port, uint16_t dl) : UART(port, Divisor{RateOf(dl, 0, 1), RateOf(dl, 0, 1), dl, 0, 1}){
+}
+
+UART::UART(uint8_t port, Divisor divisor){
   if(port != 2 && port != 3){
     LOG_ERROR("Invalid UART Port %d!", port);
     return;
   }
-  _dl = dl;
+  _divisor = divisor;
   _port = port;
 }
 
@@ -33,8 +52,10 @@ void UART::Init(){
   //Set DLL and DLM to set the baud rate
   LPC_UART[GetPort() - 2]->DLL = (0x00FF & GetDL()) >> 0;
   LPC_UART[GetPort() - 2]->DLM = (0xFF00 & GetDL()) >> 8;
-  //We're not using FDR, so just set it to its default value
-  LPC_UART[GetPort() - 2]->FDR = (1 << 4);
+  //Set the fractional divider
+  LPC_UART[GetPort() - 2]->FDR = (_divisor.mulval << 4) | _divisor.divaddval;
+  LOG_DEBUG("UART%d at %lu baud for %lu (%lu ppm off)", GetPort(), _divisor.rate, _divisor.baud,
+            _divisor.GetErrorPpm());
   //Set the FIFO enable bit in FCR
   LPC_UART[GetPort() - 2]->FCR |= (1 << 0);
   //Set packet length to 8 bits
@@ -66,6 +87,14 @@ bool UART::CheckError(){
 }
 
 void UART::SendByte(uint8_t byte){
+  //Wait for the THRE bit, or the byte gets dropped once the FIFO is full
+  while(!(LPC_UART[GetPort() - 2]->LSR & (1 << 5))){
+    continue;
+  }
+  LPC_UART[GetPort() - 2]->THR = byte;
+}
+
+void UART::SendByteNoWait(uint8_t byte){
   LPC_UART[GetPort() - 2]->THR = byte;
 }
 
@@ -99,7 +128,11 @@ uint8_t UART::GetPort(){
 }
 
 uint16_t UART::GetDL(){
-  return _dl;
+  return _divisor.dl;
+}
+
+uint32_t UART::GetBaud(){
+  return _divisor.rate;
 }
 
 void UART::AttachRBRIsr(IsrPointer isr){
@@ -113,6 +146,260 @@ void UART::EnableRBRInterrupt(){
 }
 
 void UART::DisableRBRInterrupt(){
-  LPC_UART[GetPort() - 2]->IER |= (1 << 0);
+  LPC_UART[GetPort() - 2]->IER &= ~(1 << 0);
   NVIC_DisableIRQ(UART_IRQ_MAP[GetPort() - 2]);
 }
+
+void UART::StartInterrupts(RxRing* rx, TxRing* tx){
+  volatile LPC_UART_TypeDef* uart = LPC_UART[GetPort() - 2];
+  _rx = rx;
+  _tx = tx;
+  _rx->Reset();
+  _tx->Reset();
+  _tx_busy = 0;
+  isr_owner[GetPort() - 2] = this;
+  RegisterIsr(UART_IRQ_MAP[GetPort() - 2], (GetPort() == 2) ? Uart2Isr : Uart3Isr);
+  //Reset both FIFOs, and interrupt once 8 bytes are waiting. That leaves the
+  //ISR 8 byte times to get there before the FIFO overruns
+  uart->FCR = (1 << 0) | (1 << 1) | (1 << 2) | (0b10 << 6);
+  //Interrupt on received data, THRE, and receive line status
+  uart->IER = (1 << 0) | (1 << 1) | (1 << 2);
+  NVIC_EnableIRQ(UART_IRQ_MAP[GetPort() - 2]);
+}
+
+uint16_t UART::Read(uint8_t* buf, uint16_t len, TickType_t wait){
+  if(!WaitReadable(wait)){
+    return 0;
+  }
+  uint16_t got = 0;
+  while(got < len && _rx->Pop(&buf[got])){
+    got++;
+  }
+  return got;
+}
+
+uint16_t UART::Peek(const uint8_t** data){
+  return _rx->Peek(data);
+}
+
+void UART::Consume(uint16_t len){
+  _rx->Skip(len);
+}
+
+bool UART::WaitReadable(TickType_t wait, uint16_t count){
+  while(_rx->GetCount() < count){
+    //Tell the ISR who to wake, then look again in case a byte came in before
+    //it knew
+    _rx_waiter = xTaskGetCurrentTaskHandle();
+    if(_rx->GetCount() >= count){
+      _rx_waiter = NULL;
+      break;
+    }
+    bool woken = ulTaskNotifyTake(pdTRUE, wait);
+    _rx_waiter = NULL;
+    if(!woken){
+      return _rx->GetCount() >= count;
+    }
+  }
+  return 1;
+}
+
+uint16_t UART::GetReadable(){
+  return _rx->GetCount();
+}
+
+uint16_t UART::Write(const uint8_t* buf, uint16_t len, TickType_t wait){
+  uint16_t sent = 0;
+  while(sent < len){
+    while(sent < len && _tx->Push(buf[sent])){
+      sent++;
+    }
+    //If the ISR has gone idle, get the FIFO going again. THRE only fires after
+    //the FIFO has had something in it
+    taskENTER_CRITICAL();
+    if(!_tx_busy){
+      FillTxFifo();
+    }
+    taskEXIT_CRITICAL();
+    if(sent < len){
+      //The ring is full, sleep until the ISR makes room
+      _tx_waiter = xTaskGetCurrentTaskHandle();
+      bool woken = _tx->GetFree() || ulTaskNotifyTake(pdTRUE, wait);
+      _tx_waiter = NULL;
+      if(!woken){
+        break;
+      }
+    }
+  }
+  return sent;
+}
+
+uint32_t UART::GetRingOverruns(){
+  return _ring_overruns;
+}
+
+uint32_t UART::GetFifoOverruns(){
+  return _fifo_overruns;
+}
+
+uint32_t UART::GetLineErrors(){
+  return _line_errors;
+}
+
+void UART::FillTxFifo(){
+  uint8_t byte;
+  uint8_t room = UART_FIFO_DEPTH;
+  bool sent = 0;
+  while(room && _tx->Pop(&byte)){
+    LPC_UART[GetPort() - 2]->THR = byte;
+    room--;
+    sent = 1;
+  }
+  //Nothing went out, so THRE won't fire again until a writer primes it
+  _tx_busy = sent;
+}
+
+void UART::HandleInterrupt(){
+  volatile LPC_UART_TypeDef* uart = LPC_UART[GetPort() - 2];
+  BaseType_t woken = pdFALSE;
+  uint32_t iir;
+  uint32_t lsr;
+  //Bit 0 of IIR is clear while there's an interrupt pending
+  while(!((iir = uart->IIR) & (1 << 0))){
+    switch((iir >> 1) & 0x07){
+      //Receive line status, cleared by reading LSR
+      case 0x3 :
+        lsr = uart->LSR;
+        _fifo_overruns += (lsr >> 1) & 1;
+        _line_errors += (lsr & ((1 << 2) | (1 << 3) | (1 << 4))) ? 1 : 0;
+        break;
+
+      //Receive data available, or a character timeout with a few bytes left
+      //in the FIFO. Either way, empty it
+      case 0x2 :
+      case 0x6 :
+        while((lsr = uart->LSR) & (1 << 0)){
+          _fifo_overruns += (lsr >> 1) & 1;
+          if(!_rx->Push(uart->RBR)){
+            _ring_overruns++;
+          }
+        }
+        if(_rx_waiter != NULL){
+          vTaskNotifyGiveFromISR(_rx_waiter, &woken);
+        }
+        break;
+
+      //THRE, the transmit FIFO is empty
+      case 0x1 :
+        FillTxFifo();
+        if(_tx_waiter != NULL){
+          vTaskNotifyGiveFromISR(_tx_waiter, &woken);
+        }
+        break;
+
+      default :
+        break;
+    }
+  }
+  portYIELD_FROM_ISR(woken);
+}
+
+void UART::Uart2Isr(){
+  isr_owner[0]->HandleInterrupt();
+}
+
+void UART::Uart3Isr(){
+  isr_owner[1]->HandleInterrupt();
+}
+
+bool UART::DmaInit(){
+  if(_dma_tx >= 0){
+    return 1;
+  }
+  _dma_tx = GPDMA::AllocChannel(DmaHandler);
+  _dma_rx = GPDMA::AllocChannel(DmaHandler);
+  if(_dma_tx < 0 || _dma_rx < 0){
+    //Give back whatever we got, we need both
+    if(_dma_tx >= 0){
+      GPDMA::FreeChannel(_dma_tx);
+    }
+    if(_dma_rx >= 0){
+      GPDMA::FreeChannel(_dma_rx);
+    }
+    _dma_tx = -1;
+    _dma_rx = -1;
+    return 0;
+  }
+  dma_owner[_dma_tx] = this;
+  dma_owner[_dma_rx] = this;
+  //The UART only asks the DMA for data with the FIFOs in DMA mode. The DMA
+  //takes one byte per request, so ask as soon as there is one
+  LPC_UART[GetPort() - 2]->FCR = (1 << 0) | (1 << 3);
+  return 1;
+}
+
+bool UART::RecvDma(uint8_t* ring, uint16_t len, DmaCallback callback){
+  if(!DmaInit()){
+    return 0;
+  }
+  GPDMA::Stop(_dma_rx);
+  _rx_ring = ring;
+  _rx_second = 0;
+  _rx_callback = callback;
+  //The ISR isn't needed to receive any more
+  LPC_UART[GetPort() - 2]->IER &= ~(1 << 0);
+  GPDMA::PeriphToRing(_dma_rx, &LPC_UART[GetPort() - 2]->RBR, ring, len / 2, _rx_lli,
+                      (GetPort() == 2) ? GPDMA::kUart2Rx : GPDMA::kUart3Rx);
+  return 1;
+}
+
+uint16_t UART::GetRecvDmaPos(){
+  if(_rx_ring == NULL){
+    return 0;
+  }
+  return GPDMA::GetDestAddr(_dma_rx) - (uint32_t)_rx_ring;
+}
+
+void UART::StopRecvDma(){
+  if(_dma_rx >= 0){
+    GPDMA::Stop(_dma_rx);
+  }
+  _rx_ring = NULL;
+}
+
+bool UART::SendDma(const uint8_t* buf, uint16_t len, IsrPointer done){
+  if(!DmaInit()){
+    return 0;
+  }
+  _tx_callback = done;
+  GPDMA::MemToPeriph(_dma_tx, buf, &LPC_UART[GetPort() - 2]->THR, len, GPDMA::kByte, GPDMA::kBurst1,
+                     (GetPort() == 2) ? GPDMA::kUart2Tx : GPDMA::kUart3Tx);
+  return 1;
+}
+
+bool UART::IsSendDmaBusy(){
+  return (_dma_tx >= 0) && GPDMA::IsActive(_dma_tx);
+}
+
+void UART::DmaHandler(uint8_t channel, bool error){
+  UART *uart = dma_owner[channel];
+  if(uart == NULL){
+    return;
+  }
+  if(channel == uart->_dma_tx){
+    if(uart->_tx_callback != NULL){
+      uart->_tx_callback();
+    }
+    return;
+  }
+  //A failed receive stops the channel, and there's nothing to hand on
+  if(error){
+    uart->_line_errors++;
+    return;
+  }
+  bool second = uart->_rx_second;
+  uart->_rx_second = !second;
+  if(uart->_rx_callback != NULL){
+    uart->_rx_callback(second);
+  }
+}
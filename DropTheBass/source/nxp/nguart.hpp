@@ -2,28 +2,121 @@
 
 #include "L0_LowLevel/LPC40xx.h"
 #include "ngpincon.hpp"
+#include "ngring.hpp"
+#include "nggpdma.hpp"
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/task.h"
 #include "L0_LowLevel/interrupt.hpp"
 #include "utility/log.hpp"
 
+#include <cstdint>
 #include <iterator>
 
+//The clock going into the UARTs
+#define UART_PCLK 48000000
+
+//The size of the receive and transmit rings used in interrupt mode. Powers of
+//2. At 1 Mbaud the receive ring holds about 5 ms of data. The rings belong to
+//whoever starts interrupt mode, so a polled or DMA UART doesn't pay for them
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE 512
+#endif
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE 512
+#endif
+
+//A UART on UART2 or UART3. It starts out polled: SendByte waits for room in
+//the transmit FIFO, and RecvByte busy waits for a byte. StartInterrupts
+//switches it over to interrupt mode, where the ISR moves bytes between the
+//FIFOs and a pair of lock free rings the caller hands over, and Read and
+//Write only ever touch the rings. Don't mix the polled calls with Read and Write once interrupts are on.
+//
+//For bulk transfers, RecvDma keeps the DMA filling a ring buffer forever with
+//no CPU involved, and SendDma sends a whole buffer in the background.
 class UART{
 public:
+  //Called from the DMA ISR every time half of the receive ring fills
+  //@param second: False for the first half, true for the second
+  typedef void (*DmaCallback)(bool second);
+
+  //The rings interrupt mode runs on
+  typedef Ring<UART_RX_RING_SIZE> RxRing;
+  typedef Ring<UART_TX_RING_SIZE> TxRing;
+
+  //Everything that sets the baud rate:
+  //rate = UART_PCLK / (16 * dl * (1 + divaddval / mulval))
+  struct Divisor{
+    //The rate asked for
+    uint32_t baud;
+    //The rate these settings actually give
+    uint32_t rate;
+    uint16_t dl;
+    uint8_t divaddval;
+    uint8_t mulval;
+
+    //Get how far off the actual rate is, in parts per million
+    constexpr uint32_t GetErrorPpm() const{
+      return baud ? (uint32_t)(((rate > baud) ? rate - baud : baud - rate) * 1000000ull / baud) : 0;
+    }
+  };
+
+  //Work out the rate a set of divisors gives
+  static constexpr uint32_t RateOf(uint16_t dl, uint8_t divaddval, uint8_t mulval, uint32_t pclk=UART_PCLK){
+    return dl ? (uint32_t)((uint64_t)pclk * mulval / (16ull * dl * (mulval + divaddval))) : 0;
+  }
+
+  //Find the divisors that get closest to a baud rate. Tries every fractional
+  //divider (DIVADDVAL/MULVAL) with the best divisor latch for each. Use it in
+  //a constexpr, ex: UART uart(3, UART::FindDivisor(921600)), and the search
+  //happens at compile time
+  //@param baud: The baud rate
+  //@param pclk: The clock going into the UART
+  //@return Divisor: The closest settings
+  static constexpr Divisor FindDivisor(uint32_t baud, uint32_t pclk=UART_PCLK){
+    Divisor best = {baud, RateOf(0xFFFF, 0, 1, pclk), 0xFFFF, 0, 1};
+    for(uint8_t mulval = 1; mulval <= 15; mulval++){
+      for(uint8_t divaddval = 0; divaddval < mulval; divaddval++){
+        //The closest divisor latch, rounded
+        uint64_t den = 16ull * baud * (mulval + divaddval);
+        uint64_t dl = ((uint64_t)pclk * mulval + den / 2) / den;
+        //The fractional divider needs a divisor latch of at least 3
+        uint64_t low = divaddval ? 3 : 1;
+        dl = (dl < low) ? low : (dl > 0xFFFF) ? 0xFFFF : dl;
+        Divisor next = {baud, RateOf(dl, divaddval, mulval, pclk), (uint16_t)dl, divaddval, mulval};
+        if(next.GetErrorPpm() < best.GetErrorPpm()){
+          best = next;
+        }
+      }
+    }
+    return best;
+  }
+
   //Constructor for the UART object
   //@param uint8_t port: The port number for the interrupt (2 or 3
   //@param uint16_t dl: The value to push into the divisor latches to set the bitrate
   UART(uint8_t port, uint16_t dl);
 
+  //Constructor for the UART object
+  //@param uint8_t port: The port number for the interrupt (2 or 3)
+  //@param Divisor divisor: The baud rate settings, from FindDivisor
+  UART(uint8_t port, Divisor divisor);
+
   //Destructor for the UART object
   ~UART();
 
   //Initialize the UART object with the private class variables
   void Init();
 
-  //Send a single byte over UART
+  //Send a single byte over UART. Waits for room in the transmit FIFO
   //@param uint8_t byte: The byte to send
   void SendByte(uint8_t byte);
 
+  //Drop a single byte into the transmit FIFO without waiting, so it's safe
+  //from an ISR. The byte is lost if the FIFO is full, which only a UART that
+  //sends the odd byte here and there can rule out
+  //@param uint8_t byte: The byte to send
+  void SendByteNoWait(uint8_t byte);
+
   //Send a string over UART
   //@param const char*: The string to send
   void SendString(const char* string);
@@ -63,6 +156,10 @@ public:
   //@return uint16_t: The two bytes in the divisol latches DLM and DLL
   uint16_t GetDL();
 
+  //Get the baud rate the UART actually runs at
+  //@return uint32_t: The baud rate
+  uint32_t GetBaud();
+
   //Attach an ISR to RBR inerrupt of the UART object. Note: This function
   //does not automatically clear the interrupt after servicing it! The RBR
   //register must be read to clear the interrupt
@@ -75,7 +172,124 @@ public:
   //Disable Interrupts on the UART object.
   void DisableRBRInterrupt();
 
+  //Switch to interrupt mode. Takes over the UART's interrupt, so don't use
+  //AttachRBRIsr as well
+  //@param rx: The receive ring, which has to stay put while interrupts are on
+  //@param tx: The transmit ring, same
+  void StartInterrupts(RxRing* rx, TxRing* tx);
+
+  //Interrupt mode: Read whatever has been received, up to len bytes. Sleeps on
+  //the calling task's notification until at least one byte shows up. Only one
+  //task should read
+  //@param buf: Filled in with the bytes
+  //@param len: The most bytes to read
+  //@param wait: How many ticks to wait for the first byte
+  //@return uint16_t: The number of bytes read, 0 on timeout
+  uint16_t Read(uint8_t* buf, uint16_t len, TickType_t wait=portMAX_DELAY);
+
+  //Interrupt mode: Get the received bytes without copying them. Hands back
+  //the run up to the end of the ring, so wrapped data takes two calls. Let
+  //them go with Consume
+  //@param data: Filled in with a pointer to the oldest byte
+  //@return uint16_t: The number of bytes in a row
+  uint16_t Peek(const uint8_t** data);
+
+  //Interrupt mode: Let go of bytes looked at with Peek
+  //@param len: The number of bytes
+  void Consume(uint16_t len);
+
+  //Interrupt mode: Sleep until there's received data, without taking it
+  //@param wait: How many ticks to wait
+  //@param count: How many bytes to wait for
+  //@return bool: True if there's that much data
+  bool WaitReadable(TickType_t wait, uint16_t count=1);
+
+  //Interrupt mode: Get the number of received bytes waiting, wrapped or not
+  uint16_t GetReadable();
+
+  //Interrupt mode: Queue bytes to send. Sleeps on the calling task's
+  //notification while the transmit ring is full. Only one task should write
+  //@param buf: The bytes to send
+  //@param len: The number of bytes
+  //@param wait: How many ticks to wait for room each time the ring fills up
+  //@return uint16_t: The number of bytes queued. Short on timeout
+  uint16_t Write(const uint8_t* buf, uint16_t len, TickType_t wait=portMAX_DELAY);
+
+  //Get the number of received bytes thrown away because the receive ring was
+  //full
+  uint32_t GetRingOverruns();
+
+  //Get the number of times the hardware FIFO overran before the ISR got to it
+  uint32_t GetFifoOverruns();
+
+  //Get the number of framing, parity and break errors
+  uint32_t GetLineErrors();
+
+  //Start receiving into a ring with the DMA. It keeps going, wrapping around
+  //the ring, until StopRecvDma. Don't use interrupt mode reads as well
+  //@param ring: The ring, which has to stay put until StopRecvDma
+  //@param len: The size of the ring. Even, and up to 2 * GPDMA::kMaxTransfer
+  //@param callback: Called from the DMA ISR every time half the ring fills, or
+  //NULL
+  //@return bool: False if there's no DMA channel free
+  bool RecvDma(uint8_t* ring, uint16_t len, DmaCallback callback);
+
+  //Get where in the ring the DMA will write the next byte
+  uint16_t GetRecvDmaPos();
+
+  //Stop receiving with the DMA
+  void StopRecvDma();
+
+  //Start sending a buffer with the DMA and return right away
+  //@param buf: The bytes, which have to stay put until it's done
+  //@param len: The number of bytes, up to GPDMA::kMaxTransfer
+  //@param done: Called from the DMA ISR once the last byte is in the FIFO, or
+  //NULL
+  //@return bool: False if there's no DMA channel free
+  bool SendDma(const uint8_t* buf, uint16_t len, IsrPointer done=NULL);
+
+  //Check to see if SendDma is still going
+  bool IsSendDmaBusy();
+
 private:
-  uint16_t _dl;
+  //Service the UART's interrupt
+  void HandleInterrupt();
+  //Move bytes from the transmit ring to the FIFO, up to a FIFO's worth. Only
+  //called from the ISR, or with the ISR held off
+  void FillTxFifo();
+
+  //The ISR for each port, which find their UART object here
+  static void Uart2Isr();
+  static void Uart3Isr();
+  static UART *isr_owner[2];
+
+  //Grab the DMA channels the first time they're needed
+  bool DmaInit();
+  //Find the UART a DMA interrupt is for
+  static void DmaHandler(uint8_t channel, bool error);
+  static UART *dma_owner[GPDMA::kChannels];
+
+  Divisor _divisor;
   uint8_t _port;
+  //The rings from StartInterrupts, NULL until then
+  RxRing* _rx = NULL;
+  TxRing* _tx = NULL;
+  //The tasks sleeping on Read and Write, or NULL
+  TaskHandle_t volatile _rx_waiter = NULL;
+  TaskHandle_t volatile _tx_waiter = NULL;
+  //True while the ISR is draining the transmit ring. When it's false the
+  //FIFO has to be primed by the writer, since THRE only fires once per refill
+  volatile bool _tx_busy = 0;
+  volatile uint32_t _ring_overruns = 0;
+  volatile uint32_t _fifo_overruns = 0;
+  volatile uint32_t _line_errors = 0;
+  int8_t _dma_tx = -1;
+  int8_t _dma_rx = -1;
+  //The receive ring's links, and where it is
+  GPDMA::Lli _rx_lli[2];
+  uint8_t* _rx_ring = NULL;
+  //Which half of the ring the DMA is filling
+  volatile bool _rx_second = 0;
+  DmaCallback _rx_callback = NULL;
+  IsrPointer _tx_callback = NULL;
 };
@@ -1,14 +1,20 @@
 #include "ngadesto.hpp"
 
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/task.h"
+
 #include "L0_LowLevel/LPC40xx.h"
 #include "../nxp/nggpio.hpp"
 #include "utility/log.hpp"
 
-#define ADESTO_SIG_CMMD       0x9F
-#define ADESTO_WRITE_CMMD     0x02
-#define ADESTO_WRITE_EN_CMMD  0x06
-#define ADESTO_READ_CMMD      0x03
-#define ADESTO_STAT_CMMD      0x05
+#define ADESTO_SIG_CMMD         0x9F
+#define ADESTO_WRITE_CMMD       0x02
+#define ADESTO_WRITE_EN_CMMD    0x06
+#define ADESTO_WRITE_DIS_CMMD   0x04
+#define ADESTO_FAST_READ_CMMD   0x0B
+#define ADESTO_STAT_CMMD        0x05
+//The first byte of the JEDEC ID
+#define ADESTO_MAKER_ID         0x1F
 
 #define ADESTO_PORT     1
 #define ADESTO_SCK_PIN  0
@@ -19,16 +25,41 @@
 Adesto::Adesto(){
   _cs = new GPIO(ADESTO_PORT, ADESTO_CS_PIN);
   _ssp2 = new SSP(8, SSP::kSPI, 0b10, 2);
+  //8 bit SPI frames, as fast as SSP2 goes up to ADESTO_CLOCK_HZ. The SD card
+  //driver already turned SSP2 on and set up its pins
+  uint8_t cpsr;
+  uint8_t scr;
+  SSP::FindClock(ADESTO_CLOCK_HZ, &cpsr, &scr);
+  _config.cr0 = (8 - 1) | (scr << 8);
+  _config.cpsr = cpsr;
   _cs->SetAsOutput();
-  _disable();
+  _cs->SetHigh();
 }
 
 void Adesto::_enable(){
+  _saved = _ssp2->GetConfig();
+  _ssp2->SetConfig(_config);
   _cs->SetLow();
 }
 
 void Adesto::_disable(){
   _cs->SetHigh();
+  _ssp2->SetConfig(_saved);
+}
+
+void Adesto::_send_cmmd(uint8_t cmmd){
+  _enable();
+  _ssp2->Send(&cmmd);
+  _disable();
+}
+
+void Adesto::_send_addr(uint8_t cmmd, uint32_t addr){
+  uint8_t buf[4];
+  buf[0] = cmmd;
+  buf[1] = (addr >> 16) & 0xFF;
+  buf[2] = (addr >> 8) & 0xFF;
+  buf[3] = addr & 0xFF;
+  _ssp2->SendBurst(buf, 4);
 }
 
 void Adesto::_set_state(bool state){
@@ -40,6 +71,25 @@ void Adesto::_set_state(bool state){
   }
 }
 
+bool Adesto::Init(){
+  uint32_t sig = GetSignature();
+  //The low 5 bits of the first device ID byte are the density, in powers of 2
+  //from 32 KB: 4 is 512 KB, 7 is 4 MB
+  uint8_t density = (sig >> 16) & 0x1F;
+  if((sig >> 24) != ADESTO_MAKER_ID || density == 0 || density > 12){
+    LOG_ERROR("Adesto: Unknown flash, signature 0x%08lx", sig);
+    _size = 0;
+    return 0;
+  }
+  _size = 1ul << (15 + density);
+  LOG_INFO("Adesto: %lu KB", _size / 1024);
+  return 1;
+}
+
+uint32_t Adesto::GetSize(){
+  return _size;
+}
+
 uint32_t Adesto::GetSignature(){
   uint8_t data[4];
   uint8_t cmmd = ADESTO_SIG_CMMD;
@@ -60,10 +110,20 @@ uint8_t Adesto::GetStatReg(){
 }
 
 void Adesto::WriteEnable(){
-  uint8_t data = ADESTO_WRITE_EN_CMMD;
-  _enable();
-  _ssp2->Send(&data);
-  _disable();
+  _send_cmmd(ADESTO_WRITE_EN_CMMD);
+}
+
+void Adesto::WriteDisable(){
+  _send_cmmd(ADESTO_WRITE_DIS_CMMD);
+}
+
+void Adesto::SetWrite(bool state){
+  if(state){
+    WriteEnable();
+  }
+  else{
+    WriteDisable();
+  }
 }
 
 bool Adesto::CheckBusy(){
@@ -72,33 +132,61 @@ bool Adesto::CheckBusy(){
 
 void Adesto::BusyWait(){
   while(CheckBusy()){
-    continue;
+    //Nothing else can run before the scheduler starts, so just spin then
+    if(xTaskGetSchedulerState() == taskSCHEDULER_RUNNING){
+      vTaskDelay(1);
+    }
+  }
+}
+
+void Adesto::WaitReady(SemaphoreHandle_t bus){
+  for(;;){
+    xSemaphoreTake(bus, portMAX_DELAY);
+    bool busy = CheckBusy();
+    xSemaphoreGive(bus);
+    if(!busy){
+      return;
+    }
+    vTaskDelay(1);
+  }
+}
+
+void Adesto::Write(const uint8_t *buf, uint32_t addr, uint32_t len){
+  while(len){
+    //A program command wraps around inside its page, so stop at the end of it
+    uint32_t chunk = ADESTO_PAGE_SIZE - (addr % ADESTO_PAGE_SIZE);
+    if(chunk > len){
+      chunk = len;
+    }
+    BusyWait();
+    //The flash forgets it was write enabled after every write or erase
+    WriteEnable();
+    _enable();
+    _send_addr(ADESTO_WRITE_CMMD, addr);
+    _ssp2->SendBurst(buf, chunk);
+    _disable();
+    buf += chunk;
+    addr += chunk;
+    len -= chunk;
   }
 }
 
-void Adesto::Write(uint8_t *buf, uint32_t addr, uint16_t len){
-  uint8_t cmmd[4];
-  cmmd[0] = ADESTO_WRITE_CMMD;
-  cmmd[1] = addr & 0x00FF0000;
-  cmmd[2] = addr & 0x0000FF00;
-  cmmd[3] = addr & 0x000000FF;
+void Adesto::Erase(uint32_t addr, EraseSize size){
   BusyWait();
+  WriteEnable();
   _enable();
-  _ssp2->Send(cmmd, 4);
-  _ssp2->Send(buf, len);
+  _send_addr(size, addr);
   _disable();
 }
 
-void Adesto::Read(uint8_t *buf, uint32_t addr, uint16_t len){
-  uint8_t cmmd[4];
-  cmmd[0] = ADESTO_READ_CMMD;
-  cmmd[1] = addr & 0x00FF0000;
-  cmmd[2] = addr & 0x0000FF00;
-  cmmd[3] = addr & 0x000000FF;
+void Adesto::Read(uint8_t *buf, uint32_t addr, uint32_t len){
   BusyWait();
   _enable();
-  _ssp2->Send(cmmd, 4);
-  _ssp2->Recv(buf, len);
+  //Fast read takes a dummy byte after the address
+  uint8_t dummy;
+  _send_addr(ADESTO_FAST_READ_CMMD, addr);
+  _ssp2->RecvBurst(&dummy, 1);
+  _ssp2->RecvBurst(buf, len);
   _disable();
 }
 
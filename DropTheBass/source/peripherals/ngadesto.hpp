@@ -1,38 +1,100 @@
 #pragma once
 
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
 #include "../nxp/nggpio.hpp"
 #include "../nxp/ngssp.hpp"
 
 #include <cstdint>
 #include <iterator>
 
+//The size of flash the player lays its data out for, and of the smallest
+//block it can erase. Init reads the real size, check it with GetSize
+#define ADESTO_SIZE         0x400000
+#define ADESTO_SECTOR_SIZE  4096
+//The most a single program command can write. Writes that cross a page get
+//split up
+#define ADESTO_PAGE_SIZE    256
+//The fastest SPI clock to run the flash at. SSP2 tops out well under what the
+//flash can do with fast reads
+#ifndef ADESTO_CLOCK_HZ
+#define ADESTO_CLOCK_HZ     24000000
+#endif
+
+//The Adesto shares SSP2 with the SD card. Every command sets SSP2 up the way
+//the flash wants it and puts back whatever was there before, so the SD card
+//driver never knows. Hold the SD card's mutex while calling any of these.
 class Adesto{
 public:
+  //The erase sizes, set to the command for each
+  enum EraseSize : uint8_t
+  {
+    k4K  = 0x20,
+    k32K = 0x52,
+    k64K = 0xD8
+  };
+
   //Constructor
   Adesto();
   //Destructor
   ~Adesto();
+  //Read the JEDEC ID and work out the size of the flash from it. Call once
+  //SSP2 is running, with the SD card's mutex held
+  //@return bool: False if it isn't an Adesto flash
+  bool Init();
+  //Get the size of the flash in bytes, 0 before Init or if it's unknown
+  uint32_t GetSize();
   //Enable writing to the Adesto
   void WriteEnable();
   //Disable writing to the Adesto
   void WriteDisable();
   //Set the write status of the Adesto
   void SetWrite(bool state);
-  //Write data to the Adesto chip
-  void Write(uint8_t *buf, uint32_t addr, uint16_t len=1);
-  //Read data from the adesto chip
-  void Read(uint8_t *buf, uint32_t addr, uint16_t len=1);
+  //Write data to the Adesto chip. The data is split up at page boundaries, and
+  //each page waits for the last one to finish. Doesn't wait for the last page
+  //@param buf: The data to write
+  //@param addr: Where to write it
+  //@param len: The number of bytes
+  void Write(const uint8_t *buf, uint32_t addr, uint32_t len=1);
+  //Erase the block holding an address. Doesn't wait for the erase to finish,
+  //which takes from tens of milliseconds for 4K to most of a second for 64K
+  //@param addr: Any address in the block
+  //@param size: How big a block to erase
+  void Erase(uint32_t addr, EraseSize size=k4K);
+  //Read data from the adesto chip with the fast read command, which streams
+  //as many bytes as you want without stopping the clock
+  //@param buf: Filled in with the data
+  //@param addr: Where to start reading
+  //@param len: The number of bytes
+  void Read(uint8_t *buf, uint32_t addr, uint32_t len=1);
   //Get the status register of the Adesto chip
   uint8_t GetStatReg();
   //Get the Manufacturer/Device Signature of the Adesto
   uint32_t GetSignature();
   //Check to see if the Adesto is busy
   bool CheckBusy();
-  //Busy wait for the Adesto to become available
+  //Wait for the Adesto to become available. Sleeps a tick between checks once
+  //the scheduler is running. The caller's mutex stays held the whole time, so
+  //for long erases poll CheckBusy and let the bus go in between instead
   void BusyWait();
+  //Wait for the Adesto to become available, letting go of the bus between
+  //checks so the SD card can be used while the flash erases or programs.
+  //Don't hold the mutex when calling this
+  //@param bus: The mutex for SSP2
+  void WaitReady(SemaphoreHandle_t bus);
 private:
   SSP *_ssp2;
   GPIO *_cs;
+  //How the flash wants SSP2 set up
+  SSP::Config _config;
+  //How SSP2 was set up before the current command
+  SSP::Config _saved;
+  uint32_t _size = 0;
+  //Send a command on its own
+  void _send_cmmd(uint8_t cmmd);
+  //Send a command with a 24 bit address
+  void _send_addr(uint8_t cmmd, uint32_t addr);
   //Enable the Adesto
   void _enable();
   //Disable the Adesto
@@ -1,10 +1,15 @@
 #include "ngmp3.hpp"
 
+#include <stdlib.h>
+#include <string.h>
+
 void Mp3::FullInit(){
   //Create a new SSP object at runtime
-  //TODO: See if we can increase the clockspeed here
   _comm = new SSP(16, SSP::kSPI, 8, 0);
   _comm->Init();
+  //Until CLOCKF is set, the decoder runs straight off the crystal, so start
+  //out slow
+  SetClki(MP3_XTALI);
 
   //GPIO Signals:
   //XCS (Chip Select): P0_10
@@ -15,13 +20,12 @@ void Mp3::FullInit(){
   _xreset = new GPIO(0, 11);
   _xreset->SetAsOutput();
   _xreset->SetHigh();
-  //DREQ (Data Request): P0_0
+  //DREQ (Data Request): P0_25
   _dreq = new GPIO(0, 25);
-  _dreq->SetAsInput();
+  Dreq::SetAsInput();
   //XDCS (Data Chip Select): P0_6
-  _xdcs = new GPIO(0, 6);
-  _xdcs->SetAsOutput();
-  _xdcs->SetHigh();
+  Xdcs::SetAsOutput();
+  Xdcs::SetHigh();
 
   //Initialize the filesystem
   _fs = new FATFS;
@@ -53,6 +57,8 @@ void Mp3::DecoderInit(){
   WriteReg(Mp3::SCIReg::kCLOCKF, 0x6000);
   //The chip needs a second to change the frequency
   Delay(1);
+  //Now the SSP can go a lot faster
+  SetClki(MP3_XTALI * MP3_CLKI_MULT);
   //Start the volume at slightly less than half
   SetVolume(0x70);
 }
@@ -65,7 +71,6 @@ Mp3::~Mp3(){
   delete _xcs;
   delete _xreset;
   delete _dreq;
-  delete _xdcs;
 
   //Make sure we delete the filesystem object
   delete _fs;
@@ -76,6 +81,11 @@ Mp3::~Mp3(){
 
 uint16_t Mp3::ReadReg(SCIReg reg){
   uint16_t buf;
+  //Reads need a slower clock than writes
+  UseReadClock();
+  //SCI is 16 bits at a time. Song data leaves the SSP at 8, so it only
+  //switches when the two take turns
+  _comm->SetDataSize(16);
   //Select the chip
   _xcs->SetLow();
   //Send the read command and the address of the register
@@ -92,15 +102,14 @@ uint16_t Mp3::ReadReg(SCIReg reg){
 }
 
 void Mp3::WriteReg(SCIReg reg, uint16_t data){
-  uint16_t buf;
+  UseWriteClock();
+  _comm->SetDataSize(16);
   //Select the chip
   _xcs->SetLow();
-  //Send the write command and the address of the register
-  buf = (SCI_WRITE << 8) | reg;
-  _comm->Send(&buf);
-  //Send the actual data
-  buf = data;
-  _comm->Send(&buf);
+  //Send the write command and the address of the register, then the actual
+  //data, back to back
+  uint16_t cmmd[2] = {(uint16_t)((SCI_WRITE << 8) | reg), data};
+  _comm->SendBurst(cmmd, 2);
   //Deselect the chip
   _xcs->SetHigh();
   //Wait for DREQ
@@ -108,6 +117,8 @@ void Mp3::WriteReg(SCIReg reg, uint16_t data){
 }
 
 void Mp3::HardReset(){
+  //Resetting clears CLOCKF, so slow back down
+  SetClki(MP3_XTALI);
   //XRESET is active low
   _xreset->SetLow();
   //Wait 4 microseconds
@@ -139,7 +150,7 @@ uint8_t Mp3::GetVolume(){
 }
 
 bool Mp3::CheckDreq(){
-  return _dreq->ReadBool();
+  return Dreq::ReadBool();
 }
 
 void Mp3::WaitDreq(){
@@ -149,26 +160,388 @@ void Mp3::WaitDreq(){
   }
 }
 
-bool Mp3::PrepareSong(char* filename){
+bool Mp3::PrepareSong(const char* filename){
   //Make sure we're in VS10xx native mode
   WriteReg(SCIReg::kMODE, (1 << 11));
   //Clear out the resync variable (0x1e29) to resync the player
   //Just in case we want to play some WMA or M4A files
-  WriteReg(SCIReg::kWRAMADDR, 0x1e29);
-  WriteReg(SCIReg::kWRAM,     0x00);
-  //Clear the decode time register
-  //Write to it twice because the datasheet says so
-  WriteReg(SCIReg::kDECODE_TIME, 0x00);
-  WriteReg(SCIReg::kDECODE_TIME, 0x00);
+  SetResync(0);
+  ResetPlayTime();
+  return OpenSong(filename);
+}
+
+bool Mp3::OpenSong(const char* filename){
   //Open the song on the filesystem
   FRESULT fr = f_open(_song_file, filename, FA_READ);
   if(fr){
     LOG_ERROR("Could not open song!");
     return 0;
   }
+  memset(&_info, 0, sizeof(_info));
+  _info.audio_end = f_size(_song_file);
+  if(!ReadId3v2()){
+    LOG_ERROR("Could not read song tags!");
+    f_close(_song_file);
+    return 0;
+  }
+  ReadId3v1();
+  InitSeek();
+  //Start streaming right at the audio
+  if(f_lseek(_song_file, _info.audio_start)){
+    f_close(_song_file);
+    return 0;
+  }
+  return 1;
+}
+
+const SongInfo* Mp3::GetSongInfo(){
+  return &_info;
+}
+
+int32_t Mp3::Seek(uint32_t ms){
+  if(!_seekable){
+    return -1;
+  }
+  if(_info.duration_ms && ms >= _info.duration_ms){
+    ms = _info.duration_ms - 1;
+  }
+  //Only walk as far as this seek needs
+  if(!_seek_complete){
+    IndexTo(ms);
+  }
+  uint16_t point = ms / _seek_step_ms;
+  if(point >= _seek_count){
+    point = _seek_count - 1;
+  }
+  //The points are at most one step apart, so close the gap by walking frames.
+  //This is never more than a step's worth of frames. Table of contents points
+  //can land in the middle of a frame, so find the next whole one first. It's
+  //less than a frame past the point, close enough to count as the point's time
+  uint32_t pos = _seek_pos[point];
+  uint64_t samples = 0;
+  uint32_t base = point * _seek_step_ms;
+  Frame frame = {0, 0, 0, 0};
+  if(!FindFrame(&pos, &frame)){
+    //The decoder can still find its own way from the point
+    return JumpTo(pos, base) ? base : -1;
+  }
+  while(pos < _info.audio_end && ReadFrame(pos, &frame)){
+    uint32_t at = base + samples * 1000 / frame.rate;
+    if(at + (uint32_t)frame.samples * 1000 / frame.rate > ms){
+      break;
+    }
+    samples += frame.samples;
+    pos += frame.len;
+  }
+  uint32_t landed = base + (frame.rate ? samples * 1000 / frame.rate : 0);
+  return JumpTo(pos, landed) ? landed : -1;
+}
+
+bool Mp3::JumpTo(uint32_t pos, uint32_t ms){
+  if(pos < _info.audio_start){
+    pos = _info.audio_start;
+  }
+  if(pos > _info.audio_end){
+    pos = _info.audio_end;
+  }
+  if(f_lseek(_song_file, pos)){
+    return 0;
+  }
+  //The decoder has to find its footing again in the middle of the stream
+  SetResync(MP3_RESYNC_AUTO);
+  //Write to it twice because the datasheet says so
+  WriteReg(SCIReg::kDECODE_TIME, ms / 1000);
+  WriteReg(SCIReg::kDECODE_TIME, ms / 1000);
+  return 1;
+}
+
+void Mp3::SetResync(uint16_t resync){
+  WriteReg(SCIReg::kWRAMADDR, MP3_RESYNC_ADDR);
+  WriteReg(SCIReg::kWRAM,     resync);
+}
+
+bool Mp3::ReadFrame(uint32_t pos, Frame *frame){
+  uint8_t h[4];
+  UINT bytes;
+  if(f_lseek(_song_file, pos) || f_read(_song_file, h, sizeof(h), &bytes) || bytes != sizeof(h)){
+    return 0;
+  }
+  return mpeg::ParseFrame(h, frame);
+}
+
+bool Mp3::FindFrame(uint32_t *pos, Frame *frame){
+  uint8_t buf[64];
+  UINT bytes;
+  uint32_t end = *pos + MP3_SYNC_SCAN;
+  if(end > _info.audio_end){
+    end = _info.audio_end;
+  }
+  uint32_t at = *pos;
+  while(at < end){
+    if(f_lseek(_song_file, at) || f_read(_song_file, buf, sizeof(buf), &bytes) || bytes < 2){
+      return 0;
+    }
+    for(UINT i = 0; i + 1 < bytes && at + i < end; i++){
+      if(buf[i] != 0xFF || (buf[i + 1] & 0xE0) != 0xE0){
+        continue;
+      }
+      //Plenty of audio data looks like a sync, the next header makes sure.
+      //The last frame of the song has nothing after it
+      Frame next;
+      uint32_t after = at + i;
+      if(ReadFrame(after, frame) &&
+         (after + frame->len >= _info.audio_end || ReadFrame(after + frame->len, &next))){
+        *pos = after;
+        return 1;
+      }
+    }
+    //Go back a byte in case a sync got split between reads
+    at += bytes - 1;
+  }
+  return 0;
+}
+
+void Mp3::InitSeek(){
+  Frame frame;
+  UINT bytes;
+  _seek_count = 0;
+  _seek_step_ms = MP3_SEEK_STEP_MS;
+  _seek_complete = 0;
+  _walk_pos = _info.audio_start;
+  _walk_samples = 0;
+  _seekable = ReadFrame(_info.audio_start, &frame);
+  if(!_seekable){
+    return;
+  }
+  _walk_rate = frame.rate;
+  //Room for a Xing header with its table of contents, and the LAME tag after it
+  uint8_t vbr[160];
+  if(f_lseek(_song_file, _info.audio_start + frame.side) ||
+     f_read(_song_file, vbr, sizeof(vbr), &bytes) || bytes != sizeof(vbr)){
+    return;
+  }
+  uint32_t audio_bytes = _info.audio_end - _info.audio_start;
+  //Xing (VBR) or Info (CBR): flags, then frames, bytes and a 100 entry table
+  //of contents as fractions of the file, each optional
+  if(!memcmp(vbr, "Xing", 4) || !memcmp(vbr, "Info", 4)){
+    uint32_t flags = (vbr[4] << 24) | (vbr[5] << 16) | (vbr[6] << 8) | vbr[7];
+    uint8_t at = 8;
+    uint32_t frames = 0;
+    if(flags & 0x01){
+      frames = (vbr[at] << 24) | (vbr[at + 1] << 16) | (vbr[at + 2] << 8) | vbr[at + 3];
+      at += 4;
+    }
+    if(flags & 0x02){
+      audio_bytes = (vbr[at] << 24) | (vbr[at + 1] << 16) | (vbr[at + 2] << 8) | vbr[at + 3];
+      at += 4;
+    }
+    if(frames && !_info.duration_ms){
+      _info.duration_ms = (uint64_t)frames * frame.samples * 1000 / frame.rate;
+    }
+    //Turn the table of contents into 100 evenly spaced seek points
+    if(flags & 0x04){
+      if(frames){
+        _seek_step_ms = (_info.duration_ms + 99) / 100;
+        for(uint8_t i = 0; i < 100; i++){
+          _seek_pos[_seek_count++] = _info.audio_start + (uint64_t)vbr[at + i] * audio_bytes / 256;
+        }
+        _seek_complete = 1;
+      }
+      at += 100;
+    }
+    if(flags & 0x08){
+      at += 4;
+    }
+    //The LAME tag (or the one ffmpeg writes) has the encoder's delay and
+    //padding in samples, 12 bits each, 21 bytes in
+    if(at + 24 <= sizeof(vbr) && (!memcmp(&vbr[at], "LAME", 4) || !memcmp(&vbr[at], "Lav", 3))){
+      _info.enc_delay = (vbr[at + 21] << 4) | (vbr[at + 22] >> 4);
+      _info.enc_padding = ((vbr[at + 22] & 0x0F) << 8) | vbr[at + 23];
+    }
+    //The header frame decodes to a frame of silence, so don't send it. This
+    //matters when songs run straight into each other
+    _info.audio_start += frame.len;
+    _walk_pos = _info.audio_start;
+    return;
+  }
+  //VBRI always sits 32 bytes past the header: version, delay, quality, bytes,
+  //frames, table entries, scale, entry size, frames per entry, then the table
+  if(f_lseek(_song_file, _info.audio_start + 36) ||
+     f_read(_song_file, vbr, 26, &bytes) || bytes != 26 || memcmp(vbr, "VBRI", 4)){
+    return;
+  }
+  uint32_t frames = (vbr[14] << 24) | (vbr[15] << 16) | (vbr[16] << 8) | vbr[17];
+  uint16_t entries = (vbr[18] << 8) | vbr[19];
+  uint16_t scale = (vbr[20] << 8) | vbr[21];
+  uint8_t entry_size = (vbr[22] << 8) | vbr[23];
+  uint16_t per_entry = (vbr[24] << 8) | vbr[25];
+  if(!frames || !per_entry || entry_size < 1 || entry_size > 4){
+    return;
+  }
+  if(!_info.duration_ms){
+    _info.duration_ms = (uint64_t)frames * frame.samples * 1000 / frame.rate;
+  }
+  //Each entry is the size of the next stretch of per_entry frames
+  _seek_step_ms = (uint64_t)per_entry * frame.samples * 1000 / frame.rate;
+  uint32_t pos = _info.audio_start;
+  AddSeekPoint(pos);
+  for(uint16_t i = 0; i < entries; i++){
+    uint8_t e[4];
+    if(f_read(_song_file, e, entry_size, &bytes) || bytes != entry_size){
+      break;
+    }
+    uint32_t size = 0;
+    for(uint8_t j = 0; j < entry_size; j++){
+      size = (size << 8) | e[j];
+    }
+    pos += size * scale;
+    AddSeekPoint(pos);
+  }
+  _seek_complete = 1;
+}
+
+void Mp3::IndexTo(uint32_t ms){
+  Frame frame;
+  while(!_seek_complete){
+    uint32_t at = (uint64_t)_walk_samples * 1000 / _walk_rate;
+    //Drop a seek point on the first frame of every step
+    if(at >= _seek_count * _seek_step_ms){
+      AddSeekPoint(_walk_pos);
+    }
+    if(at > ms + _seek_step_ms){
+      return;
+    }
+    //Ran off the end of the audio, or into something that isn't a frame
+    if(_walk_pos >= _info.audio_end || !ReadFrame(_walk_pos, &frame)){
+      _seek_complete = 1;
+      if(!_info.duration_ms){
+        _info.duration_ms = at;
+      }
+      return;
+    }
+    _walk_pos += frame.len;
+    _walk_samples += frame.samples;
+  }
+}
+
+void Mp3::AddSeekPoint(uint32_t pos){
+  //Full, keep every other point and space them twice as far apart
+  if(_seek_count >= MP3_SEEK_POINTS){
+    for(uint16_t i = 0; i < MP3_SEEK_POINTS / 2; i++){
+      _seek_pos[i] = _seek_pos[i * 2];
+    }
+    _seek_count = MP3_SEEK_POINTS / 2;
+    _seek_step_ms *= 2;
+    //The new point was number MP3_SEEK_POINTS, which is even, so it still
+    //lands right on the new spacing
+  }
+  _seek_pos[_seek_count++] = pos;
+}
+
+bool Mp3::ReadId3v2(){
+  uint8_t header[MPEG_TAG_HEADER_SIZE];
+  UINT bytes;
+  if(f_read(_song_file, header, sizeof(header), &bytes) || bytes != sizeof(header)){
+    return 0;
+  }
+  mpeg::Tag tag;
+  //No tag, the audio starts at the top
+  if(!mpeg::ParseTag(header, &tag)){
+    return 1;
+  }
+  uint8_t version = tag.version;
+  uint32_t end = tag.end;
+  _info.audio_start = tag.audio_start;
+  uint32_t pos = sizeof(header);
+  //Skip the extended header
+  if(version >= 3 && (tag.flags & 0x40)){
+    uint8_t ext[4];
+    if(f_read(_song_file, ext, sizeof(ext), &bytes) || bytes != sizeof(ext)){
+      return 0;
+    }
+    //v2.4 counts the size bytes themselves, v2.3 doesn't
+    pos += (version == 4) ? mpeg::SyncSafe(ext) : 4 + mpeg::BigEndian(ext, 4);
+  }
+  //v2.2 frames have 3 character IDs and 3 byte sizes
+  uint8_t id_len = (version == 2) ? 3 : 4;
+  uint8_t frame_header = (version == 2) ? 6 : 10;
+  //Only the start of a frame is ever kept, so this is all the room we need
+  uint8_t data[MP3_TAG_TEXT_SIZE * 2 + 3];
+  while(pos + frame_header <= end){
+    uint8_t fh[10];
+    if(f_lseek(_song_file, pos) ||
+       f_read(_song_file, fh, frame_header, &bytes) || bytes != frame_header){
+      return 0;
+    }
+    //Padding, no more frames
+    if(fh[0] == 0){
+      break;
+    }
+    uint32_t frame_size = mpeg::TagFrameSize(fh, version);
+    pos += frame_header;
+    if(pos + frame_size > end){
+      break;
+    }
+    //Pick out the frames we keep
+    char *field = NULL;
+    bool length = 0;
+    if(!memcmp(fh, (version == 2) ? "TT2" : "TIT2", id_len)){
+      field = _info.title;
+    }
+    else if(!memcmp(fh, (version == 2) ? "TP1" : "TPE1", id_len)){
+      field = _info.artist;
+    }
+    else if(!memcmp(fh, (version == 2) ? "TAL" : "TALB", id_len)){
+      field = _info.album;
+    }
+    else if(!memcmp(fh, (version == 2) ? "TLE" : "TLEN", id_len)){
+      length = 1;
+    }
+    if(field != NULL || length){
+      uint16_t len = (frame_size < sizeof(data)) ? frame_size : sizeof(data);
+      if(f_read(_song_file, data, len, &bytes) || bytes != len){
+        return 0;
+      }
+      if(field != NULL){
+        mpeg::CopyTagText(field, MP3_TAG_TEXT_SIZE, data, len);
+      }
+      else{
+        //The length is the song's milliseconds, as text
+        char text[12];
+        mpeg::CopyTagText(text, sizeof(text), data, len);
+        _info.duration_ms = strtoul(text, NULL, 10);
+      }
+    }
+    //Everything else, album art included, is seeked over and never read
+    pos += frame_size;
+  }
   return 1;
 }
 
+void Mp3::ReadId3v1(){
+  uint8_t tag[MPEG_ID3V1_SIZE];
+  UINT bytes;
+  uint32_t size = f_size(_song_file);
+  if(size < _info.audio_start + sizeof(tag)){
+    return;
+  }
+  if(f_lseek(_song_file, size - sizeof(tag)) ||
+     f_read(_song_file, tag, sizeof(tag), &bytes) || bytes != sizeof(tag) ||
+     memcmp(tag, "TAG", 3)){
+    return;
+  }
+  //Don't send the tag to the decoder
+  _info.audio_end = size - sizeof(tag);
+  //Fixed 30 character fields, padded with spaces or zeroes
+  char *fields[] = {_info.title, _info.artist, _info.album};
+  for(uint8_t i = 0; i < 3; i++){
+    if(fields[i][0]){
+      continue;
+    }
+    mpeg::CopyFixedText(fields[i], MP3_TAG_TEXT_SIZE, &tag[3 + i*30], 30);
+  }
+}
+
 bool Mp3::PlaySong(char* filename){
   FRESULT fr;
   PrepareSong(filename);
@@ -201,27 +574,52 @@ uint16_t Mp3::GetPlayTime(){
   return ReadReg(SCIReg::kDECODE_TIME);
 }
 
+void Mp3::ResetPlayTime(){
+  //Clear the decode time register
+  //Write to it twice because the datasheet says so
+  WriteReg(SCIReg::kDECODE_TIME, 0x00);
+  WriteReg(SCIReg::kDECODE_TIME, 0x00);
+}
+
 void Mp3::RegisterDREQInterrupt(IsrPointer isr){
   _dreq->AttachIsrHandle(isr, GPIO::Edge::kRising);
   _dreq->EnableInterrupts();
 }
 
 void Mp3::StartSdi(){
-  _xdcs->SetLow();
+  Xdcs::SetLow();
 }
 
 void Mp3::EndSdi(){
-  _xdcs->SetHigh();
+  Xdcs::SetHigh();
 }
 
 bool Mp3::CheckSdi(){
-  return _xdcs->ReadBool();
+  return Xdcs::ReadBool();
 }
 
 void Mp3::SendSongData(uint16_t data){
+  _comm->SetDataSize(16);
   _comm->Send(data);
 }
 
+void Mp3::SendSongBlock(uint8_t* buf, uint16_t len){
+  UseWriteClock();
+  //Song data is just a stream of bytes, so send it with 8 bit frames. That way
+  //the DMA can copy straight out of the buffer without swapping bytes around,
+  //and an odd length is fine. The SSP stays at 8 bits until the next SCI
+  //access, so back to back blocks don't turn it off and on again
+  _comm->SetDataSize(8);
+  if(_comm->SendDma(buf, len)){
+    //Sleep until the whole block is out
+    _comm->WaitDma();
+  }
+  else{
+    //No DMA, keep the FIFO full by hand
+    _comm->SendBurst((const uint8_t*)buf, len);
+  }
+}
+
 FIL* Mp3::GetFileHandle(){
   return _song_file;
 }
@@ -257,3 +655,26 @@ uint8_t Mp3::GetBass(){
   //Shift the bits and mask to get just the bass level
   return (0xF0 & ReadReg(SCIReg::kBASS)) >> 4;
 }
+
+void Mp3::SetClki(uint32_t clki){
+  uint32_t read = SSP::FindClock(clki / MP3_READ_DIV, &_read_cpsr, &_read_scr);
+  uint32_t write = SSP::FindClock(clki / MP3_WRITE_DIV, &_write_cpsr, &_write_scr);
+  LOG_DEBUG("MP3 CLKI = %lu Hz, SCI read = %lu Hz, write/SDI = %lu Hz", clki, read, write);
+  //Start on the read clock, it's safe for everything
+  _comm->SetClock(_read_cpsr, _read_scr);
+  _read_clock = 1;
+}
+
+void Mp3::UseReadClock(){
+  if(!_read_clock){
+    _comm->SetClock(_read_cpsr, _read_scr);
+    _read_clock = 1;
+  }
+}
+
+void Mp3::UseWriteClock(){
+  if(_read_clock){
+    _comm->SetClock(_write_cpsr, _write_scr);
+    _read_clock = 0;
+  }
+}
@@ -2,6 +2,7 @@
 
 #include "../nxp/ngssp.hpp"
 #include "../nxp/nggpio.hpp"
+#include "ngmpeg.hpp"
 
 #include "utility/log.hpp"
 #include "utility/time.hpp"
@@ -12,6 +13,49 @@
 #define SCI_WRITE     0b00000010
 #define SCI_READ      0b00000011
 #define SONG_BUF_SIZE 32
+//The decoder can always take this many bytes once DREQ goes high
+#define SDI_BLOCK_SIZE 32
+
+//The crystal on XTALI
+#define MP3_XTALI         12288000
+//DecoderInit sets CLOCKF so that CLKI = XTALI * 3
+#define MP3_CLKI_MULT     3
+//Datasheet limits: SCI reads can go up to CLKI/7, SCI writes and SDI can go
+//up to CLKI/4
+#define MP3_READ_DIV      7
+#define MP3_WRITE_DIV     4
+
+//Room for each text field pulled out of a song's tags, terminator included
+#define MP3_TAG_TEXT_SIZE 32
+
+//The most seek points kept for a song. When a long song fills them up, every
+//other point is dropped and the spacing doubles, so the RAM never grows
+#define MP3_SEEK_POINTS   128
+//The spacing between seek points when a song's index starts out
+#define MP3_SEEK_STEP_MS  1000
+//How far past a seek point to look for a frame. Table of contents points land
+//anywhere, and no frame is longer than this
+#define MP3_SYNC_SCAN     4096
+//The resync WRAM variable, and the value that makes the decoder hunt for the
+//next frame for as long as it takes after a jump
+#define MP3_RESYNC_ADDR   0x1e29
+#define MP3_RESYNC_AUTO   0x7fff
+
+//What we know about the song that's open
+struct SongInfo{
+  char title[MP3_TAG_TEXT_SIZE];
+  char artist[MP3_TAG_TEXT_SIZE];
+  char album[MP3_TAG_TEXT_SIZE];
+  //From the tag, or 0 if the tag didn't say
+  uint32_t duration_ms;
+  //Where the audio starts and ends in the file, with the tags and the VBR
+  //header frame cut off
+  uint32_t audio_start;
+  uint32_t audio_end;
+  //Samples the encoder added to the start and end, from the LAME tag
+  uint16_t enc_delay;
+  uint16_t enc_padding;
+};
 
 class Mp3{
 public:
@@ -73,12 +117,46 @@ public:
   //Play a song
   bool PlaySong(char* filename);
 
-  //Get ready to play a new song
-  bool PrepareSong(char* filename);
+  //Get ready to play a new song. Resets the decoder's song state, then opens
+  //the song with OpenSong
+  bool PrepareSong(const char* filename);
+
+  //Open a song without touching the decoder, so it can follow straight on
+  //from the one that's playing. Reads the song's tags and leaves the file at
+  //the first byte of audio, so the tags are never sent to the decoder. Close
+  //the last song with StopSong first
+  bool OpenSong(const char* filename);
+
+  //Get the tags and audio bounds of the open song
+  const SongInfo* GetSongInfo();
+
+  //Jump to a time in the open song. The file is left at the nearest frame at
+  //or before the time, the decoder is told to resync, and DECODE_TIME is set
+  //to match. Hold the SD card and the decoder while calling this
+  //@param ms: Where to jump to, from the start of the audio
+  //@return int32_t: The time actually landed on, or -1 if the song can't be
+  //seeked (it's not MPEG audio)
+  int32_t Seek(uint32_t ms);
+
+  //Jump to a byte in the open song that's already known to be at, or just
+  //before, a time. Works for any format the decoder can resync on. Hold the SD
+  //card and the decoder while calling this
+  //@param pos: Where to jump to in the file. Kept inside the audio
+  //@param ms: The time at that byte
+  //@return bool: False if the file couldn't be moved
+  bool JumpTo(uint32_t pos, uint32_t ms);
+
+  //Set the decoder's resync variable
+  //@param resync: 0 to never hunt for sync, up to MP3_RESYNC_AUTO to hunt
+  //that many times
+  void SetResync(uint16_t resync);
 
   //Get the seconds the song has been playing
   uint16_t GetPlayTime();
 
+  //Start the play time back at zero, ex: when a new song starts
+  void ResetPlayTime();
+
   //Register an interrupt to trigger when the chip needs more data
   //This also enables the interrupt
   void RegisterDREQInterrupt(IsrPointer isr);
@@ -95,6 +173,14 @@ public:
   //Send 16 bits of song data
   void SendSongData(uint16_t data);
 
+  //Send a block of song data with the DMA, sleeping until it's done. DREQ must
+  //be high before calling this, which guarantees the decoder can take at least
+  //SDI_BLOCK_SIZE bytes
+  //@param buf: The song data
+  //@param len: The number of bytes to send. Any length works, but DREQ only
+  //promises room for SDI_BLOCK_SIZE
+  void SendSongBlock(uint8_t* buf, uint16_t len=SDI_BLOCK_SIZE);
+
   //Get a pointer to the file object
   FIL* GetFileHandle();
 
@@ -116,13 +202,69 @@ public:
   //Get the bass level
   uint8_t GetBass();
 
+  //Tell the driver what CLKI the decoder is running at, and work out the
+  //fastest SSP clocks the datasheet allows for it
+  //@param clki: The decoder's internal clock in Hz
+  void SetClki(uint32_t clki);
+
 private:
+  //XDCS and DREQ get hit every 32 bytes of song data, so their registers are
+  //worked out at compile time
+  typedef FastGPIO<0, 6> Xdcs;
+  typedef FastGPIO<0, 25> Dreq;
+  //Switch the SSP to the clock for SCI reads, or the faster one for SCI
+  //writes and SDI. Only touches the SSP if it's not already there
+  void UseReadClock();
+  void UseWriteClock();
+  uint8_t _read_cpsr;
+  uint8_t _read_scr;
+  uint8_t _write_cpsr;
+  uint8_t _write_scr;
+  //Which clock the SSP is set to right now
+  bool _read_clock;
+  //Parse the ID3v2 tag at the start of the song, if there is one. Only the
+  //frames we keep are read, everything else (like album art) is seeked over
+  //@return bool: False if the file couldn't be read
+  bool ReadId3v2();
+  //Check the end of the song for an ID3v1 tag. Fills in any fields the ID3v2
+  //tag didn't have, and cuts the tag off the end of the audio
+  void ReadId3v1();
+  SongInfo _info;
+  typedef mpeg::Frame Frame;
+  //Read the MPEG frame header at a spot in the file
+  //@return bool: False if there isn't a valid frame there
+  bool ReadFrame(uint32_t pos, Frame *frame);
+  //Find the first frame at or after a spot in the file. A sync only counts
+  //if another frame header follows right where it says it ends
+  //@param pos: Where to start looking. Moved to the frame
+  //@return bool: False if there's no frame within MP3_SYNC_SCAN bytes
+  bool FindFrame(uint32_t *pos, Frame *frame);
+  //Set up the seek index for a new song. Uses the Xing or VBRI table of
+  //contents if the first frame has one, otherwise the index is filled in by
+  //walking frames the first time a seek needs them
+  void InitSeek();
+  //Walk frames from the end of the index until it reaches a time, adding a
+  //seek point every step along the way
+  void IndexTo(uint32_t ms);
+  //Add the next seek point, thinning the index out if it's full
+  void AddSeekPoint(uint32_t pos);
+  uint32_t _seek_pos[MP3_SEEK_POINTS];
+  uint16_t _seek_count;
+  uint32_t _seek_step_ms;
+  //The whole song is in the index, from a table of contents or a full walk
+  bool _seek_complete;
+  //False if the song isn't MPEG audio
+  bool _seekable;
+  //Where the frame walk got up to
+  uint32_t _walk_pos;
+  uint32_t _walk_samples;
+  uint32_t _walk_rate;
   SSP *_comm;
   FATFS *_fs;
   FIL *_song_file;
   GPIO *_xcs;
   GPIO *_xreset;
+  //Only used to attach the DREQ interrupt
   GPIO *_dreq;
-  GPIO *_xdcs;
   bool _paused;
 };
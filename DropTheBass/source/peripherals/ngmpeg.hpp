@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <string.h>
+
+//MPEG audio frame headers and ID3 tags, worked out from bytes already read out
+//of a song. The Mp3 driver does the file access. Keep this header free of
+//anything board specific.
+
+namespace mpeg{
+
+//What's in an MPEG audio frame header
+struct Frame{
+  //The whole frame, header included
+  uint16_t len;
+  uint16_t samples;
+  uint32_t rate;
+  //Where the VBR header would be, past the side info
+  uint8_t side;
+};
+
+//What's in the header at the top of an ID3v2 tag
+struct Tag{
+  //2, 3 or 4
+  uint8_t version;
+  uint8_t flags;
+  //Where the frames end, counted from the start of the file
+  uint32_t end;
+  //Where the audio starts, after the footer if there is one
+  uint32_t audio_start;
+};
+
+//The size of an ID3v2 tag header, and of the ID3v1 tag at the end of a file
+#define MPEG_TAG_HEADER_SIZE  10
+#define MPEG_ID3V1_SIZE       128
+
+//Read a sync safe number, 7 bits per byte
+//@param b: The 4 bytes
+//@return uint32_t: The number
+inline uint32_t SyncSafe(const uint8_t *b){
+  return (b[0] << 21) | (b[1] << 14) | (b[2] << 7) | b[3];
+}
+
+//Read a big endian number
+//@param b: The bytes
+//@param len: How many, up to 4
+//@return uint32_t: The number
+inline uint32_t BigEndian(const uint8_t *b, uint8_t len){
+  uint32_t n = 0;
+  for(uint8_t i = 0; i < len; i++){
+    n = (n << 8) | b[i];
+  }
+  return n;
+}
+
+//Parse an MPEG audio frame header
+//@param h: The 4 header bytes
+//@param frame: Filled in with what the header says
+//@return bool: False if it isn't a frame header we can walk
+inline bool ParseFrame(const uint8_t *h, Frame *frame){
+  //Bitrates in kbps, by [MPEG1][layer - 1][index]. MPEG2 and 2.5 share a table
+  static const uint16_t kBitrates[2][3][15] = {
+    {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+     {0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160},
+     {0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160}},
+    {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+     {0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384},
+     {0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320}}
+  };
+  static const uint32_t kRates[3] = {44100, 48000, 32000};
+  //Frame sync
+  if(h[0] != 0xFF || (h[1] & 0xE0) != 0xE0){
+    return 0;
+  }
+  //3 = MPEG1, 2 = MPEG2, 0 = MPEG2.5
+  uint8_t version = (h[1] >> 3) & 0x03;
+  //3 = Layer I, 2 = Layer II, 1 = Layer III
+  uint8_t layer_bits = (h[1] >> 1) & 0x03;
+  uint8_t bitrate = h[2] >> 4;
+  uint8_t rate = (h[2] >> 2) & 0x03;
+  //Free format bitrates can't be walked
+  if(version == 1 || layer_bits == 0 || bitrate == 0 || bitrate == 15 || rate == 3){
+    return 0;
+  }
+  bool mpeg1 = (version == 3);
+  uint8_t layer = 4 - layer_bits;
+  bool mono = ((h[3] >> 6) == 3);
+  uint32_t bps = kBitrates[mpeg1][layer - 1][bitrate] * 1000;
+  frame->rate = kRates[rate] >> (mpeg1 ? 0 : (version == 2) ? 1 : 2);
+  uint8_t padding = (h[2] >> 1) & 0x01;
+  if(layer == 1){
+    frame->samples = 384;
+    frame->len = (12 * bps / frame->rate + padding) * 4;
+  }
+  else{
+    frame->samples = (layer == 3 && !mpeg1) ? 576 : 1152;
+    frame->len = (frame->samples / 8) * bps / frame->rate + padding;
+  }
+  //Layer III side info sits between the header and a VBR header
+  frame->side = 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+  return 1;
+}
+
+//Parse the header at the top of an ID3v2 tag
+//@param header: The first MPEG_TAG_HEADER_SIZE bytes of the file
+//@param tag: Filled in with where the tag ends
+//@return bool: False if there's no tag we know how to read
+inline bool ParseTag(const uint8_t *header, Tag *tag){
+  if(memcmp(header, "ID3", 3) || header[3] < 2 || header[3] > 4){
+    return 0;
+  }
+  tag->version = header[3];
+  tag->flags = header[5];
+  //The size doesn't count the header
+  tag->end = MPEG_TAG_HEADER_SIZE + SyncSafe(&header[6]);
+  tag->audio_start = tag->end + ((tag->flags & 0x10) ? MPEG_TAG_HEADER_SIZE : 0);
+  return 1;
+}
+
+//Get the size of an ID3v2 frame's data from its header. v2.2 frames have 3
+//character IDs and 3 byte sizes, and only v2.4 sizes are sync safe
+//@param fh: The frame header
+//@param version: The tag's version
+//@return uint32_t: The bytes of data after the header
+inline uint32_t TagFrameSize(const uint8_t *fh, uint8_t version){
+  if(version == 2){
+    return BigEndian(&fh[3], 3);
+  }
+  return (version == 4) ? SyncSafe(&fh[4]) : BigEndian(&fh[4], 4);
+}
+
+//Copy an ID3v2 text frame into a string, as plain ASCII. The screen only has
+//ASCII, anything else is a '?'
+//@param dst: The string
+//@param size: Its size, terminator included
+//@param src: The frame data, starting with the encoding byte
+//@param len: The bytes of frame data
+inline void CopyTagText(char *dst, uint16_t size, const uint8_t *src, uint16_t len){
+  uint16_t out = 0;
+  dst[0] = 0;
+  if(len < 1){
+    return;
+  }
+  uint8_t encoding = src[0];
+  uint16_t i = 1;
+  //UTF-16, with a byte order mark for encoding 1 and big endian for 2
+  if(encoding == 1 || encoding == 2){
+    bool big = (encoding == 2);
+    if(encoding == 1 && len >= 3){
+      big = (src[1] == 0xFE);
+      i = 3;
+    }
+    for(; i + 1 < len && out < size - 1; i += 2){
+      uint16_t c = big ? ((src[i] << 8) | src[i + 1]) : ((src[i + 1] << 8) | src[i]);
+      if(c == 0){
+        break;
+      }
+      dst[out++] = (c >= ' ' && c < 0x7F) ? c : '?';
+    }
+  }
+  //ISO-8859-1 or UTF-8. UTF-8 continuation bytes are dropped so each
+  //character is one '?'
+  else{
+    for(; i < len && src[i] && out < size - 1; i++){
+      uint8_t c = src[i];
+      if(encoding == 3 && (c & 0xC0) == 0x80){
+        continue;
+      }
+      dst[out++] = (c >= ' ' && c < 0x7F) ? c : '?';
+    }
+  }
+  dst[out] = 0;
+}
+
+//Copy one of an ID3v1 tag's fixed width fields into a string, as plain ASCII
+//@param dst: The string
+//@param size: Its size, terminator included
+//@param src: The field, padded with spaces or zeroes
+//@param len: The field's width
+inline void CopyFixedText(char *dst, uint16_t size, const uint8_t *src, uint8_t len){
+  while(len && (src[len - 1] == ' ' || src[len - 1] == 0)){
+    len--;
+  }
+  uint16_t out = 0;
+  for(; out < len && out < size - 1; out++){
+    dst[out] = (src[out] >= ' ' && src[out] < 0x7F) ? src[out] : '?';
+  }
+  dst[out] = 0;
+}
+
+}
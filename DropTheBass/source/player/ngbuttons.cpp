@@ -0,0 +1,127 @@
+#include "ngbuttons.hpp"
+
+constexpr Buttons::Config Buttons::kDefaultConfig;
+
+void Buttons::Init(Callback callback, const Config &config){
+  _callback = callback;
+  _config = config;
+  _count = 0;
+  _settle = config.debounce_ms / config.sample_ms;
+  if(_settle < 1){
+    _settle = 1;
+  }
+  //One shared timer for every button. It's stopped until an edge wakes it up
+  _timer = xTimerCreate("buttons", pdMS_TO_TICKS(config.sample_ms), pdTRUE, this, Sample);
+}
+
+uint8_t Buttons::Add(GPIO *pin, uint8_t uses){
+  if(_count >= BUTTON_MAX){
+    LOG_ERROR("Too many buttons!");
+    return BUTTON_MAX - 1;
+  }
+  Button &button = _buttons[_count];
+  button.pin = pin;
+  button.uses = uses;
+  button.state = kIdle;
+  button.integrator = 0;
+  button.down = 0;
+  button.since = 0;
+  return _count++;
+}
+
+void Buttons::WakeFromISR(){
+  BaseType_t woken = pdFALSE;
+  //Starting a running timer just restarts it, that's fine
+  xTimerStartFromISR(_timer, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+bool Buttons::Update(uint8_t index, TickType_t now){
+  Button &button = _buttons[index];
+  //Integrating debounce: the button has to read the same way for _settle
+  //samples in a row before it changes state
+  if(button.pin->ReadBool()){
+    if(button.integrator < _settle){
+      button.integrator++;
+    }
+  }
+  else if(button.integrator > 0){
+    button.integrator--;
+  }
+  bool pressed = button.down;
+  if(button.integrator == _settle){
+    pressed = 1;
+  }
+  else if(button.integrator == 0){
+    pressed = 0;
+  }
+  bool edge = (pressed != button.down);
+  button.down = pressed;
+
+  switch(button.state){
+    case kIdle :
+      if(edge && pressed){
+        if(button.uses == kUseShort){
+          //Nothing to wait for, fire right away
+          _callback(index, kShort);
+          button.state = kHeld;
+        }
+        else{
+          button.state = kPressed;
+          button.since = now;
+        }
+      }
+      break;
+
+    case kPressed :
+      if(edge && !pressed){
+        if(button.uses & kUseDouble){
+          button.state = kWaitDouble;
+          button.since = now;
+        }
+        else{
+          _callback(index, kShort);
+          button.state = kIdle;
+        }
+      }
+      else if((button.uses & kUseLong) &&
+              (now - button.since) >= pdMS_TO_TICKS(_config.long_ms)){
+        _callback(index, kLong);
+        button.state = kHeld;
+      }
+      break;
+
+    case kHeld :
+      if(edge && !pressed){
+        button.state = kIdle;
+      }
+      break;
+
+    case kWaitDouble :
+      if(edge && pressed){
+        _callback(index, kDouble);
+        button.state = kHeld;
+      }
+      else if((now - button.since) >= pdMS_TO_TICKS(_config.double_ms)){
+        _callback(index, kShort);
+        button.state = kIdle;
+      }
+      break;
+  }
+  //Keep sampling while the pin is bouncing or we're timing a gesture
+  bool settled = (button.integrator == 0 || button.integrator == _settle);
+  return !settled || button.state == kPressed || button.state == kWaitDouble;
+}
+
+void Buttons::Sample(TimerHandle_t timer){
+  Buttons *buttons = (Buttons *)pvTimerGetTimerID(timer);
+  TickType_t now = xTaskGetTickCount();
+  bool busy = 0;
+  for(uint8_t i = 0; i < buttons->_count; i++){
+    busy |= buttons->Update(i, now);
+  }
+  //Everything's settled, go back to sleep until the next edge
+  if(!busy){
+    xTimerStop(timer, 0);
+  }
+}
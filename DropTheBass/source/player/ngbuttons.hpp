@@ -0,0 +1,108 @@
+#pragma once
+
+#include "../nxp/nggpio.hpp"
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/timers.h"
+
+#include <cstdint>
+
+//The most buttons one Buttons object can watch
+#define BUTTON_MAX 4
+
+//Debounces a set of buttons and turns them into short, long and double presses.
+//Button edges only wake up a FreeRTOS timer, and the timer samples every
+//button until they've all settled. Nothing runs while no one is touching the
+//buttons.
+class Buttons{
+public:
+  //The kinds of presses
+  enum Gesture : uint8_t
+  {
+    kShort  = 0,
+    kLong   = 1,
+    kDouble = 2
+  };
+
+  //Which gestures a button cares about. A button that only uses short presses
+  //fires as soon as it's debounced. Otherwise it has to wait to see if the
+  //press turns into a long or double press
+  enum Uses : uint8_t
+  {
+    kUseShort   = 0,
+    kUseLong    = (1 << 0),
+    kUseDouble  = (1 << 1)
+  };
+
+  //Timing settings, all in milliseconds
+  struct Config{
+    //How often to sample the buttons while any of them are moving
+    uint8_t sample_ms;
+    //How long a button has to read the same way before it counts
+    uint8_t debounce_ms;
+    //How long to hold a button for a long press
+    uint16_t long_ms;
+    //The longest gap between the presses of a double press
+    uint16_t double_ms;
+  };
+
+  static constexpr Config kDefaultConfig = {5, 15, 600, 250};
+
+  //Called from the timer task whenever a button makes a gesture
+  //@param button: The index Add() returned for the button
+  //@param gesture: The kind of press
+  typedef void (*Callback)(uint8_t button, Gesture gesture);
+
+  //Set up the sampler
+  //@param callback: Where to send gestures
+  //@param config: The timing settings
+  void Init(Callback callback, const Config &config=kDefaultConfig);
+
+  //Start watching a button. It reads high when pressed
+  //@param pin: The button's GPIO
+  //@param uses: The gestures this button uses, ORed together
+  //@return uint8_t: The button's index
+  uint8_t Add(GPIO *pin, uint8_t uses=kUseShort);
+
+  //Call this from every button's edge ISR. Wakes up the sampler
+  void WakeFromISR();
+
+private:
+  //Where each button is in making a gesture
+  enum State : uint8_t
+  {
+    kIdle,
+    //Down, waiting to see if it's a long press
+    kPressed,
+    //Down, and we've already sent its gesture
+    kHeld,
+    //Released, waiting to see if there's a second press
+    kWaitDouble
+  };
+
+  struct Button{
+    GPIO *pin;
+    uint8_t uses;
+    State state;
+    //Counts up while the pin reads pressed, down while it reads released
+    uint8_t integrator;
+    //The debounced state of the button
+    bool down;
+    //When the button last changed state
+    TickType_t since;
+  };
+
+  //Run the debouncer and state machine on one button
+  //@return bool: True if the button still needs sampling
+  bool Update(uint8_t index, TickType_t now);
+  //The timer callback. Samples every button, stops itself when they settle
+  static void Sample(TimerHandle_t timer);
+
+  Button _buttons[BUTTON_MAX];
+  uint8_t _count;
+  Config _config;
+  //The number of samples in a row that makes a button settled
+  uint8_t _settle;
+  Callback _callback;
+  TimerHandle_t _timer;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+
+//The player's I2C register map, for a master MCU driving one or more players.
+//Multi byte registers are little endian. Status is refreshed every
+//CONTROL_STATUS_PERIOD ms, and as soon as a write has been carried out, and a
+//multi register read always comes from a single refresh.
+//
+//Writes are queued to the player and carried out in the background, so read
+//the register back to see when it took. Anything not marked writable is read
+//only, and writes to it are ignored.
+
+//The slave address. Give each board on the bus its own
+#ifndef CONTROL_I2C_ADDR
+#define CONTROL_I2C_ADDR        0x42
+#endif
+//How often the status registers are refreshed, in ms. The decode time only
+//moves once a second
+#ifndef CONTROL_STATUS_PERIOD
+#define CONTROL_STATUS_PERIOD   1000
+#endif
+
+namespace control{
+
+enum Reg : uint8_t
+{
+  //uint8 PlayerFsm::State
+  kState        = 0x00,
+  //uint8 1 while a song is playing, 0 while paused or stopped. Writable: 0 to
+  //pause, 1 to carry on
+  kPlaying      = 0x01,
+  //uint8 attenuation, 0 is loudest. Writable
+  kVolume       = 0x02,
+  //uint8 from 0 to 15. Writable
+  kBass         = 0x03,
+  //uint16 the song's place in the play queue. Writable: the index of a song
+  //in the library to play. Unless the queue is shuffled or from the playlist
+  //file, the two are the same
+  kTrack        = 0x04,
+  //uint16 songs in the play queue
+  kTrackCount   = 0x06,
+  //uint16 seconds into the song
+  kDecodeTime   = 0x08,
+  //uint8 full buffers waiting for the decoder right now, out of kBufferTotal
+  kBufferFull   = 0x0A,
+  //uint8 the fewest full buffers the decoder has found this song
+  kBufferLow    = 0x0B,
+  //uint8 buffers in the pipeline
+  kBufferTotal  = 0x0C,
+  //uint8 bumped on every refresh, so a master can tell the player is alive
+  kSequence     = 0x0D,
+  //uint16 times the decoder ran dry this song
+  kUnderruns    = 0x0E
+};
+
+}
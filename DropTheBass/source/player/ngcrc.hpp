@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+//CRC-16/CCITT-FALSE: polynomial 0x1021, starting at 0xFFFF. Pass the result
+//back in as crc to keep going over more data
+//@param buf: The data
+//@param len: The number of bytes
+//@param crc: The CRC so far
+//@return uint16_t: The CRC including this data
+inline uint16_t Crc16(const uint8_t *buf, uint32_t len, uint16_t crc=0xFFFF){
+  for(uint32_t i = 0; i < len; i++){
+    crc ^= buf[i] << 8;
+    for(uint8_t bit = 0; bit < 8; bit++){
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,200 @@
+#include "ngflashcache.hpp"
+
+#include "third_party/FreeRTOS/Source/include/task.h"
+
+#include "ngcrc.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+//"DTBC"
+#define FLASH_CACHE_MAGIC 0x43425444
+
+void FlashCache::Init(Adesto *flash, SemaphoreHandle_t bus){
+  Header header;
+  if(flash->GetSize() < ADESTO_SIZE){
+    LOG_ERROR("Flash cache: The flash is smaller than %d KB, the cache is off", ADESTO_SIZE / 1024);
+    return;
+  }
+  _flash = flash;
+  _bus = bus;
+  _requests = xQueueCreate(FLASH_CACHE_REQUESTS, sizeof(Job));
+  uint8_t found = 0;
+  for(uint8_t i = 0; i < FLASH_CACHE_SLOTS; i++){
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    _flash->Read((uint8_t*)&header, SlotAddr(i) + FLASH_CACHE_BLOCK - ADESTO_PAGE_SIZE, sizeof(header));
+    xSemaphoreGive(_bus);
+    bool ok = header.magic == FLASH_CACHE_MAGIC &&
+              header.len <= FLASH_CACHE_CHUNK &&
+              header.crc == Crc16((uint8_t*)&header, offsetof(Header, crc));
+    _dir[i].tag = header.tag;
+    _dir[i].key = header.key;
+    _dir[i].chunk = header.chunk;
+    _dir[i].len = ok ? header.len : 0;
+    _dir[i].used = 0;
+    found += ok;
+  }
+  LOG_INFO("Flash cache: %d of %d slots filled", found, FLASH_CACHE_SLOTS);
+}
+
+void FlashCache::SetKey(uint32_t key){
+  _key = key;
+}
+
+uint32_t FlashCache::Tag(const char *path, uint32_t size){
+  //FNV-1a over the path, mixed with the size
+  uint32_t hash = 2166136261u;
+  for(uint16_t i = 0; path[i]; i++){
+    hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+  }
+  return hash ^ (size * 2654435761u);
+}
+
+bool FlashCache::Read(uint32_t tag, uint32_t pos, uint8_t *buf, uint32_t len){
+  if(_flash == NULL){
+    return 0;
+  }
+  int16_t slot = Find(tag, pos / FLASH_CACHE_CHUNK);
+  uint32_t offset = pos % FLASH_CACHE_CHUNK;
+  //Don't wait around for an erase or write to finish, the SD card is quicker
+  if(slot < 0 || offset + len > _dir[slot].len || _flash->CheckBusy()){
+    _misses++;
+    return 0;
+  }
+  _flash->Read(buf, SlotAddr(slot) + offset, len);
+  _dir[slot].used = ++_clock;
+  _hits++;
+  return 1;
+}
+
+void FlashCache::Request(const char *path, uint32_t tag, uint32_t pos){
+  static Job request;
+  if(_flash == NULL || strlen(path) >= FLASH_CACHE_PATH_SIZE){
+    return;
+  }
+  if(Find(tag, pos / FLASH_CACHE_CHUNK) >= 0){
+    return;
+  }
+  //The bus guards the static buffer too
+  request.tag = tag;
+  request.chunk = pos / FLASH_CACHE_CHUNK;
+  strcpy(request.path, path);
+  //If the queue is full, it'll be asked for again next time it misses
+  xQueueSend(_requests, &request, 0);
+}
+
+bool FlashCache::Fill(){
+  //All too big for a low priority task's stack
+  static Job request;
+  static uint8_t page[ADESTO_PAGE_SIZE];
+  static FIL file;
+  if(_flash == NULL || xQueueReceive(_requests, &request, 0) != pdTRUE){
+    return 0;
+  }
+  TickType_t start = xTaskGetTickCount();
+  //Empty the slot first, so nothing reads it while it's being rewritten
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  if(Find(request.tag, request.chunk) >= 0){
+    xSemaphoreGive(_bus);
+    return 1;
+  }
+  uint8_t slot = Victim();
+  _dir[slot].len = 0;
+  uint32_t key = _key;
+  bool ok = f_open(&file, request.path, FA_READ) == FR_OK;
+  uint32_t begin = request.chunk * FLASH_CACHE_CHUNK;
+  uint32_t len = 0;
+  if(ok){
+    //The file has changed since it was asked for
+    ok = Tag(request.path, f_size(&file)) == request.tag && begin < f_size(&file) &&
+         f_lseek(&file, begin) == FR_OK;
+    len = ok ? f_size(&file) - begin : 0;
+    len = (len > FLASH_CACHE_CHUNK) ? FLASH_CACHE_CHUNK : len;
+    if(!ok){
+      f_close(&file);
+    }
+  }
+  if(ok){
+    _flash->Erase(SlotAddr(slot), Adesto::k64K);
+  }
+  xSemaphoreGive(_bus);
+  if(!ok){
+    return 1;
+  }
+  _flash->WaitReady(_bus);
+  //A page at a time, only holding the bus while it moves
+  for(uint32_t done = 0; ok && done < len; done += ADESTO_PAGE_SIZE){
+    UINT want = (len - done < ADESTO_PAGE_SIZE) ? len - done : ADESTO_PAGE_SIZE;
+    UINT bytes;
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    ok = f_read(&file, page, want, &bytes) == FR_OK && bytes == want;
+    if(ok){
+      _flash->Write(page, SlotAddr(slot) + done, want);
+    }
+    xSemaphoreGive(_bus);
+    _flash->WaitReady(_bus);
+  }
+  Header header = {FLASH_CACHE_MAGIC, request.tag, key, request.chunk, (uint16_t)len, 0};
+  header.crc = Crc16((uint8_t*)&header, offsetof(Header, crc));
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  f_close(&file);
+  if(ok){
+    _flash->Write((uint8_t*)&header, SlotAddr(slot) + FLASH_CACHE_BLOCK - ADESTO_PAGE_SIZE, sizeof(header));
+  }
+  xSemaphoreGive(_bus);
+  if(!ok){
+    LOG_WARNING("Flash cache: Couldn't copy %s", request.path);
+    return 1;
+  }
+  _flash->WaitReady(_bus);
+  //Only now can it be read
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  _dir[slot].tag = request.tag;
+  _dir[slot].key = key;
+  _dir[slot].chunk = request.chunk;
+  _dir[slot].len = len;
+  _dir[slot].used = ++_clock;
+  xSemaphoreGive(_bus);
+  LOG_INFO("Flash cache: %lu bytes of %s into slot %d in %lu ms", len, request.path, slot,
+           (xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+  return 1;
+}
+
+uint32_t FlashCache::GetHits(){
+  return _hits;
+}
+
+uint32_t FlashCache::GetMisses(){
+  return _misses;
+}
+
+void FlashCache::LogStats(){
+  uint32_t total = _hits + _misses;
+  LOG_INFO("Flash cache: %lu hits, %lu misses (%lu%%)", _hits, _misses, total ? _hits * 100 / total : 0);
+}
+
+int16_t FlashCache::Find(uint32_t tag, uint16_t chunk){
+  for(uint8_t i = 0; i < FLASH_CACHE_SLOTS; i++){
+    if(_dir[i].len && _dir[i].tag == tag && _dir[i].chunk == chunk && _dir[i].key == _key){
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint8_t FlashCache::Victim(){
+  uint8_t oldest = 0;
+  for(uint8_t i = 0; i < FLASH_CACHE_SLOTS; i++){
+    if(!_dir[i].len || _dir[i].key != _key){
+      return i;
+    }
+    if(_dir[i].used < _dir[oldest].used){
+      oldest = i;
+    }
+  }
+  return oldest;
+}
+
+uint32_t FlashCache::SlotAddr(uint8_t slot){
+  return slot * FLASH_CACHE_BLOCK;
+}
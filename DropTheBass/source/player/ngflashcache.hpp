@@ -0,0 +1,144 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/queue.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
+#include "utility/log.hpp"
+
+#include "third_party/fatfs/source/ff.h"
+
+#include "../peripherals/ngadesto.hpp"
+#include "ngresume.hpp"
+
+#include <cstdint>
+
+//Every slot is one 64K erase block. The last page holds the slot's header,
+//and the rest holds a chunk of a file
+#define FLASH_CACHE_BLOCK   0x10000
+//How much of a file each slot holds. A multiple of the pipeline buffers and
+//library pages, so cached reads never straddle two slots
+#define FLASH_CACHE_CHUNK   61440
+//Every whole block below the resume log
+#define FLASH_CACHE_SLOTS   (RESUME_BASE / FLASH_CACHE_BLOCK)
+//How many copy requests can wait for Fill
+#ifndef FLASH_CACHE_REQUESTS
+#define FLASH_CACHE_REQUESTS 4
+#endif
+//The longest path a request can hold, terminator included
+#define FLASH_CACHE_PATH_SIZE 256
+
+//A second tier cache for SD card files, in the Adesto flash. Files are cached
+//a chunk at a time, one chunk per 64K slot, with the least recently used slot
+//thrown out first. Only the chunks someone asks for get copied: the start of
+//every song that plays, and the parts of the library index the menu looks at.
+//
+//The copying is slow (it's the flash's erase and program time), so it's done
+//by Fill from a low priority task, with the bus only held while each command
+//goes out. Reads never wait for the flash: if it's busy, the read just misses
+//and the caller goes to the SD card.
+//
+//Each slot's header is written last, so a slot cut off by a power loss is
+//just empty. Everything cached is tied to the library key, so nothing stale
+//is served after the card changes.
+class FlashCache{
+public:
+  //Set up the cache and find what's already in the flash. Call once the SD
+  //card is mounted, since the flash is on its bus. The slots are laid out for
+  //an ADESTO_SIZE flash, so on anything smaller the cache stays off and every
+  //read misses
+  //@param flash: The flash chip, after its Init
+  //@param bus: The mutex for the SPI bus the flash and SD card are on
+  void Init(Adesto *flash, SemaphoreHandle_t bus);
+
+  //Set the key of the card the cache is for. Chunks cached from another card
+  //aren't used, and are the first to be thrown out
+  //@param key: The library key
+  void SetKey(uint32_t key);
+
+  //Work out the tag for a file. Files only match if they have the same path
+  //and size
+  //@param path: The full path
+  //@param size: The size of the file
+  //@return uint32_t: The tag
+  static uint32_t Tag(const char *path, uint32_t size);
+
+  //Read part of a file from the cache. Only hits if every byte asked for is
+  //in one cached chunk. Hold the bus while calling this
+  //@param tag: The file's tag
+  //@param pos: Where to start in the file
+  //@param buf: Filled in with the data
+  //@param len: The number of bytes
+  //@return bool: True on a hit. On a miss read the SD card instead
+  bool Read(uint32_t tag, uint32_t pos, uint8_t *buf, uint32_t len);
+
+  //Ask for the chunk of a file holding a position to be cached. Returns right
+  //away, the copy happens in Fill. Hold the bus while calling this
+  //@param path: The full path
+  //@param tag: The file's tag
+  //@param pos: Any position in the chunk
+  void Request(const char *path, uint32_t tag, uint32_t pos);
+
+  //Copy the oldest requested chunk into the flash. Call this from a low
+  //priority task, without holding the bus
+  //@return bool: False if there was nothing to do
+  bool Fill();
+
+  //Get the hit and miss counts
+  uint32_t GetHits();
+  uint32_t GetMisses();
+
+  //Log the hit rate
+  void LogStats();
+
+private:
+  //What's in a slot. Kept in RAM, and in the slot's last page in the flash
+  struct Entry{
+    uint32_t tag;
+    uint32_t key;
+    uint16_t chunk;
+    //The bytes cached, 0 if the slot is empty
+    uint16_t len;
+    //When the slot was last read, the oldest is thrown out first. Only kept in
+    //RAM
+    uint32_t used;
+  };
+
+  //A slot's header in the flash
+  struct Header{
+    uint32_t magic;
+    uint32_t tag;
+    uint32_t key;
+    uint16_t chunk;
+    uint16_t len;
+    uint16_t crc;
+  };
+
+  //A chunk waiting to be copied in
+  struct Job{
+    uint32_t tag;
+    uint16_t chunk;
+    char path[FLASH_CACHE_PATH_SIZE];
+  };
+
+  //Find the slot holding a chunk. Hold the bus while calling this
+  //@return int16_t: The slot, or -1 if it isn't cached
+  int16_t Find(uint32_t tag, uint16_t chunk);
+
+  //Pick the slot to throw out: an empty one, then one from another card,
+  //then the least recently used. Hold the bus while calling this
+  uint8_t Victim();
+
+  //Get the flash address of a slot
+  static uint32_t SlotAddr(uint8_t slot);
+
+  //NULL while the cache is off
+  Adesto *_flash = NULL;
+  SemaphoreHandle_t _bus;
+  QueueHandle_t _requests;
+  Entry _dir[FLASH_CACHE_SLOTS];
+  uint32_t _key = 0;
+  uint32_t _clock = 0;
+  uint32_t _hits = 0;
+  uint32_t _misses = 0;
+};
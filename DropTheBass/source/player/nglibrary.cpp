@@ -0,0 +1,434 @@
+#include "nglibrary.hpp"
+
+#include <string.h>
+#include <strings.h>
+
+//"DTBL"
+#define LIBRARY_MAGIC   0x4C425444
+//Bump this whenever the index layout changes
+#define LIBRARY_VERSION 3
+//The most songs a 16 bit song ID can reach
+#define LIBRARY_MAX_SONGS 0xFFFF
+
+//The scan matches extensions like .flac and builds paths from the names it
+//finds, both of which need the long names. Without LFN, fname is the 8.3 name
+#if !FF_USE_LFN
+#error "The song library needs long file names, set FF_USE_LFN in ffconf.h"
+#endif
+
+void SongLibrary::Init(SemaphoreHandle_t bus){
+  _bus = bus;
+  DropPages();
+}
+
+void SongLibrary::SetFlashCache(FlashCache *cache){
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  _flash_cache = cache;
+  xSemaphoreGive(_bus);
+}
+
+bool SongLibrary::Load(){
+  //The card changed in a way the key can't see, don't trust the index
+  if(_stale){
+    _stale = 0;
+    LOG_INFO("Library: A song has gone missing, scanning again");
+    return Scan();
+  }
+  uint32_t key;
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  bool ok = GetKey(&key);
+  xSemaphoreGive(_bus);
+  if(!ok){
+    LOG_ERROR("Library: Cannot read the SD card");
+    return 0;
+  }
+  //Nothing has changed since last time
+  if(_loaded && key == _key){
+    return 1;
+  }
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  ok = OpenIndex(key);
+  xSemaphoreGive(_bus);
+  if(ok){
+    LOG_INFO("Library: %d songs in the index", _count);
+    return 1;
+  }
+  return Scan();
+}
+
+bool SongLibrary::Scan(){
+  //These are big with long file names, keep them off the caller's stack. The
+  //folders are walked with a fixed stack of DIRs instead of recursion, so the
+  //scan takes the same stack no matter how deep the card goes
+  static DIR dirs[LIBRARY_MAX_DEPTH];
+  static uint16_t path_len[LIBRARY_MAX_DEPTH];
+  static char path[LIBRARY_NAME_SIZE];
+  static FILINFO fno;
+  static FIL out;
+  FRESULT res;
+  UINT bytes;
+  //The first cache slot doubles as the write buffer, so the cache goes
+  _loaded = 0;
+  DropPages();
+  uint8_t *page = _pages[0];
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  if(_open){
+    f_close(&_file);
+    _open = 0;
+  }
+  //Start at the root. Paths are built without the trailing slash
+  path[0] = 0;
+  path_len[0] = 0;
+  res = f_opendir(&dirs[0], "/");
+  if(res != FR_OK){
+    xSemaphoreGive(_bus);
+    LOG_ERROR("Library: Cannot open the root directory (%d)", res);
+    return 0;
+  }
+  if(f_open(&out, LIBRARY_INDEX_PATH, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK){
+    f_closedir(&dirs[0]);
+    xSemaphoreGive(_bus);
+    LOG_ERROR("Library: Cannot create the index");
+    return 0;
+  }
+  //Leave the header for last, once the count is known
+  bool ok = f_lseek(&out, LIBRARY_PAGE_SIZE) == FR_OK;
+  uint16_t skipped = 0;
+  int8_t depth = 0;
+  _scanned = 0;
+  while(ok && depth >= 0){
+    res = f_readdir(&dirs[depth], &fno);
+    //The end of a folder, go back up to its parent
+    if(res != FR_OK || fno.fname[0] == 0){
+      f_closedir(&dirs[depth]);
+      depth--;
+      if(depth >= 0){
+        path[path_len[depth]] = 0;
+      }
+      continue;
+    }
+    //Skip hidden and system files, like the recycle bin and our own index
+    if(fno.fattrib & (AM_HID | AM_SYS) || fno.fname[0] == '.' ||
+       (depth == 0 && !strcasecmp(fno.fname, LIBRARY_INDEX_NAME))){
+      continue;
+    }
+    //Add this entry to the path. Anything too long to store couldn't be
+    //opened later, so it's left out
+    uint16_t base = path_len[depth];
+    uint16_t len = base + 1 + strlen(fno.fname);
+    if(len >= LIBRARY_NAME_SIZE){
+      skipped++;
+      continue;
+    }
+    path[base] = '/';
+    strcpy(&path[base + 1], fno.fname);
+    if(fno.fattrib & AM_DIR){
+      //Go down into the folder, if there's room left in the DIR stack
+      if(depth + 1 < LIBRARY_MAX_DEPTH && f_opendir(&dirs[depth + 1], path) == FR_OK){
+        depth++;
+        path_len[depth] = len;
+      }
+      else{
+        LOG_WARNING("Library: Skipped %s", path);
+        path[base] = 0;
+      }
+      continue;
+    }
+    //Cheap check on the name first, then make sure the file really is audio
+    if(IsAudioName(fno.fname) && IsAudioFile(path)){
+      if(_scanned >= LIBRARY_MAX_SONGS){
+        LOG_WARNING("Library: Full at %lu songs", _scanned);
+        path[base] = 0;
+        break;
+      }
+      ok = AddRecord(&out, page, path, len);
+    }
+    path[base] = 0;
+  }
+  //Close anything left open if the scan stopped early
+  for(; depth >= 0; depth--){
+    f_closedir(&dirs[depth]);
+  }
+  //Write out the last partial page
+  uint16_t rest = (_scanned % LIBRARY_PAGE_SONGS) * LIBRARY_RECORD_SIZE;
+  if(ok && rest){
+    ok = f_write(&out, page, rest, &bytes) == FR_OK && bytes == rest;
+  }
+  //Mark the index invalid until the key is known
+  _count = _scanned;
+  ok = ok && WriteHeader(&out, 0);
+  f_close(&out);
+  //The key has to be read after writing, since the index takes up clusters
+  //too. Stamp it into the header now
+  if(ok && GetKey(&_key) && f_open(&out, LIBRARY_INDEX_PATH, FA_WRITE | FA_OPEN_EXISTING) == FR_OK){
+    ok = WriteHeader(&out, _key);
+    f_close(&out);
+  }
+  else{
+    ok = 0;
+  }
+  _open = ok && f_open(&_file, LIBRARY_INDEX_PATH, FA_READ) == FR_OK;
+  //The new index is a new file as far as the flash cache is concerned
+  if(_open){
+    _tag = FlashCache::Tag(LIBRARY_INDEX_PATH, f_size(&_file));
+  }
+  xSemaphoreGive(_bus);
+  if(!_open){
+    LOG_ERROR("Library: Cannot write the index");
+    return 0;
+  }
+  if(skipped){
+    LOG_WARNING("Library: Left out %d files with long paths", skipped);
+  }
+  LOG_INFO("Library: Scanned %d songs", _count);
+  _loaded = 1;
+  return 1;
+}
+
+const char* SongLibrary::BaseName(const char *path){
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+bool SongLibrary::IsAudioName(const char *name){
+  //Everything the VS1053 decodes that we can spot by the header
+  static const char *const kExtensions[] = {
+    "mp3", "mp2", "ogg", "flac", "wav", "aac", "m4a"
+  };
+  const char *dot = strrchr(name, '.');
+  if(dot == NULL){
+    return 0;
+  }
+  for(uint8_t i = 0; i < sizeof(kExtensions) / sizeof(kExtensions[0]); i++){
+    if(!strcasecmp(dot + 1, kExtensions[i])){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+bool SongLibrary::IsAudioFile(const char *path){
+  static FIL file;
+  uint8_t magic[12];
+  UINT bytes;
+  if(f_open(&file, path, FA_READ) != FR_OK){
+    return 0;
+  }
+  bool ok = f_read(&file, magic, sizeof(magic), &bytes) == FR_OK && bytes == sizeof(magic);
+  f_close(&file);
+  if(!ok){
+    return 0;
+  }
+  //ID3v2 tag in front of an MP3
+  if(!memcmp(magic, "ID3", 3)){
+    return 1;
+  }
+  //A bare MPEG audio frame sync, or an ADTS AAC sync
+  if(magic[0] == 0xFF && (magic[1] & 0xE0) == 0xE0){
+    return 1;
+  }
+  if(!memcmp(magic, "OggS", 4) || !memcmp(magic, "fLaC", 4)){
+    return 1;
+  }
+  if(!memcmp(magic, "RIFF", 4) && !memcmp(&magic[8], "WAVE", 4)){
+    return 1;
+  }
+  //MP4 container, for AAC in an .m4a
+  if(!memcmp(&magic[4], "ftyp", 4)){
+    return 1;
+  }
+  return 0;
+}
+
+bool SongLibrary::AddRecord(FIL *out, uint8_t *page, const char *path, uint16_t len){
+  UINT bytes;
+  uint8_t *record = &page[(_scanned % LIBRARY_PAGE_SONGS) * LIBRARY_RECORD_SIZE];
+  memset(record, 0, LIBRARY_RECORD_SIZE);
+  memcpy(record, path, len);
+  _scanned++;
+  //Write the page out once it's full
+  if(_scanned % LIBRARY_PAGE_SONGS == 0){
+    return f_write(out, page, LIBRARY_PAGE_SIZE, &bytes) == FR_OK &&
+           bytes == LIBRARY_PAGE_SIZE;
+  }
+  return 1;
+}
+
+uint16_t SongLibrary::GetCount(){
+  return _count;
+}
+
+bool SongLibrary::GetName(uint16_t id, char *name){
+  name[0] = 0;
+  if(!_loaded || id >= _count){
+    return 0;
+  }
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  uint8_t *page = GetPage(id / LIBRARY_PAGE_SONGS);
+  if(page != NULL){
+    memcpy(name, &page[(id % LIBRARY_PAGE_SONGS) * LIBRARY_RECORD_SIZE], LIBRARY_NAME_SIZE);
+    name[LIBRARY_NAME_SIZE - 1] = 0;
+  }
+  xSemaphoreGive(_bus);
+  return page != NULL;
+}
+
+bool SongLibrary::Find(const char *path, uint16_t *id){
+  if(!_loaded){
+    return 0;
+  }
+  for(uint32_t first = 0; first < _count; first += LIBRARY_PAGE_SONGS){
+    //Let go of the bus between pages so the reader doesn't starve
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    uint8_t *page = GetPage(first / LIBRARY_PAGE_SONGS);
+    bool found = 0;
+    for(uint16_t i = 0; page != NULL && i < LIBRARY_PAGE_SONGS && first + i < _count; i++){
+      if(!strncmp((const char*)&page[i * LIBRARY_RECORD_SIZE], path, LIBRARY_NAME_SIZE)){
+        *id = first + i;
+        found = 1;
+        break;
+      }
+    }
+    xSemaphoreGive(_bus);
+    if(page == NULL){
+      return 0;
+    }
+    if(found){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+uint32_t SongLibrary::GetKey(){
+  return _key;
+}
+
+void SongLibrary::MarkStale(){
+  _stale = 1;
+}
+
+uint32_t SongLibrary::GetHits(){
+  return _hits;
+}
+
+uint32_t SongLibrary::GetMisses(){
+  return _misses;
+}
+
+bool SongLibrary::GetKey(uint32_t *key){
+  static DIR dir;
+  static FILINFO fno;
+  FATFS *fs;
+  DWORD free_clusters;
+  if(f_getfree("", &free_clusters, &fs) != FR_OK){
+    return 0;
+  }
+  uint32_t hash = (free_clusters * 2654435761u) ^ fs->n_fatent;
+  //A rename, or a file swapped for one the same size, leaves the cluster
+  //counts alone. Mix in the name, size and time of every folder and song in
+  //the root as well, FNV-1a style. Our own files aren't songs, so saving them
+  //doesn't move the key
+  if(f_opendir(&dir, "/") != FR_OK){
+    return 0;
+  }
+  while(f_readdir(&dir, &fno) == FR_OK && fno.fname[0]){
+    if(!(fno.fattrib & AM_DIR) && !IsAudioName(fno.fname)){
+      continue;
+    }
+    for(const char *c = fno.fname; *c; c++){
+      hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)fno.fsize) * 16777619u;
+    hash = (hash ^ (((uint32_t)fno.fdate << 16) | fno.ftime)) * 16777619u;
+  }
+  f_closedir(&dir);
+  *key = hash;
+  return 1;
+}
+
+bool SongLibrary::OpenIndex(uint32_t key){
+  Header header;
+  UINT bytes;
+  if(_open){
+    f_close(&_file);
+    _open = 0;
+  }
+  DropPages();
+  if(f_open(&_file, LIBRARY_INDEX_PATH, FA_READ) != FR_OK){
+    return 0;
+  }
+  //The header is all that has to be read, the songs come in as they're needed
+  bool ok = f_read(&_file, &header, sizeof(header), &bytes) == FR_OK &&
+            bytes == sizeof(header) &&
+            header.magic == LIBRARY_MAGIC &&
+            header.version == LIBRARY_VERSION &&
+            header.record_size == LIBRARY_RECORD_SIZE &&
+            header.key == key &&
+            header.count <= LIBRARY_MAX_SONGS &&
+            f_size(&_file) >= LIBRARY_PAGE_SIZE + header.count * LIBRARY_RECORD_SIZE;
+  if(!ok){
+    f_close(&_file);
+    return 0;
+  }
+  _open = 1;
+  _tag = FlashCache::Tag(LIBRARY_INDEX_PATH, f_size(&_file));
+  _count = header.count;
+  _key = key;
+  _loaded = 1;
+  return 1;
+}
+
+bool SongLibrary::WriteHeader(FIL *file, uint32_t key){
+  UINT bytes;
+  Header header = {LIBRARY_MAGIC, LIBRARY_VERSION, LIBRARY_RECORD_SIZE, key, _count};
+  return f_lseek(file, 0) == FR_OK &&
+         f_write(file, &header, sizeof(header), &bytes) == FR_OK &&
+         bytes == sizeof(header);
+}
+
+uint8_t* SongLibrary::GetPage(uint32_t page){
+  uint8_t oldest = 0;
+  _clock++;
+  for(uint8_t i = 0; i < LIBRARY_CACHE_PAGES; i++){
+    if(_page_no[i] == (int32_t)page){
+      _page_used[i] = _clock;
+      _hits++;
+      return _pages[i];
+    }
+    if(_page_used[i] < _page_used[oldest]){
+      oldest = i;
+    }
+  }
+  //Not cached, read it over the least recently used page
+  _misses++;
+  UINT bytes;
+  uint32_t pos = LIBRARY_PAGE_SIZE + page * LIBRARY_PAGE_SIZE;
+  _page_no[oldest] = -1;
+  if(!_open){
+    return NULL;
+  }
+  //The flash is the next best thing to RAM. Whatever it doesn't have comes
+  //from the SD card, and gets copied over to the flash for next time
+  bool cached = _flash_cache != NULL && _flash_cache->Read(_tag, pos, _pages[oldest], LIBRARY_PAGE_SIZE);
+  if(!cached){
+    if(f_lseek(&_file, pos) != FR_OK ||
+       f_read(&_file, _pages[oldest], LIBRARY_PAGE_SIZE, &bytes) != FR_OK){
+      return NULL;
+    }
+    if(_flash_cache != NULL){
+      _flash_cache->Request(LIBRARY_INDEX_PATH, _tag, pos);
+    }
+  }
+  //The last page may be short, the rest of it is never looked at
+  _page_no[oldest] = page;
+  _page_used[oldest] = _clock;
+  return _pages[oldest];
+}
+
+void SongLibrary::DropPages(){
+  for(uint8_t i = 0; i < LIBRARY_CACHE_PAGES; i++){
+    _page_no[i] = -1;
+    _page_used[i] = 0;
+  }
+}
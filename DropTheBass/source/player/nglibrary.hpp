@@ -0,0 +1,166 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
+#include "utility/log.hpp"
+
+#include "third_party/fatfs/source/ff.h"
+
+#include "ngflashcache.hpp"
+
+#include <cstdint>
+
+//Where the index lives on the SD card
+#define LIBRARY_INDEX_PATH "/dtb.idx"
+//The name of the index, so the scan can skip it
+#define LIBRARY_INDEX_NAME "DTB.IDX"
+//Every song gets a fixed size record in the index, so finding song n is just
+//a seek. Paths that don't fit are left out of the library
+#define LIBRARY_RECORD_SIZE 256
+//The longest path GetName can hand back, terminator included
+#define LIBRARY_NAME_SIZE   LIBRARY_RECORD_SIZE
+//How many folders deep the scan goes. Each level costs one DIR
+#ifndef LIBRARY_MAX_DEPTH
+#define LIBRARY_MAX_DEPTH   8
+#endif
+//Records are read a sector at a time
+#define LIBRARY_PAGE_SIZE   512
+#define LIBRARY_PAGE_SONGS  (LIBRARY_PAGE_SIZE / LIBRARY_RECORD_SIZE)
+//The number of pages kept in RAM. This is all the RAM the library uses, no
+//matter how many songs there are
+#ifndef LIBRARY_CACHE_PAGES
+#define LIBRARY_CACHE_PAGES 4
+#endif
+
+//The list of songs on the SD card. The list itself stays on the card in an
+//index file of fixed size records; only the pages that have been looked at
+//recently are kept in RAM. The card is only walked when it has changed since
+//the index was saved. Every folder is searched, and only files the decoder
+//can play make it into the library.
+class SongLibrary{
+public:
+  //Set up the library
+  //@param bus: A mutex to hold around every SD card access
+  void Init(SemaphoreHandle_t bus);
+
+  //Read index pages from the flash cache when they're there, and ask for the
+  //ones that aren't
+  //@param cache: The cache, or NULL to only use the SD card
+  void SetFlashCache(FlashCache *cache);
+
+  //Make sure the library matches the SD card. Does nothing if the card hasn't
+  //changed since the last call, uses the saved index if it still matches,
+  //and only scans the card if neither does
+  //@return bool: True if the library is ready
+  bool Load();
+
+  //Walk every folder on the card and save a new index, whether the card has
+  //changed or not
+  //@return bool: True if the index could be built
+  bool Scan();
+
+  //Get the number of songs
+  uint16_t GetCount();
+
+  //Copy out the full path of a song
+  //@param id: The song, from 0 to GetCount() - 1
+  //@param name: A LIBRARY_NAME_SIZE buffer for the null terminated path
+  //@return bool: True if the path could be read
+  bool GetName(uint16_t id, char *name);
+
+  //Look a song up by its full path. Reads through the index a page at a
+  //time, so this can take a while on a big card
+  //@param path: The path to look for
+  //@param id: Filled in with the song
+  //@return bool: True if the song is in the library
+  bool Find(const char *path, uint16_t *id);
+
+  //Get the file name at the end of a path, for display
+  //@param path: A path from GetName
+  //@return const char*: The part after the last slash
+  static const char* BaseName(const char *path);
+
+  //Get the key of the card the library was built from. Song IDs only mean
+  //the same song while the key stays the same
+  uint32_t GetKey();
+
+  //Say that a song in the library has gone missing. The key only sees the
+  //root folder, so a rename further down is only found this way. The next
+  //Load scans the card whatever the key says
+  void MarkStale();
+
+  //Get the page cache hit and miss counts
+  uint32_t GetHits();
+  uint32_t GetMisses();
+
+private:
+  //The first sector of the index file
+  struct Header{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t key;
+    uint32_t count;
+  };
+
+  //Work out a key for the contents of the card. Folder timestamps aren't kept
+  //by FAT, so this uses the volume's cluster counts, which move whenever a
+  //file is added or removed, and the entries in the root folder
+  //@param key: Filled in with the key
+  //@return bool: True if the key could be read
+  bool GetKey(uint32_t *key);
+
+  //Check if a file name has an extension the decoder can play
+  //@param name: The file name
+  //@return bool: True if it might be audio
+  static bool IsAudioName(const char *name);
+
+  //Check the first bytes of a file for an audio format the decoder can play
+  //@param path: The full path of the file
+  //@return bool: True if it looks like audio
+  static bool IsAudioFile(const char *path);
+
+  //Append a record for a song to the page being built
+  //@return bool: False if the page couldn't be written
+  bool AddRecord(FIL *out, uint8_t *page, const char *path, uint16_t len);
+
+  //Open the index file if it was saved with this key
+  //@return bool: True if the index can be used
+  bool OpenIndex(uint32_t key);
+
+  //Write the first sector of the index
+  //@return bool: True if it was written
+  bool WriteHeader(FIL *file, uint32_t key);
+
+  //Find a page in the cache, reading it from the index if it isn't there
+  //@return uint8_t*: The page, or NULL if it couldn't be read
+  uint8_t* GetPage(uint32_t page);
+
+  //Throw away every cached page
+  void DropPages();
+
+  SemaphoreHandle_t _bus;
+  //The index, kept open for reading while the library is loaded
+  FIL _file;
+  bool _open = 0;
+  uint16_t _count = 0;
+  //Songs found while scanning, counted separately so _count stays valid
+  uint32_t _scanned = 0;
+  //The key of the card the library was built from
+  uint32_t _key = 0;
+  FlashCache *_flash_cache = NULL;
+  //The index file's tag in the flash cache
+  uint32_t _tag = 0;
+  bool _loaded = 0;
+  //Set by MarkStale
+  volatile bool _stale = 0;
+  uint8_t _pages[LIBRARY_CACHE_PAGES][LIBRARY_PAGE_SIZE];
+  //Which page of the index each cache slot holds, or -1 if it's empty
+  int32_t _page_no[LIBRARY_CACHE_PAGES];
+  //When each slot was last used, the oldest is thrown out first
+  uint32_t _page_used[LIBRARY_CACHE_PAGES];
+  uint32_t _clock = 0;
+  uint32_t _hits = 0;
+  uint32_t _misses = 0;
+};
@@ -0,0 +1,87 @@
+#include "ngpipeline.hpp"
+
+uint8_t Pipeline::_bufs[PIPE_BUF_COUNT][PIPE_BUF_SIZE];
+
+void Pipeline::Init(){
+  _free = xQueueCreate(PIPE_BUF_COUNT, sizeof(uint8_t*));
+  _full = xQueueCreate(PIPE_BUF_COUNT, sizeof(Block));
+  Reset();
+}
+
+void Pipeline::Reset(){
+  xQueueReset(_free);
+  xQueueReset(_full);
+  //Every buffer starts out empty
+  for(uint8_t i = 0; i < PIPE_BUF_COUNT; i++){
+    uint8_t *buf = _bufs[i];
+    xQueueSend(_free, &buf, 0);
+  }
+  ResetWatermarks();
+}
+
+uint8_t* Pipeline::GetFree(TickType_t wait){
+  uint8_t *buf;
+  if(!xQueueReceive(_free, &buf, wait)){
+    return NULL;
+  }
+  return buf;
+}
+
+void Pipeline::Commit(uint8_t *buf, uint16_t len, uint8_t flags, uint16_t arg, uint32_t pos){
+  Block block = {buf, len, flags, arg, pos};
+  //There's always room, there are only PIPE_BUF_COUNT buffers
+  xQueueSend(_full, &block, portMAX_DELAY);
+}
+
+bool Pipeline::GetFull(Block *block, TickType_t wait){
+  //Sample how far ahead the reader is before we take anything
+  uint8_t waiting = uxQueueMessagesWaiting(_full);
+  if(_primed){
+    if(waiting > _high){
+      _high = waiting;
+    }
+    if(waiting < _low){
+      _low = waiting;
+    }
+    if(waiting == 0){
+      _underruns++;
+    }
+  }
+  if(!xQueueReceive(_full, block, wait)){
+    return 0;
+  }
+  _primed = 1;
+  return 1;
+}
+
+void Pipeline::Release(Block *block){
+  xQueueSend(_free, &block->data, portMAX_DELAY);
+}
+
+uint8_t Pipeline::GetHighWatermark(){
+  return _high;
+}
+
+uint8_t Pipeline::GetLowWatermark(){
+  return _low;
+}
+
+uint16_t Pipeline::GetUnderruns(){
+  return _underruns;
+}
+
+uint8_t Pipeline::GetFullCount(){
+  return uxQueueMessagesWaiting(_full);
+}
+
+void Pipeline::ResetWatermarks(){
+  _high = 0;
+  _low = PIPE_BUF_COUNT;
+  _underruns = 0;
+  _primed = 0;
+}
+
+void Pipeline::LogWatermarks(){
+  LOG_INFO("Pipeline: high = %d, low = %d, underruns = %d of %d buffers",
+           _high, _low, _underruns, PIPE_BUF_COUNT);
+}
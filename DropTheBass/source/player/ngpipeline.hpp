@@ -0,0 +1,109 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/queue.h"
+
+#include "utility/log.hpp"
+
+#include <cstdint>
+
+//The number of buffers in the ring
+#ifndef PIPE_BUF_COUNT
+#define PIPE_BUF_COUNT 4
+#endif
+//The size of each buffer. Keep this a multiple of 512 so every SD card read
+//stays sector aligned
+#ifndef PIPE_BUF_SIZE
+#define PIPE_BUF_SIZE 2048
+#endif
+
+//A producer/consumer ring of song buffers. One task (the reader) fills free
+//buffers from the SD card and commits them, another task (the feeder) takes
+//the full buffers, streams them to the decoder and releases them. A slow SD
+//read only hurts if it takes longer than playing every full buffer.
+class Pipeline{
+public:
+  //Flags that travel with a block
+  enum Flags : uint8_t
+  {
+    kNone = 0,
+    //This is the last block of the song
+    kEnd  = (1 << 0),
+    //This is the first block after a seek
+    kSeek = (1 << 1),
+    //This is the first block of a song that follows straight on from the last
+    //one. The block's arg is the song
+    kTrackStart = (1 << 2),
+    //The block came from the flash cache instead of the SD card
+    kCached = (1 << 3)
+  };
+
+  //A buffer of song data handed from the reader to the feeder
+  struct Block{
+    uint8_t *data;
+    uint16_t len;
+    uint8_t flags;
+    //Extra information for the flags that need it
+    uint16_t arg;
+    //Where the data came from in the song's file
+    uint32_t pos;
+  };
+
+  //Create the queues and fill the free queue with every buffer
+  void Init();
+
+  //Put every buffer back in the free queue. Only call this when neither the
+  //reader nor the feeder are running
+  void Reset();
+
+  //Reader: Get an empty buffer to fill
+  //@param wait: How many ticks to wait for a free buffer
+  //@return uint8_t*: A PIPE_BUF_SIZE buffer, or NULL on timeout
+  uint8_t* GetFree(TickType_t wait);
+
+  //Reader: Hand a filled buffer to the feeder
+  //@param buf: The buffer from GetFree
+  //@param len: The number of valid bytes in the buffer
+  //@param flags: Flags for the feeder
+  //@param arg: Extra information for the flags
+  //@param pos: Where the data came from in the song's file
+  void Commit(uint8_t *buf, uint16_t len, uint8_t flags=kNone, uint16_t arg=0, uint32_t pos=0);
+
+  //Feeder: Get the next full buffer
+  //@param block: Filled in with the next block
+  //@param wait: How many ticks to wait for a full buffer
+  //@return bool: True if we got a block, false on timeout
+  bool GetFull(Block *block, TickType_t wait);
+
+  //Feeder: Give a buffer back to the reader
+  void Release(Block *block);
+
+  //Get the most full buffers the feeder has ever found waiting for it
+  uint8_t GetHighWatermark();
+
+  //Get the least full buffers the feeder has ever found waiting for it.
+  //Zero means the feeder caught up with the reader at least once
+  uint8_t GetLowWatermark();
+
+  //Get the number of times the feeder had to wait on an empty pipeline
+  uint16_t GetUnderruns();
+
+  //Get the number of full buffers waiting for the feeder right now
+  uint8_t GetFullCount();
+
+  //Clear the watermarks and underrun counter, ex: at the start of a song
+  void ResetWatermarks();
+
+  //Log the watermarks
+  void LogWatermarks();
+
+private:
+  static uint8_t _bufs[PIPE_BUF_COUNT][PIPE_BUF_SIZE];
+  QueueHandle_t _free;
+  QueueHandle_t _full;
+  uint8_t _high;
+  uint8_t _low;
+  uint16_t _underruns;
+  //Don't count the wait for the very first buffer as an underrun
+  bool _primed;
+};
@@ -0,0 +1,107 @@
+#include "ngplayerfsm.hpp"
+
+const PlayerFsm::Transition PlayerFsm::kTable[] = {
+  //State         Event           Next State      Action
+  {kScanning,     kLibraryReady,  kMenu,          kShowMenu},
+  {kScanning,     kResumeReady,   kPlaying,       kResumePlayback},
+
+  {kMenu,         kNext,          kMenu,          kMenuNext},
+  {kMenu,         kPrev,          kMenu,          kMenuPrev},
+  {kMenu,         kSel,           kPlaying,       kPlaySelected},
+  {kMenu,         kSelDouble,     kPlaying,       kPlayPlaylist},
+  {kMenu,         kSelLong,       kPlaying,       kPlaySerial},
+  {kMenu,         kLibraryReady,  kMenu,          kShowMenu},
+  {kMenu,         kRemotePlay,    kPlaying,       kPlayRemote},
+
+  {kPlaying,      kNext,          kPlaying,       kNextTrack},
+  {kPlaying,      kPrev,          kPlaying,       kPrevTrack},
+  {kPlaying,      kPause,         kPaused,        kPauseSong},
+  {kPlaying,      kSel,           kFuncPlaying,   kFuncOn},
+  {kPlaying,      kNextLong,      kPlaying,       kSeekForward},
+  {kPlaying,      kPrevLong,      kPlaying,       kSeekBack},
+  {kPlaying,      kSelDouble,     kPlaying,       kToggleContinuous},
+  {kPlaying,      kSelLong,       kPlaying,       kToggleShuffle},
+  {kPlaying,      kPauseDouble,   kPlaying,       kCycleRepeat},
+  {kPlaying,      kPauseLong,     kScanning,      kStopSong},
+  {kPlaying,      kTrackEnd,      kScanning,      kStopSong},
+  {kPlaying,      kQueueNext,     kPlaying,       kPlayNext},
+  {kPlaying,      kTrackFailed,   kScanning,      kStopSong},
+  {kPlaying,      kRemotePlay,    kPlaying,       kPlayRemote},
+  {kPlaying,      kRemoteSeek,    kPlaying,       kSeekBy},
+  {kPlaying,      kRemotePause,   kPaused,        kPauseSong},
+
+  {kPaused,       kPause,         kPlaying,       kResumeSong},
+  {kPaused,       kNext,          kPlaying,       kNextTrack},
+  {kPaused,       kPrev,          kPlaying,       kPrevTrack},
+  {kPaused,       kSel,           kFuncPaused,    kFuncOn},
+  {kPaused,       kNextLong,      kPaused,        kSeekForward},
+  {kPaused,       kPrevLong,      kPaused,        kSeekBack},
+  {kPaused,       kSelDouble,     kPaused,        kToggleContinuous},
+  {kPaused,       kSelLong,       kPaused,        kToggleShuffle},
+  {kPaused,       kPauseDouble,   kPaused,        kCycleRepeat},
+  {kPaused,       kPauseLong,     kScanning,      kStopSong},
+  {kPaused,       kTrackEnd,      kScanning,      kStopSong},
+  {kPaused,       kQueueNext,     kPlaying,       kPlayNext},
+  {kPaused,       kTrackFailed,   kScanning,      kStopSong},
+  {kPaused,       kRemotePlay,    kPlaying,       kPlayRemote},
+  {kPaused,       kRemoteSeek,    kPaused,        kSeekBy},
+  {kPaused,       kRemoteResume,  kPlaying,       kResumeSong},
+
+  {kFuncPlaying,  kNext,          kFuncPlaying,   kBassUp},
+  {kFuncPlaying,  kPrev,          kFuncPlaying,   kBassDown},
+  {kFuncPlaying,  kSel,           kPlaying,       kFuncOff},
+  {kFuncPlaying,  kPause,         kScanning,      kStopSong},
+  {kFuncPlaying,  kPauseLong,     kScanning,      kStopSong},
+  {kFuncPlaying,  kTrackEnd,      kScanning,      kStopSong},
+  {kFuncPlaying,  kQueueNext,     kFuncPlaying,   kPlayNext},
+  {kFuncPlaying,  kTrackFailed,   kScanning,      kStopSong},
+  {kFuncPlaying,  kRemotePlay,    kPlaying,       kPlayRemote},
+  {kFuncPlaying,  kRemoteSeek,    kFuncPlaying,   kSeekBy},
+  {kFuncPlaying,  kRemotePause,   kFuncPaused,    kPauseSong},
+
+  {kFuncPaused,   kNext,          kFuncPaused,    kBassUp},
+  {kFuncPaused,   kPrev,          kFuncPaused,    kBassDown},
+  {kFuncPaused,   kSel,           kPaused,        kFuncOff},
+  {kFuncPaused,   kPause,         kScanning,      kStopSong},
+  {kFuncPaused,   kPauseLong,     kScanning,      kStopSong},
+  {kFuncPaused,   kTrackEnd,      kScanning,      kStopSong},
+  {kFuncPaused,   kQueueNext,     kFuncPlaying,   kPlayNext},
+  {kFuncPaused,   kTrackFailed,   kScanning,      kStopSong},
+  {kFuncPaused,   kRemotePlay,    kPlaying,       kPlayRemote},
+  {kFuncPaused,   kRemoteSeek,    kFuncPaused,    kSeekBy},
+  {kFuncPaused,   kRemoteResume,  kFuncPlaying,   kResumeSong},
+
+  {kAny,          kRemoteVolume,  kAny,           kSetVolume},
+  {kAny,          kRemoteBass,    kAny,           kSetBass}
+};
+
+const uint8_t PlayerFsm::kTableLen = sizeof(kTable) / sizeof(kTable[0]);
+
+PlayerFsm::PlayerFsm(){
+  _state = kScanning;
+}
+
+PlayerFsm::Event PlayerFsm::ButtonEvent(uint8_t button, uint8_t gesture){
+  return (Event)(button * 3 + gesture);
+}
+
+PlayerFsm::Action PlayerFsm::Handle(Event event){
+  //The table is small, just walk it
+  for(uint8_t i = 0; i < kTableLen; i++){
+    if((kTable[i].state == _state || kTable[i].state == kAny) && kTable[i].event == event){
+      if(kTable[i].next != kAny){
+        _state = kTable[i].next;
+      }
+      return kTable[i].action;
+    }
+  }
+  return kNone;
+}
+
+PlayerFsm::State PlayerFsm::GetState(){
+  return _state;
+}
+
+bool PlayerFsm::CheckFunc(){
+  return _state == kFuncPlaying || _state == kFuncPaused;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstdint>
+
+//The player's state machine. It takes in events (button gestures and news from
+//the playback tasks) and hands back the action to take. It doesn't touch any
+//hardware or FreeRTOS, so it can be driven with made up event sequences.
+//
+//While a song is playing, the function key (Sel) doubles what the other
+//buttons do:
+//Pause = Pause/Resume Song
+//Prev = Previous Song
+//Next = Next Song
+//Pause + Func = Exit to Menu
+//Prev + Func = Decrease Bass
+//Next + Func = Increase Bass
+//Sel = Function Toggle
+//Hold Pause = Exit to Menu
+//Hold Next = Fast Forward
+//Hold Prev = Rewind
+//Double Tap Sel = Continuous Play Toggle (no gap between songs)
+//Hold Sel = Shuffle Toggle
+//Double Tap Pause = Next Repeat Mode
+//
+//In the menu, double tapping Sel plays the playlist file instead of the song
+//under the cursor, and holding Sel plays whatever streams in over the serial
+//port
+//
+//The remote control can start a song or seek from any state but kScanning,
+//pause and carry on like the Pause button, and set the volume and bass at any
+//time
+class PlayerFsm{
+public:
+  enum State : uint8_t
+  {
+    //Building the song list
+    kScanning,
+    //Choosing a song
+    kMenu,
+    kPlaying,
+    kPaused,
+    //Playing or paused with the function key on
+    kFuncPlaying,
+    kFuncPaused,
+    //Only used in the table: a row for every state, or a row that stays put
+    kAny
+  };
+
+  enum Event : uint8_t
+  {
+    //Button gestures, laid out as button * 3 + gesture so ButtonEvent() can
+    //work them out. The buttons go Prev, Sel, Pause, Next
+    kPrev,
+    kPrevLong,
+    kPrevDouble,
+    kSel,
+    kSelLong,
+    kSelDouble,
+    kPause,
+    kPauseLong,
+    kPauseDouble,
+    kNext,
+    kNextLong,
+    kNextDouble,
+    //The song list is ready
+    kLibraryReady,
+    //The song finished playing
+    kTrackEnd,
+    //The song finished playing and the play queue has another one. The
+    //argument is its position in the queue
+    kQueueNext,
+    //The song couldn't be opened
+    kTrackFailed,
+    //The song list is ready, and a song was playing when the power went out
+    kResumeReady,
+    //The remote control asked for a song. The argument is its library ID
+    kRemotePlay,
+    //The remote control asked for a seek. The argument is the seconds to jump,
+    //as an int16_t
+    kRemoteSeek,
+    //The remote control asked to pause or carry on
+    kRemotePause,
+    kRemoteResume,
+    //The remote control asked for a volume or bass. The argument is the level
+    kRemoteVolume,
+    kRemoteBass
+  };
+
+  enum Action : uint8_t
+  {
+    kNone,
+    //Draw the menu
+    kShowMenu,
+    //Move the menu cursor
+    kMenuNext,
+    kMenuPrev,
+    //Play the song under the menu cursor
+    kPlaySelected,
+    //Skip to the next or previous song
+    kNextTrack,
+    kPrevTrack,
+    kPauseSong,
+    kResumeSong,
+    //Stop playing and go back to the menu
+    kStopSong,
+    kBassUp,
+    kBassDown,
+    //Jump forward or back in the song
+    kSeekForward,
+    kSeekBack,
+    //Play the next song in the queue, after the last one ended on its own
+    kPlayNext,
+    //Turn continuous play on or off
+    kToggleContinuous,
+    //Queue up and play the playlist file
+    kPlayPlaylist,
+    //Turn shuffle on or off
+    kToggleShuffle,
+    //Go to the next repeat mode
+    kCycleRepeat,
+    //Pick the song back up from where the power went out
+    kResumePlayback,
+    //Play the song data coming in over the serial port
+    kPlaySerial,
+    //Drop whatever is playing and play the song the remote control asked for
+    kPlayRemote,
+    //Jump as far as the remote control asked
+    kSeekBy,
+    //Set the volume or bass to the event's argument
+    kSetVolume,
+    kSetBass,
+    //Turn the function key on or off
+    kFuncOn,
+    kFuncOff
+  };
+
+  PlayerFsm();
+
+  //Work out the event for a button gesture
+  //@param button: 0 = Prev, 1 = Sel, 2 = Pause, 3 = Next
+  //@param gesture: 0 = Short, 1 = Long, 2 = Double
+  static Event ButtonEvent(uint8_t button, uint8_t gesture);
+
+  //Run an event through the state machine
+  //@param event: The event that happened
+  //@return Action: What to do about it. kNone if the event doesn't mean
+  //anything in the current state
+  Action Handle(Event event);
+
+  //Get the current state
+  State GetState();
+
+  //Check to see if the function key is on
+  bool CheckFunc();
+
+private:
+  struct Transition{
+    State state;
+    Event event;
+    State next;
+    Action action;
+  };
+  //Every transition the player can make. Anything not in here is ignored
+  static const Transition kTable[];
+  static const uint8_t kTableLen;
+  State _state;
+};
@@ -0,0 +1,403 @@
+#include "ngplaylist.hpp"
+
+#include "third_party/FreeRTOS/Source/include/task.h"
+
+#include <string.h>
+
+//"DTBQ"
+#define PLAYLIST_MAGIC  0x51425444
+//How much of an M3U is read at a time
+#define PLAYLIST_CHUNK  128
+
+void Playlist::Init(SongLibrary *library, SemaphoreHandle_t bus){
+  _library = library;
+  _bus = bus;
+  _lock = xSemaphoreCreateMutex();
+}
+
+void Playlist::UseLibrary(uint16_t id){
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _source = kLibrary;
+  _count = _library->GetCount();
+  if(id >= _count){
+    LOG_WARNING("Playlist: Song %d is not in the library of %d", id, _count);
+    id = 0;
+  }
+  _position = id;
+  if(_shuffle){
+    _seed = (xTaskGetTickCount() * 2654435761u) ^ _seed;
+    Shuffle(id);
+  }
+  xSemaphoreGive(_lock);
+}
+
+bool Playlist::LoadM3u(const char *path){
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool ok = IndexM3u(path);
+  if(ok){
+    _source = kM3u;
+    strncpy(_m3u, path, LIBRARY_NAME_SIZE - 1);
+    _m3u[LIBRARY_NAME_SIZE - 1] = 0;
+    _position = 0;
+    if(_shuffle){
+      _seed = (xTaskGetTickCount() * 2654435761u) ^ _seed;
+      Shuffle(0);
+    }
+  }
+  xSemaphoreGive(_lock);
+  if(!ok){
+    //The checkpoints are gone, so fall back to the library
+    LOG_WARNING("Playlist: Cannot load %s", path);
+    UseLibrary(0);
+  }
+  return ok;
+}
+
+void Playlist::SetShuffle(bool on){
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if(_count && on != _shuffle){
+    //Stay on the same song either way
+    uint16_t entry = GetEntry(_position);
+    _shuffle = on;
+    if(on){
+      _seed = (xTaskGetTickCount() * 2654435761u) ^ _seed;
+      Shuffle(entry);
+      _position = 0;
+    }
+    else{
+      _position = entry;
+    }
+  }
+  _shuffle = on;
+  xSemaphoreGive(_lock);
+}
+
+bool Playlist::GetShuffle(){
+  return _shuffle;
+}
+
+void Playlist::SetRepeat(Repeat repeat){
+  _repeat = repeat;
+}
+
+Playlist::Repeat Playlist::GetRepeat(){
+  return _repeat;
+}
+
+uint16_t Playlist::GetCount(){
+  return _count;
+}
+
+bool Playlist::FromLibrary(){
+  return _source == kLibrary;
+}
+
+uint16_t Playlist::GetPosition(){
+  return _position;
+}
+
+void Playlist::SetPosition(uint16_t pos){
+  if(pos < _count){
+    _position = pos;
+  }
+}
+
+bool Playlist::Peek(uint16_t *pos){
+  if(_repeat == kRepeatOne){
+    return *pos < _count;
+  }
+  if(*pos + 1 < _count){
+    (*pos)++;
+    return 1;
+  }
+  if(_repeat == kRepeatAll && _count){
+    *pos = 0;
+    return 1;
+  }
+  return 0;
+}
+
+void Playlist::Next(){
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _position = (_position + 1 >= _count) ? 0 : _position + 1;
+  xSemaphoreGive(_lock);
+}
+
+void Playlist::Prev(){
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _position = (_position == 0) ? ((_count) ? _count - 1 : 0) : _position - 1;
+  xSemaphoreGive(_lock);
+}
+
+bool Playlist::GetPath(uint16_t pos, char *path){
+  path[0] = 0;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if(pos >= _count){
+    xSemaphoreGive(_lock);
+    return 0;
+  }
+  uint16_t entry = GetEntry(pos);
+  bool ok = 1;
+  if(_source == kM3u){
+    ok = ReadM3uEntry(entry, path);
+  }
+  xSemaphoreGive(_lock);
+  //The library does its own locking
+  if(_source == kLibrary){
+    ok = _library->GetName(entry, path);
+  }
+  return ok;
+}
+
+bool Playlist::Save(){
+  static State state;
+  UINT bytes;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  state.magic = PLAYLIST_MAGIC;
+  state.library_key = _library->GetKey();
+  state.seed = _seed;
+  state.position = _position;
+  state.front = _front;
+  state.source = _source;
+  state.shuffle = _shuffle;
+  state.repeat = _repeat;
+  memcpy(state.m3u, _m3u, LIBRARY_NAME_SIZE);
+  xSemaphoreGive(_lock);
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  //Songs start far more often than the queue changes in a way worth keeping,
+  //so don't wear the card out rewriting the same bytes
+  bool ok = !memcmp(&state, &_saved, sizeof(state));
+  if(!ok && f_open(&_file, PLAYLIST_STATE_PATH, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK){
+    ok = f_write(&_file, &state, sizeof(state), &bytes) == FR_OK && bytes == sizeof(state);
+    f_close(&_file);
+    //Half a write leaves the card matching neither, so try again next time
+    memcpy(&_saved, &state, sizeof(state));
+    if(!ok){
+      _saved.magic = 0;
+    }
+  }
+  xSemaphoreGive(_bus);
+  return ok;
+}
+
+bool Playlist::Restore(){
+  //Read straight into _saved, it's what's on the card
+  State &state = _saved;
+  UINT bytes;
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  bool ok = f_open(&_file, PLAYLIST_STATE_PATH, FA_READ) == FR_OK;
+  if(ok){
+    ok = f_read(&_file, &state, sizeof(state), &bytes) == FR_OK && bytes == sizeof(state);
+    f_close(&_file);
+  }
+  if(!ok){
+    state.magic = 0;
+  }
+  xSemaphoreGive(_bus);
+  if(!ok || state.magic != PLAYLIST_MAGIC || state.repeat > kRepeatOne){
+    return 0;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if(state.source == kM3u){
+    //The path is checked against the file, so leave the saved copy alone
+    memcpy(_m3u, state.m3u, LIBRARY_NAME_SIZE);
+    _m3u[LIBRARY_NAME_SIZE - 1] = 0;
+    ok = IndexM3u(_m3u);
+  }
+  else{
+    //Song IDs only line up with the library they were saved from
+    ok = state.library_key == _library->GetKey();
+    _count = _library->GetCount();
+  }
+  ok = ok && state.position < _count && state.front < _count;
+  if(ok){
+    _source = (Source)state.source;
+    _shuffle = state.shuffle;
+    _repeat = (Repeat)state.repeat;
+    _seed = state.seed;
+    //The same seed and front entry shuffle out the same queue as last time
+    if(_shuffle){
+      Shuffle(state.front);
+    }
+    _position = state.position;
+  }
+  xSemaphoreGive(_lock);
+  if(!ok){
+    UseLibrary(0);
+  }
+  return ok;
+}
+
+void Playlist::Shuffle(uint16_t front){
+  //Nothing to shuffle, and Permute would never find a number in range
+  if(_count == 0){
+    return;
+  }
+  //The permutation covers the smallest even number of bits that reaches
+  //every entry
+  _half_bits = 1;
+  while((1ul << (2 * _half_bits)) < _count){
+    _half_bits++;
+  }
+  //Put the song we're on first, by swapping it with whatever the permutation
+  //put there
+  _front = front;
+  _front_at = Permute(front, 0);
+}
+
+uint16_t Playlist::GetEntry(uint16_t pos){
+  if(!_shuffle){
+    return pos;
+  }
+  if(pos == 0){
+    return _front;
+  }
+  if(pos == _front_at){
+    return Permute(0, 1);
+  }
+  return Permute(pos, 1);
+}
+
+uint16_t Playlist::Permute(uint16_t x, bool forward){
+  //A Feistel network shuffles every number of 2 * _half_bits bits, whatever
+  //the round function does, and runs backwards just as easily. Numbers past
+  //the end of the queue go round again until one lands inside it, which
+  //leaves a shuffle of just 0 to _count - 1. At most 3 in 4 numbers are past
+  //the end, so it rarely takes more than a few goes
+  uint32_t mask = (1ul << _half_bits) - 1;
+  uint32_t n = x;
+  do{
+    uint32_t left = n >> _half_bits;
+    uint32_t right = n & mask;
+    for(uint8_t i = 0; i < PLAYLIST_ROUNDS; i++){
+      uint32_t t;
+      if(forward){
+        t = left ^ (Round(right, i) & mask);
+        left = right;
+        right = t;
+      }
+      else{
+        t = right ^ (Round(left, PLAYLIST_ROUNDS - 1 - i) & mask);
+        right = left;
+        left = t;
+      }
+    }
+    n = (left << _half_bits) | right;
+  }while(n >= _count);
+  return n;
+}
+
+uint32_t Playlist::Round(uint32_t half, uint8_t round){
+  //Mix the half in with the seed and round number, so the same seed always
+  //gives the same queue
+  uint32_t h = (half + 1) * 2654435761u ^ _seed ^ (round * 0x85EBCA6Bu);
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  return h;
+}
+
+bool Playlist::IndexM3u(const char *path){
+  uint8_t chunk[PLAYLIST_CHUNK];
+  UINT bytes;
+  _count = 0;
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  if(f_open(&_file, path, FA_READ) != FR_OK){
+    xSemaphoreGive(_bus);
+    return 0;
+  }
+  //0 = looking for the start of a line, 1 = in an entry, 2 = in a comment
+  uint8_t state = 0;
+  uint32_t offset = 0;
+  while(_count < PLAYLIST_MAX && f_read(&_file, chunk, sizeof(chunk), &bytes) == FR_OK && bytes){
+    for(UINT i = 0; i < bytes && _count < PLAYLIST_MAX; i++, offset++){
+      uint8_t c = chunk[i];
+      if(c == '\n'){
+        state = 0;
+      }
+      //Skip blank space, and a UTF-8 byte order mark at the very start
+      else if(state == 0 && (c == ' ' || c == '\t' || c == '\r' || (offset < 3 && c >= 0xBB))){
+        continue;
+      }
+      else if(state == 0 && c == '#'){
+        state = 2;
+      }
+      else if(state == 0){
+        state = 1;
+        if(_count % PLAYLIST_CHECKPOINT_EVERY == 0){
+          _checkpoints[_count / PLAYLIST_CHECKPOINT_EVERY] = offset;
+        }
+        _count++;
+      }
+    }
+  }
+  f_close(&_file);
+  xSemaphoreGive(_bus);
+  LOG_INFO("Playlist: %d entries in %s", _count, path);
+  return _count > 0;
+}
+
+bool Playlist::ReadM3uEntry(uint16_t entry, char *path){
+  uint8_t chunk[PLAYLIST_CHUNK];
+  UINT bytes;
+  //Relative paths start from the M3U's folder
+  const char *slash = strrchr(_m3u, '/');
+  uint16_t folder = slash ? slash - _m3u + 1 : 1;
+  uint16_t len = folder;
+  memcpy(path, slash ? _m3u : "/", folder);
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  if(f_open(&_file, _m3u, FA_READ) != FR_OK ||
+     f_lseek(&_file, _checkpoints[entry / PLAYLIST_CHECKPOINT_EVERY]) != FR_OK){
+    f_close(&_file);
+    xSemaphoreGive(_bus);
+    return 0;
+  }
+  //The checkpoint is the start of an entry, count forward from there
+  uint16_t skip = entry % PLAYLIST_CHECKPOINT_EVERY;
+  uint8_t state = 1;
+  bool done = 0;
+  bool fits = 1;
+  while(!done && f_read(&_file, chunk, sizeof(chunk), &bytes) == FR_OK && bytes){
+    for(UINT i = 0; i < bytes && !done; i++){
+      uint8_t c = chunk[i];
+      if(c == '\n' || c == '\r'){
+        if(state == 1 && skip == 0){
+          done = 1;
+        }
+        else if(state == 1){
+          skip--;
+        }
+        state = 0;
+      }
+      else if(state == 0 && (c == ' ' || c == '\t')){
+        continue;
+      }
+      else if(state == 0 && c == '#'){
+        state = 2;
+      }
+      else if(state == 0){
+        state = 1;
+      }
+      if(state == 1 && skip == 0 && !done){
+        //Absolute paths replace the folder
+        if(c == '/' || c == '\\'){
+          c = '/';
+          if(len == folder){
+            len = 0;
+          }
+        }
+        if(len < LIBRARY_NAME_SIZE - 1){
+          path[len++] = c;
+        }
+        else{
+          fits = 0;
+        }
+      }
+    }
+  }
+  f_close(&_file);
+  xSemaphoreGive(_bus);
+  //The last entry might not end with a new line
+  path[len] = 0;
+  return (done || (state == 1 && skip == 0)) && fits;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
+#include "utility/log.hpp"
+
+#include "third_party/fatfs/source/ff.h"
+
+#include "nglibrary.hpp"
+
+#include <cstdint>
+
+//The most entries read from an M3U. The library's queue is as long as the
+//library, this only sizes the M3U's checkpoints
+#ifndef PLAYLIST_MAX
+#define PLAYLIST_MAX 5120
+#endif
+//An M3U's songs are found again by remembering where every this many entries
+//start in the file, and reading forward from there
+#define PLAYLIST_CHECKPOINT_EVERY 64
+#define PLAYLIST_CHECKPOINTS ((PLAYLIST_MAX + PLAYLIST_CHECKPOINT_EVERY - 1) / PLAYLIST_CHECKPOINT_EVERY)
+//Where the queue's state is saved between power cycles
+#define PLAYLIST_STATE_PATH "/dtb.que"
+
+//How many rounds the shuffle's Feistel network runs
+#define PLAYLIST_ROUNDS 4
+
+//The order songs play in. The queue is either the whole library or the
+//entries of an M3U file, and each entry is just a 16 bit number: a song ID for
+//the library, or an entry number for an M3U. The order is never stored. In
+//order, position n is entry n. Shuffled, position n goes through a seeded
+//permutation that can be worked out one position at a time, so a queue of
+//any length costs the same few bytes. Only the source, the shuffle seed and
+//the position are saved, the queue is rebuilt from them.
+class Playlist{
+public:
+  enum Repeat : uint8_t
+  {
+    //Stop at the end of the queue
+    kRepeatOff,
+    //Go back to the start of the queue
+    kRepeatAll,
+    //Play the same song again
+    kRepeatOne
+  };
+
+  //Set up the playlist
+  //@param library: Where the songs come from
+  //@param bus: A mutex to hold around every SD card access
+  void Init(SongLibrary *library, SemaphoreHandle_t bus);
+
+  //Queue up the whole library
+  //@param id: The song to start at. An ID past the end of the library is
+  //logged and starts the queue at the first song
+  void UseLibrary(uint16_t id);
+
+  //Queue up the songs in an M3U file. The file is read a sector at a time,
+  //so it can be any length; only the first PLAYLIST_MAX entries are used
+  //@param path: The full path of the M3U
+  //@return bool: True if it had at least one entry
+  bool LoadM3u(const char *path);
+
+  //Turn shuffle on or off. Turning it on shuffles everything but the song at
+  //the current position, which moves to the front. Turning it off goes back
+  //to the source's order, still on the same song
+  void SetShuffle(bool on);
+  bool GetShuffle();
+
+  void SetRepeat(Repeat repeat);
+  Repeat GetRepeat();
+
+  //Get the number of songs in the queue
+  uint16_t GetCount();
+
+  //Check whether the queue is the library, not an M3U
+  bool FromLibrary();
+
+  //Get or set the position in the queue
+  uint16_t GetPosition();
+  void SetPosition(uint16_t pos);
+
+  //Work out what plays after a position when a song ends on its own
+  //@param pos: The position that ended, changed to the next one
+  //@return bool: False if the queue is over
+  bool Peek(uint16_t *pos);
+
+  //Move to the next or previous song because the user asked. These always
+  //wrap around, whatever the repeat mode
+  void Next();
+  void Prev();
+
+  //Copy out the path of the song at a position
+  //@param pos: The position in the queue
+  //@param path: A LIBRARY_NAME_SIZE buffer
+  //@return bool: True if the path could be found
+  bool GetPath(uint16_t pos, char *path);
+
+  //Save the source, shuffle, repeat mode and position to the SD card. Nothing
+  //is written if they haven't changed since the last save
+  //@return bool: True if the card matches the queue
+  bool Save();
+
+  //Rebuild the queue from the saved state
+  //@return bool: True if there was a saved queue that still matches the card
+  bool Restore();
+
+private:
+  enum Source : uint8_t
+  {
+    kLibrary,
+    kM3u
+  };
+
+  //What gets saved
+  struct State{
+    uint32_t magic;
+    uint32_t library_key;
+    uint32_t seed;
+    uint16_t position;
+    uint16_t front;
+    uint8_t source;
+    uint8_t shuffle;
+    uint8_t repeat;
+    char m3u[LIBRARY_NAME_SIZE];
+  };
+
+  //Shuffle the queue with _seed, and move the entry front to position 0
+  void Shuffle(uint16_t front);
+  //Get the entry at a position in the queue
+  uint16_t GetEntry(uint16_t pos);
+  //Run a number through the shuffle's permutation of 0 to _count - 1
+  //@param forward: True to go from a position to an entry, false for back
+  uint16_t Permute(uint16_t x, bool forward);
+  //The Feistel network's round function
+  uint32_t Round(uint32_t half, uint8_t round);
+  //Index an M3U file, filling in _checkpoints and _count
+  bool IndexM3u(const char *path);
+  //Read the path of an M3U entry, relative paths are resolved from the M3U's
+  //folder
+  bool ReadM3uEntry(uint16_t entry, char *path);
+
+  SongLibrary *_library;
+  SemaphoreHandle_t _bus;
+  //Guards the queue. Always taken before _bus, never after
+  SemaphoreHandle_t _lock;
+  uint16_t _count = 0;
+  uint16_t _position = 0;
+  Source _source = kLibrary;
+  bool _shuffle = 0;
+  Repeat _repeat = kRepeatAll;
+  uint32_t _seed = 1;
+  //The entry that was moved to the front when shuffling, and the position it
+  //swapped places with
+  uint16_t _front = 0;
+  uint16_t _front_at = 0;
+  //The permutation works on numbers of twice this many bits
+  uint8_t _half_bits = 1;
+  //The M3U, and the file offset of every PLAYLIST_CHECKPOINT_EVERY'th entry
+  char _m3u[LIBRARY_NAME_SIZE];
+  uint32_t _checkpoints[PLAYLIST_CHECKPOINTS];
+  //Every file the playlist opens goes through this one, under _bus
+  FIL _file;
+  //What's on the card, so Save can tell when nothing has changed
+  State _saved;
+};
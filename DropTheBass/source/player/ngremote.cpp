@@ -0,0 +1,113 @@
+#include "ngremote.hpp"
+
+#include <string.h>
+
+void RemoteLink::Init(){
+  _uart.Init();
+  _uart.StartInterrupts(&_rx_ring, &_tx_ring);
+  LOG_INFO("Remote: UART%d at %lu baud", REMOTE_PORT, _uart.GetBaud());
+}
+
+int16_t RemoteLink::Receive(const uint8_t** payload, TickType_t wait){
+  for(;;){
+    const uint8_t* data;
+    uint16_t len = _uart.Peek(&data);
+    if(!len){
+      if(!_uart.WaitReadable(wait)){
+        return -1;
+      }
+      continue;
+    }
+    //Look for the delimiter in the part of the run not checked yet
+    const uint8_t* end = (const uint8_t*)memchr(&data[_scanned], 0, len - _scanned);
+    uint16_t run = end ? end - data : len;
+
+    if(_dropping){
+      _uart.Consume(end ? run + 1 : run);
+      _dropping = !end;
+      _scanned = 0;
+      continue;
+    }
+
+    if(_copied || (!end && _uart.GetReadable() > len)){
+      //The frame wraps around the end of the ring, or already has. Copy it
+      //out a run at a time
+      if(!Copy(data, run)){
+        _bad_frames++;
+        _copied = 0;
+        _dropping = !end;
+        _uart.Consume(end ? run + 1 : run);
+        _scanned = 0;
+        continue;
+      }
+      _uart.Consume(end ? run + 1 : run);
+      _scanned = 0;
+      if(!end){
+        continue;
+      }
+      int16_t got = remote::Decode(_frame, _copied);
+      _copied = 0;
+      if(got < 0){
+        _bad_frames++;
+        continue;
+      }
+      *payload = _frame;
+      return got;
+    }
+
+    if(!end){
+      //Still coming in. Don't let a frame with no end fill the ring
+      if(len >= REMOTE_MAX_FRAME){
+        _bad_frames++;
+        _uart.Consume(len);
+        _scanned = 0;
+        _dropping = 1;
+        continue;
+      }
+      _scanned = len;
+      if(!_uart.WaitReadable(wait, len + 1)){
+        return -1;
+      }
+      continue;
+    }
+
+    //The whole frame is in a row in the ring. The bytes belong to this
+    //reader until they're consumed, so decode them right there
+    _scanned = 0;
+    int16_t got = (run > 0) ? remote::Decode(const_cast<uint8_t*>(data), run) : -1;
+    if(got < 0){
+      //A lone delimiter is just a host getting back in step, not an error
+      if(run > 0){
+        _bad_frames++;
+      }
+      _uart.Consume(run + 1);
+      continue;
+    }
+    _held = run + 1;
+    *payload = data;
+    return got;
+  }
+}
+
+void RemoteLink::Release(){
+  _uart.Consume(_held);
+  _held = 0;
+}
+
+bool RemoteLink::Copy(const uint8_t* data, uint16_t len){
+  if(_copied + len > REMOTE_MAX_FRAME){
+    return 0;
+  }
+  memcpy(&_frame[_copied], data, len);
+  _copied += len;
+  return 1;
+}
+
+void RemoteLink::Send(const uint8_t* payload, uint16_t len){
+  uint16_t size = remote::Encode(payload, len, _tx_frame);
+  _uart.Write(_tx_frame, size);
+}
+
+uint32_t RemoteLink::GetBadFrames(){
+  return _bad_frames;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/task.h"
+
+#include "utility/log.hpp"
+
+#include "../nxp/nguart.hpp"
+#include "ngremoteproto.hpp"
+
+#include <cstdint>
+
+//The UART the remote control listens on. UART2 is taken by the serial source
+#ifndef REMOTE_PORT
+#define REMOTE_PORT   3
+#endif
+#ifndef REMOTE_BAUD
+#define REMOTE_BAUD   115200
+#endif
+
+//The framing side of the remote control protocol (see ngremoteproto.hpp).
+//Frames are picked out of the UART's receive ring and decoded right where
+//they sit, so the payload handed back points into the ring. Only a frame that
+//wraps around the end of the ring gets copied out first.
+class RemoteLink{
+public:
+  //Set up the UART and turn its interrupts on
+  void Init();
+
+  //Wait for the next good frame. Bad frames are counted and skipped. The
+  //payload stays put until Release, so call it before the next Receive
+  //@param payload: Filled in with a pointer to the payload
+  //@param wait: How many ticks to wait each time more data is needed
+  //@return int16_t: The payload's size, or -1 on timeout
+  int16_t Receive(const uint8_t** payload, TickType_t wait);
+
+  //Let go of the last payload from Receive
+  void Release();
+
+  //Send a payload as a frame
+  //@param payload: The payload
+  //@param len: Its size, up to REMOTE_MAX_PAYLOAD
+  void Send(const uint8_t* payload, uint16_t len);
+
+  //Get the number of frames thrown away for a bad CRC, bad COBS or size
+  uint32_t GetBadFrames();
+
+private:
+  //Copy a run of the ring onto the end of the wrapped frame
+  //@return bool: False if it doesn't fit
+  bool Copy(const uint8_t* data, uint16_t len);
+
+  UART _uart{REMOTE_PORT, UART::FindDivisor(REMOTE_BAUD)};
+  UART::RxRing _rx_ring;
+  UART::TxRing _tx_ring;
+  //Bytes of the frame at the front of the ring already checked for the
+  //delimiter
+  uint16_t _scanned = 0;
+  //Bytes to consume on Release
+  uint16_t _held = 0;
+  //A frame that wrapped, copied out of the ring. _copied is 0 when the frame
+  //is still in the ring
+  uint8_t _frame[REMOTE_MAX_FRAME];
+  uint16_t _copied = 0;
+  //True while skipping to the end of a frame that's too long
+  bool _dropping = 0;
+  uint8_t _tx_frame[REMOTE_MAX_FRAME];
+  uint32_t _bad_frames = 0;
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "ngcrc.hpp"
+
+#include <cstdint>
+#include <string.h>
+
+//The remote control protocol, shared by the player and the host tools. Keep
+//this header free of anything board specific.
+//
+//Every frame on the wire is a COBS encoded payload with its CRC16 on the end
+//(little endian), followed by a 0x00. COBS makes sure 0x00 only ever shows up
+//as the delimiter, so a receiver that loses its place just waits for the next
+//one. A payload is any number of records back to back, so one frame can
+//carry a batch of commands:
+//  [op][len][len bytes of args]
+//Every multi byte field is little endian. The player answers each frame with
+//one frame, holding an ack for every command in the same order, plus a status
+//record for every kOpStatus.
+
+//The most payload a frame can carry, CRC not included
+#define REMOTE_MAX_PAYLOAD  250
+//The most bytes a frame takes on the wire, delimiter included
+#define REMOTE_MAX_FRAME    (REMOTE_MAX_PAYLOAD + 2 + (REMOTE_MAX_PAYLOAD + 2) / 254 + 2)
+//The op and len in front of every record's args
+#define REMOTE_RECORD_HEADER  2
+//An ack record: the header, then the op and the result
+#define REMOTE_ACK_SIZE     (REMOTE_RECORD_HEADER + 2)
+
+namespace remote{
+
+enum Op : uint8_t
+{
+  //Host to player
+  //Play a song. Args: its full path, no terminator
+  kOpPlay       = 0x01,
+  //Jump in the song. Args: int16 seconds, negative to go back
+  kOpSeek       = 0x02,
+  //Set the volume. Args: uint8 attenuation, 0 is loudest
+  kOpVolume     = 0x03,
+  //Set the bass. Args: uint8 from 0 to 15
+  kOpBass       = 0x04,
+  //Ask for a status record. No args
+  kOpStatus     = 0x05,
+  //Ask for status records on a timer. Args: uint16 ms between them, 0 to stop
+  kOpSubscribe  = 0x06,
+
+  //Player to host
+  //The result of a command. Args: the command's op, then a Result
+  kOpAck        = 0x80,
+  //Args: a Status
+  kOpStatusReport = 0x81
+};
+
+enum Result : uint8_t
+{
+  kOk = 0,
+  //The args were the wrong size
+  kBadArgs,
+  //The song isn't in the library
+  kNotFound,
+  //The player doesn't know the op
+  kUnknownOp,
+  //The player can't do that right now
+  kBusy
+};
+
+struct __attribute__((packed)) Status{
+  //PlayerFsm::State
+  uint8_t state;
+  uint8_t paused;
+  uint8_t volume;
+  uint8_t bass;
+  //The song's place in the play queue, and how many songs are in it
+  uint16_t position;
+  uint16_t count;
+  //Seconds into the song
+  uint16_t play_time;
+  //Times the decoder ran dry this song
+  uint16_t underruns;
+};
+
+//Add a record to a payload
+//@param payload: The payload being built
+//@param used: The bytes in it so far, updated
+//@param op: The record's op
+//@param args: The record's args
+//@param len: The number of bytes of args
+//@return bool: False if it doesn't fit
+inline bool AddRecord(uint8_t *payload, uint16_t *used, uint8_t op, const void *args, uint8_t len){
+  if(*used + 2 + len > REMOTE_MAX_PAYLOAD){
+    return 0;
+  }
+  payload[*used] = op;
+  payload[*used + 1] = len;
+  memcpy(&payload[*used + 2], args, len);
+  *used += 2 + len;
+  return 1;
+}
+
+//Walk the records in a payload
+//@param payload: The payload
+//@param len: Its size
+//@param pos: Where the next record starts, start at 0. Updated
+//@param op: Filled in with the record's op
+//@param args: Filled in with a pointer to its args, in the payload
+//@param args_len: Filled in with the number of bytes of args
+//@return bool: False once there are no more complete records
+inline bool NextRecord(const uint8_t *payload, uint16_t len, uint16_t *pos, uint8_t *op,
+                       const uint8_t **args, uint8_t *args_len){
+  if(*pos + 2 > len || *pos + 2 + payload[*pos + 1] > len){
+    return 0;
+  }
+  *op = payload[*pos];
+  *args_len = payload[*pos + 1];
+  *args = &payload[*pos + 2];
+  *pos += 2 + *args_len;
+  return 1;
+}
+
+//Wrap a payload up into a frame: CRC, COBS, delimiter
+//@param payload: The payload
+//@param len: Its size, up to REMOTE_MAX_PAYLOAD
+//@param frame: A REMOTE_MAX_FRAME buffer for the frame
+//@return uint16_t: The frame's size, delimiter included
+inline uint16_t Encode(const uint8_t *payload, uint16_t len, uint8_t *frame){
+  uint16_t crc = Crc16(payload, len);
+  uint8_t tail[2] = {(uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8)};
+  //Each code byte counts the bytes up to the next zero, or 254 at most
+  uint16_t code_at = 0;
+  uint16_t out = 1;
+  uint8_t code = 1;
+  for(uint16_t i = 0; i < len + 2; i++){
+    uint8_t byte = (i < len) ? payload[i] : tail[i - len];
+    if(byte){
+      frame[out++] = byte;
+      code++;
+    }
+    if(!byte || code == 0xFF){
+      frame[code_at] = code;
+      code_at = out++;
+      code = 1;
+    }
+  }
+  frame[code_at] = code;
+  frame[out++] = 0;
+  return out;
+}
+
+//Unwrap a frame in place, checking its CRC
+//@param frame: The frame without its delimiter. Overwritten with the payload
+//@param len: The frame's size
+//@return int16_t: The payload's size, or -1 if the frame is bad
+inline int16_t Decode(uint8_t *frame, uint16_t len){
+  uint16_t in = 0;
+  uint16_t out = 0;
+  //The output never gets ahead of the input, so this can work in place
+  while(in < len){
+    uint8_t code = frame[in++];
+    if(code == 0 || in + code - 1 > len){
+      return -1;
+    }
+    for(uint8_t i = 1; i < code; i++){
+      frame[out++] = frame[in++];
+    }
+    //A zero goes between blocks, unless the block was full or it's the end
+    if(code != 0xFF && in < len){
+      frame[out++] = 0;
+    }
+  }
+  if(out < 2){
+    return -1;
+  }
+  out -= 2;
+  uint16_t crc = frame[out] | (frame[out + 1] << 8);
+  return (Crc16(frame, out) == crc) ? out : -1;
+}
+
+}
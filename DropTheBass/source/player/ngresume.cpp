@@ -0,0 +1,120 @@
+#include "ngresume.hpp"
+
+#include "third_party/FreeRTOS/Source/include/task.h"
+
+#include "ngcrc.hpp"
+
+#include <string.h>
+
+static_assert(sizeof(ResumeLog::Record) == RESUME_RECORD_SIZE, "A checkpoint has to be one flash page");
+
+//Check to see if a page hasn't been programmed since it was erased
+static bool IsBlank(const uint8_t *page, uint16_t len){
+  for(uint16_t i = 0; i < len; i++){
+    if(page[i] != 0xFF){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void ResumeLog::Init(Adesto *flash, SemaphoreHandle_t bus){
+  static Record record;
+  _slot = -1;
+  if(flash->GetSize() < ADESTO_SIZE){
+    LOG_ERROR("Resume: The flash is smaller than %d KB, checkpoints are off", ADESTO_SIZE / 1024);
+    return;
+  }
+  _flash = flash;
+  _bus = bus;
+  //Doubles as a read speed check for the flash
+  TickType_t start = xTaskGetTickCount();
+  //Read every page and keep the newest good one. The whole region is only a
+  //few KB, so this takes a few milliseconds
+  for(int16_t i = 0; i < RESUME_RECORDS; i++){
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    _flash->Read((uint8_t*)&record, RESUME_BASE + i * RESUME_RECORD_SIZE, sizeof(record));
+    xSemaphoreGive(_bus);
+    if(record.seq == 0xFFFFFFFF){
+      continue;
+    }
+    if(Crc16((uint8_t*)&record + 2, sizeof(record) - 2) != record.crc){
+      LOG_WARNING("Resume: Bad checkpoint in page %d", i);
+      continue;
+    }
+    if(_slot < 0 || record.seq > _latest.seq){
+      _latest = record;
+      _slot = i;
+    }
+  }
+  LOG_INFO("Resume: Read %d KB of flash in %lu ms", RESUME_SECTORS * ADESTO_SECTOR_SIZE / 1024,
+           (xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+  if(_slot >= 0){
+    LOG_INFO("Resume: Checkpoint %lu in page %d", _latest.seq, _slot);
+  }
+  //The power going out part way through a checkpoint leaves a page after the
+  //newest one that's neither good nor blank. Programming can only clear bits,
+  //so the next checkpoint can't go on top of it. Pages in a new sector get
+  //erased first anyway
+  while(_slot >= 0 && (_slot + 1) % (ADESTO_SECTOR_SIZE / RESUME_RECORD_SIZE) != 0){
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    _flash->Read((uint8_t*)&record, RESUME_BASE + (_slot + 1) * RESUME_RECORD_SIZE, sizeof(record));
+    xSemaphoreGive(_bus);
+    if(IsBlank((uint8_t*)&record, sizeof(record))){
+      break;
+    }
+    _slot++;
+  }
+}
+
+bool ResumeLog::GetLatest(Record *record){
+  if(_slot < 0){
+    return 0;
+  }
+  *record = _latest;
+  return 1;
+}
+
+bool ResumeLog::Append(Record *record){
+  if(_flash == NULL){
+    return 0;
+  }
+  record->reserved = 0;
+  //Everything but the CRC and sequence number matches the last checkpoint.
+  //Borrow its sequence number so every other field gets compared
+  if(_slot >= 0){
+    record->seq = _latest.seq;
+    if(!memcmp((uint8_t*)record + 2, (uint8_t*)&_latest + 2, sizeof(*record) - 2)){
+      return 1;
+    }
+  }
+  record->seq = (_slot < 0) ? 0 : _latest.seq + 1;
+  record->crc = Crc16((uint8_t*)record + 2, sizeof(*record) - 2);
+  int16_t slot = (_slot + 1) % RESUME_RECORDS;
+  uint32_t addr = RESUME_BASE + slot * RESUME_RECORD_SIZE;
+  //Starting a new sector, clear out the oldest checkpoints that are in it
+  if(addr % ADESTO_SECTOR_SIZE == 0){
+    xSemaphoreTake(_bus, portMAX_DELAY);
+    _flash->Erase(addr, Adesto::k4K);
+    xSemaphoreGive(_bus);
+    _flash->WaitReady(_bus);
+  }
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  _flash->Write((uint8_t*)record, addr, sizeof(*record));
+  xSemaphoreGive(_bus);
+  _flash->WaitReady(_bus);
+  //Make sure it took before counting on it
+  static Record check;
+  xSemaphoreTake(_bus, portMAX_DELAY);
+  _flash->Read((uint8_t*)&check, addr, sizeof(check));
+  xSemaphoreGive(_bus);
+  if(memcmp(&check, record, sizeof(check))){
+    LOG_ERROR("Resume: Checkpoint didn't write to page %d", slot);
+    //Skip the bad page next time
+    _slot = slot;
+    return 0;
+  }
+  _latest = *record;
+  _slot = slot;
+  return 1;
+}
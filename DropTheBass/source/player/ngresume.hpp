@@ -0,0 +1,85 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
+#include "utility/log.hpp"
+
+#include "../peripherals/ngadesto.hpp"
+
+#include <cstdint>
+
+//How many 4K sectors at the top of the flash the log rotates through. Each
+//holds 16 checkpoints, and each sector is only erased once every time the log
+//goes all the way around
+#ifndef RESUME_SECTORS
+#define RESUME_SECTORS 4
+#endif
+#define RESUME_BASE           (ADESTO_SIZE - RESUME_SECTORS * ADESTO_SECTOR_SIZE)
+#define RESUME_RECORD_SIZE    ADESTO_PAGE_SIZE
+#define RESUME_RECORDS        (RESUME_SECTORS * ADESTO_SECTOR_SIZE / RESUME_RECORD_SIZE)
+#define RESUME_PATH_SIZE      (RESUME_RECORD_SIZE - 20)
+
+//An append only log of where the player was, kept in the Adesto flash so it
+//survives a power cycle. Every checkpoint goes in the next page after the last
+//one, and a sector is erased right before the log wraps back into it, so the
+//wear is spread evenly over the whole region. On boot the newest checkpoint
+//with a good CRC wins.
+class ResumeLog{
+public:
+  enum Flags : uint8_t
+  {
+    //A song was playing when the checkpoint was taken
+    kPlaying    = (1 << 0),
+    kContinuous = (1 << 1)
+  };
+
+  //One checkpoint, exactly one flash page
+  struct Record{
+    //CRC16 of everything after this field
+    uint16_t crc;
+    uint8_t flags;
+    uint8_t volume;
+    //Counts up forever, the highest one is the newest. All ones is a blank
+    //page
+    uint32_t seq;
+    uint8_t bass;
+    uint8_t reserved;
+    //The song's position in the play queue
+    uint16_t position;
+    //Where in the song's file the decoder was fed up to
+    uint32_t offset;
+    //The decoder's play time at that point
+    uint32_t ms;
+    char path[RESUME_PATH_SIZE];
+  };
+
+  //Set up the log and find the newest checkpoint. The log sits at the top of
+  //an ADESTO_SIZE flash, so on anything smaller it stays off: there's never a
+  //checkpoint, and Append does nothing
+  //@param flash: The flash chip, after its Init
+  //@param bus: The mutex for the SPI bus the flash is on
+  void Init(Adesto *flash, SemaphoreHandle_t bus);
+
+  //Get the newest checkpoint
+  //@param record: Filled in with the checkpoint
+  //@return bool: False if there isn't one
+  bool GetLatest(Record *record);
+
+  //Add a checkpoint. Skipped if nothing has changed since the last one. The
+  //bus is only held while commands go out, never while the flash is busy
+  //erasing or programming, so this can run next to song playback. Call it from
+  //one task only
+  //@param record: The checkpoint. The CRC and sequence number are filled in
+  //@return bool: True if it was written, or didn't need to be
+  bool Append(Record *record);
+
+private:
+  //NULL while the log is off
+  Adesto *_flash = NULL;
+  SemaphoreHandle_t _bus;
+  Record _latest;
+  //The last page written: the newest checkpoint, or a bad page after it. -1
+  //if there isn't one
+  int16_t _slot = -1;
+};
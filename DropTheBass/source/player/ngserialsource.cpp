@@ -0,0 +1,132 @@
+#include "ngserialsource.hpp"
+
+#include <string.h>
+
+//Software flow control characters
+#define SERIAL_XON  0x11
+#define SERIAL_XOFF 0x13
+
+SerialSource *SerialSource::instance;
+uint8_t SerialSource::_ring[SERIAL_SOURCE_RING];
+
+void SerialSource::Init(){
+  instance = this;
+  _uart.Init();
+  LOG_INFO("Serial source: UART%d at %lu baud", SERIAL_SOURCE_PORT, _uart.GetBaud());
+}
+
+bool SerialSource::Start(){
+  _done = 0;
+  _read = 0;
+  _lost = 0;
+  _overruns = 0;
+  if(!_uart.RecvDma(_ring, SERIAL_SOURCE_RING, HalfDone)){
+    return 0;
+  }
+  SetFlow(1);
+  return 1;
+}
+
+void SerialSource::Stop(){
+  SetFlow(0);
+  _uart.StopRecvDma();
+  LOG_INFO("Serial source: %lu bytes, %lu overruns", _read, _overruns);
+}
+
+uint32_t SerialSource::GetWritten(){
+  //The halves count in whole halves, the DMA's position fills in the rest. If
+  //the ISR hasn't caught up with a half that just finished, the position is
+  //past the end of the count's half, which still adds up
+  uint32_t done = _done;
+  uint16_t pos = _uart.GetRecvDmaPos();
+  return done + ((pos - done) % SERIAL_SOURCE_RING);
+}
+
+uint16_t SerialSource::Read(uint8_t* buf, uint16_t len, TickType_t wait){
+  uint32_t avail;
+  for(;;){
+    SkipLost();
+    avail = GetWritten() - _read;
+    if(!avail){
+      //Sleep until the DMA finishes a half. Tell the ISR who to wake, then look
+      //again in case a half finished before it knew. A host that stops part way
+      //through a half never finishes it, so whatever it did send is picked up
+      //from the DMA's position once the wait runs out
+      _waiter = xTaskGetCurrentTaskHandle();
+      if(GetWritten() == _read){
+        ulTaskNotifyTake(pdTRUE, wait);
+      }
+      _waiter = NULL;
+      avail = GetWritten() - _read;
+    }
+    if(avail > len){
+      avail = len;
+    }
+    //Copy in up to two pieces, around the end of the ring
+    uint16_t tail = _read % SERIAL_SOURCE_RING;
+    uint16_t first = (avail < (uint32_t)(SERIAL_SOURCE_RING - tail)) ? avail : SERIAL_SOURCE_RING - tail;
+    memcpy(buf, &_ring[tail], first);
+    memcpy(&buf[first], _ring, avail - first);
+    //If the DMA caught up with us during the copy, some of it may have been
+    //written over. Throw it away and start again past the damage
+    if(!SkipLost()){
+      break;
+    }
+  }
+  _read += avail;
+  //Let the host go again once there's plenty of room
+  if(!_flow && GetWritten() - _read <= SERIAL_SOURCE_XON){
+    taskENTER_CRITICAL();
+    SetFlow(1);
+    taskEXIT_CRITICAL();
+  }
+  return avail;
+}
+
+bool SerialSource::SkipLost(){
+  taskENTER_CRITICAL();
+  bool skip = (int32_t)(_lost - _read) > 0;
+  if(skip){
+    _read = _lost;
+  }
+  taskEXIT_CRITICAL();
+  return skip;
+}
+
+uint32_t SerialSource::GetOverruns(){
+  return _overruns;
+}
+
+uint32_t SerialSource::GetReceived(){
+  return GetWritten();
+}
+
+void SerialSource::HalfDone(bool second){
+  SerialSource *source = instance;
+  source->_done += SERIAL_SOURCE_RING / 2;
+  uint32_t unread = source->_done - source->_read;
+  //The DMA has moved on to the half before this one, and is writing over
+  //data that was never read. Only the half it just finished is still good
+  if(unread > SERIAL_SOURCE_RING / 2){
+    source->_overruns++;
+    source->_lost = source->_done - SERIAL_SOURCE_RING / 2;
+  }
+  if(source->_flow && unread >= SERIAL_SOURCE_XOFF){
+    source->SetFlow(0);
+  }
+  if(source->_waiter != NULL){
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(source->_waiter, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+
+void SerialSource::SetFlow(bool on){
+  if(_flow == on){
+    return;
+  }
+  _flow = on;
+  //This is called from the DMA ISR, so don't wait on THRE. Flow control is all
+  //this UART ever sends, one byte at a time, so the FIFO always has room
+  _uart.SendByteNoWait(on ? SERIAL_XON : SERIAL_XOFF);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/task.h"
+
+#include "utility/log.hpp"
+
+#include "../nxp/nguart.hpp"
+
+#include <cstdint>
+
+//The UART songs stream in on. UART3 is left for remote control
+#ifndef SERIAL_SOURCE_PORT
+#define SERIAL_SOURCE_PORT  2
+#endif
+#ifndef SERIAL_SOURCE_BAUD
+#define SERIAL_SOURCE_BAUD  1000000
+#endif
+//The size of the DMA ring. At 1 Mbaud it holds 80 ms of data
+#ifndef SERIAL_SOURCE_RING
+#define SERIAL_SOURCE_RING  8192
+#endif
+//Tell the host to stop sending once the ring is this full, and to start
+//again once it's down to this. XOFF is only checked when a half fills, so
+//there has to be room for another half, plus whatever is already on its way
+//when the host hears it
+#define SERIAL_SOURCE_XOFF  (SERIAL_SOURCE_RING / 4)
+#define SERIAL_SOURCE_XON   (SERIAL_SOURCE_RING / 8)
+
+//Song data streamed in over a UART instead of read off the SD card. The DMA
+//fills a ring buffer without the CPU, and the reader copies out of it. The
+//DMA can't be paused, so the host is paced with XON/XOFF: XOFF goes out from
+//the DMA ISR when the ring gets too full, and XON from Read once it has been
+//drained. Flow control bytes only go from the player to the host, so the
+//song data itself can be anything.
+class SerialSource{
+public:
+  //Set up the UART. Doesn't start listening
+  void Init();
+
+  //Start filling the ring and let the host send
+  //@return bool: False if there's no DMA channel free
+  bool Start();
+
+  //Stop filling the ring and tell the host to stop
+  void Stop();
+
+  //Copy out whatever has come in, up to len bytes. With nothing waiting, it
+  //sleeps until the DMA finishes a half of the ring, then takes whatever has
+  //come in by the time the wait runs out. Only one task should read
+  //@param buf: Filled in with the data
+  //@param len: The most bytes to copy
+  //@param wait: How many ticks to sleep when nothing has come in
+  //@return uint16_t: The number of bytes copied, 0 on timeout
+  uint16_t Read(uint8_t* buf, uint16_t len, TickType_t wait);
+
+  //Get the number of times the host sent more than the ring could hold
+  uint32_t GetOverruns();
+
+  //Get the number of bytes received since Start
+  uint32_t GetReceived();
+
+private:
+  //The DMA finished a half of the ring
+  static void HalfDone(bool second);
+
+  //Get the total bytes written by the DMA since Start
+  uint32_t GetWritten();
+
+  //Send XON or XOFF
+  void SetFlow(bool on);
+
+  //Move the read position past anything the DMA has written over
+  //@return bool: True if it had to move
+  bool SkipLost();
+
+  //Only one source, so the DMA callback can find it
+  static SerialSource *instance;
+
+  UART _uart{SERIAL_SOURCE_PORT, UART::FindDivisor(SERIAL_SOURCE_BAUD)};
+  static uint8_t _ring[SERIAL_SOURCE_RING];
+  //Bytes in every half the DMA has finished since Start
+  volatile uint32_t _done = 0;
+  //Bytes copied out since Start
+  volatile uint32_t _read = 0;
+  //Everything before this has been written over by the DMA, set on an overrun
+  volatile uint32_t _lost = 0;
+  //True while the host has been told to send
+  volatile bool _flow = 0;
+  //The task sleeping in Read, or NULL
+  TaskHandle_t volatile _waiter = NULL;
+  volatile uint32_t _overruns = 0;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdio>
+
+//A tiny test harness. TEST(name) defines a test that the runner picks up, and
+//CHECK(condition) reports a failure and carries on with the test
+struct TestCase{
+  const char *name;
+  void (*run)();
+  TestCase *next;
+};
+
+//Every test, and how many checks have failed so far
+extern TestCase *g_tests;
+extern int g_failures;
+
+struct TestRegistrar{
+  TestRegistrar(TestCase *test){
+    test->next = g_tests;
+    g_tests = test;
+  }
+};
+
+#define TEST(name) \
+  static void name(); \
+  static TestCase name##_case = {#name, name, NULL}; \
+  static TestRegistrar name##_registrar(&name##_case); \
+  static void name()
+
+#define CHECK(condition) \
+  do{ \
+    if(!(condition)){ \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      g_failures++; \
+    } \
+  }while(0)
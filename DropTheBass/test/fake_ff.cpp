@@ -0,0 +1,107 @@
+#include "fakes.hpp"
+
+#include "third_party/fatfs/source/ff.h"
+
+#include <map>
+#include <string.h>
+
+static std::map<std::string, std::string> files;
+static uint32_t writes = 0;
+
+void FakeFile(const char *path, const std::string &data){
+  files[path] = data;
+}
+
+bool FakeGetFile(const char *path, std::string *data){
+  auto found = files.find(path);
+  if(found == files.end()){
+    return 0;
+  }
+  *data = found->second;
+  return 1;
+}
+
+void FakeClearFiles(){
+  files.clear();
+  writes = 0;
+}
+
+uint32_t FakeWriteCount(){
+  return writes;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode){
+  fp->obj = NULL;
+  auto found = files.find(path);
+  if(mode & FA_CREATE_ALWAYS){
+    found = files.insert_or_assign(path, std::string()).first;
+  }
+  else if(found == files.end()){
+    return FR_NO_FILE;
+  }
+  fp->obj = &found->second;
+  fp->fptr = 0;
+  fp->obj_size = found->second.size();
+  return FR_OK;
+}
+
+FRESULT f_close(FIL *fp){
+  if(fp->obj == NULL){
+    return FR_INVALID_OBJECT;
+  }
+  fp->obj = NULL;
+  return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buf, UINT len, UINT *read){
+  *read = 0;
+  if(fp->obj == NULL){
+    return FR_INVALID_OBJECT;
+  }
+  std::string *file = (std::string*)fp->obj;
+  if(fp->fptr < file->size()){
+    *read = (len < file->size() - fp->fptr) ? len : file->size() - fp->fptr;
+    memcpy(buf, file->data() + fp->fptr, *read);
+    fp->fptr += *read;
+  }
+  return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buf, UINT len, UINT *written){
+  *written = 0;
+  if(fp->obj == NULL){
+    return FR_INVALID_OBJECT;
+  }
+  std::string *file = (std::string*)fp->obj;
+  if(file->size() < fp->fptr + len){
+    file->resize(fp->fptr + len);
+  }
+  file->replace(fp->fptr, len, (const char*)buf, len);
+  fp->fptr += len;
+  fp->obj_size = file->size();
+  *written = len;
+  writes++;
+  return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, FSIZE_t pos){
+  if(fp->obj == NULL){
+    return FR_INVALID_OBJECT;
+  }
+  //Like FatFs, seeking past the end of a read only file stops at the end
+  std::string *file = (std::string*)fp->obj;
+  fp->fptr = (pos < file->size()) ? pos : file->size();
+  return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR *path, FILINFO *info){
+  auto found = files.find(path);
+  if(found == files.end()){
+    return FR_NO_FILE;
+  }
+  if(info != NULL){
+    memset(info, 0, sizeof(*info));
+    info->fsize = found->second.size();
+  }
+  return FR_OK;
+}
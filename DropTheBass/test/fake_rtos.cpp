@@ -0,0 +1,58 @@
+#include "fakes.hpp"
+
+#include "third_party/FreeRTOS/Source/include/FreeRTOS.h"
+#include "third_party/FreeRTOS/Source/include/task.h"
+#include "third_party/FreeRTOS/Source/include/semphr.h"
+
+//The tests run on one thread, so a semaphore is always free to take, and the
+//only time that passes is what FakeTicks hands out
+
+static uint32_t ticks = 0;
+static int handle;
+
+void FakeTicks(uint32_t more){
+  ticks += more;
+}
+
+TickType_t xTaskGetTickCount(){
+  return ticks;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(){
+  return &handle;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait){
+  return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task){
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken){
+}
+
+void vTaskDelay(TickType_t more){
+  ticks += more;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(){
+  return &handle;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(){
+  return &handle;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait){
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem){
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken){
+  return pdTRUE;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//Control over the stand ins for FatFs and FreeRTOS
+
+//Put a file on the fake card, replacing whatever was there
+void FakeFile(const char *path, const std::string &data);
+
+//Get a file back off the fake card
+//@return bool: False if there's no such file
+bool FakeGetFile(const char *path, std::string *data);
+
+//Empty the fake card
+void FakeClearFiles();
+
+//Count the f_write calls since the card was last emptied
+uint32_t FakeWriteCount();
+
+//Move the fake tick count along
+void FakeTicks(uint32_t ticks);
@@ -0,0 +1,25 @@
+#include "check.hpp"
+
+TestCase *g_tests = NULL;
+int g_failures = 0;
+
+int main(){
+  //The tests register themselves in reverse, so flip the list to run them in
+  //the order they're written
+  TestCase *ordered = NULL;
+  while(g_tests != NULL){
+    TestCase *next = g_tests->next;
+    g_tests->next = ordered;
+    ordered = g_tests;
+    g_tests = next;
+  }
+  int count = 0;
+  for(TestCase *test = ordered; test != NULL; test = test->next){
+    int before = g_failures;
+    test->run();
+    printf("%s %s\n", (g_failures == before) ? "pass" : "FAIL", test->name);
+    count++;
+  }
+  printf("%d tests, %d failed checks\n", count, g_failures);
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+//Just enough of the LPC40xx header for the driver headers to compile on a
+//PC. Nothing in the tests touches a register
+typedef struct{
+  volatile uint32_t DIR;
+  uint32_t RESERVED0[3];
+  volatile uint32_t MASK;
+  volatile uint32_t PIN;
+  volatile uint32_t SET;
+  volatile uint32_t CLR;
+} LPC_GPIO_TypeDef;
+
+#define LPC_GPIO0_BASE 0x20098000UL
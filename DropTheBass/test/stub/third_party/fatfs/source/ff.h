@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+//A stand in for FatFs that keeps files in memory. See fake_ff.cpp
+#define FF_USE_LFN 1
+#define FF_MAX_LFN 255
+
+typedef unsigned int UINT;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef DWORD FSIZE_t;
+
+typedef enum{
+  FR_OK = 0,
+  FR_DISK_ERR,
+  FR_NO_FILE,
+  FR_DENIED,
+  FR_INVALID_OBJECT
+} FRESULT;
+
+typedef struct{
+  //The fake's file, NULL when closed
+  void *obj;
+  FSIZE_t fptr;
+  FSIZE_t obj_size;
+} FIL;
+
+typedef struct{
+  int unused;
+} DIR;
+
+typedef struct{
+  FSIZE_t fsize;
+  WORD fdate;
+  WORD ftime;
+  BYTE fattrib;
+  TCHAR fname[FF_MAX_LFN + 1];
+} FILINFO;
+
+typedef struct{
+  int unused;
+} FATFS;
+
+#define FA_READ           0x01
+#define FA_WRITE          0x02
+#define FA_OPEN_EXISTING  0x00
+#define FA_CREATE_ALWAYS  0x08
+
+#define AM_HID  0x02
+#define AM_SYS  0x04
+#define AM_DIR  0x10
+
+#define f_size(fp) ((fp)->obj_size)
+#define f_tell(fp) ((fp)->fptr)
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buf, UINT len, UINT *read);
+FRESULT f_write(FIL *fp, const void *buf, UINT len, UINT *written);
+FRESULT f_lseek(FIL *fp, FSIZE_t pos);
+FRESULT f_stat(const TCHAR *path, FILINFO *info);
@@ -0,0 +1,164 @@
+#include "check.hpp"
+
+#include "peripherals/ngmpeg.hpp"
+
+#include <string.h>
+
+//Parse a frame header, with every field set to something the parser will
+//have to overwrite
+static bool Parse(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3, mpeg::Frame *frame){
+  const uint8_t h[4] = {b0, b1, b2, b3};
+  memset(frame, 0xAA, sizeof(*frame));
+  return mpeg::ParseFrame(h, frame);
+}
+
+TEST(MpegLayer3){
+  mpeg::Frame frame;
+  //MPEG1 Layer III, 128 kbps, 44.1 kHz, stereo
+  CHECK(Parse(0xFF, 0xFB, 0x90, 0x00, &frame));
+  CHECK(frame.len == 417);
+  CHECK(frame.samples == 1152);
+  CHECK(frame.rate == 44100);
+  CHECK(frame.side == 36);
+  //The same with the padding bit
+  CHECK(Parse(0xFF, 0xFB, 0x92, 0x00, &frame));
+  CHECK(frame.len == 418);
+  //Mono has less side info
+  CHECK(Parse(0xFF, 0xFB, 0x90, 0xC0, &frame));
+  CHECK(frame.side == 21);
+  //320 kbps, 48 kHz
+  CHECK(Parse(0xFF, 0xFB, 0xE4, 0x00, &frame));
+  CHECK(frame.len == 960);
+  CHECK(frame.rate == 48000);
+}
+
+TEST(MpegLowSampleRates){
+  mpeg::Frame frame;
+  //MPEG2 Layer III, 64 kbps, 22.05 kHz: half the samples
+  CHECK(Parse(0xFF, 0xF3, 0x80, 0x00, &frame));
+  CHECK(frame.rate == 22050);
+  CHECK(frame.samples == 576);
+  CHECK(frame.len == 208);
+  CHECK(frame.side == 21);
+  CHECK(Parse(0xFF, 0xF3, 0x80, 0xC0, &frame));
+  CHECK(frame.side == 13);
+  //MPEG2.5 Layer III, 8 kbps, 8 kHz
+  CHECK(Parse(0xFF, 0xE3, 0x18, 0x00, &frame));
+  CHECK(frame.rate == 8000);
+  CHECK(frame.samples == 576);
+  CHECK(frame.len == 72);
+}
+
+TEST(MpegLayers1And2){
+  mpeg::Frame frame;
+  //Layer I counts in 4 byte slots, 384 kbps at 44.1 kHz
+  CHECK(Parse(0xFF, 0xFF, 0xC0, 0x00, &frame));
+  CHECK(frame.samples == 384);
+  CHECK(frame.len == 416);
+  CHECK(Parse(0xFF, 0xFF, 0xC2, 0x00, &frame));
+  CHECK(frame.len == 420);
+  //Layer II, 128 kbps at 44.1 kHz
+  CHECK(Parse(0xFF, 0xFD, 0x80, 0x00, &frame));
+  CHECK(frame.samples == 1152);
+  CHECK(frame.len == 417);
+}
+
+TEST(MpegRejectsBadHeaders){
+  mpeg::Frame frame;
+  //No sync
+  CHECK(!Parse(0xFE, 0xFB, 0x90, 0x00, &frame));
+  CHECK(!Parse(0xFF, 0xDB, 0x90, 0x00, &frame));
+  //Reserved version and layer
+  CHECK(!Parse(0xFF, 0xEB, 0x90, 0x00, &frame));
+  CHECK(!Parse(0xFF, 0xF9, 0x90, 0x00, &frame));
+  //Free format and bad bitrates
+  CHECK(!Parse(0xFF, 0xFB, 0x00, 0x00, &frame));
+  CHECK(!Parse(0xFF, 0xFB, 0xF0, 0x00, &frame));
+  //Reserved sample rate
+  CHECK(!Parse(0xFF, 0xFB, 0x9C, 0x00, &frame));
+  //ID3 isn't a frame
+  CHECK(!Parse('I', 'D', '3', 0x03, &frame));
+}
+
+TEST(Id3TagHeader){
+  mpeg::Tag tag;
+  const uint8_t v3[10] = {'I', 'D', '3', 3, 0, 0x40, 0x00, 0x00, 0x02, 0x01};
+  CHECK(mpeg::ParseTag(v3, &tag));
+  CHECK(tag.version == 3);
+  CHECK(tag.flags == 0x40);
+  //The size is sync safe and doesn't count the header
+  CHECK(tag.end == 10 + 257);
+  CHECK(tag.audio_start == 10 + 257);
+  //A footer comes after the frames
+  const uint8_t v4[10] = {'I', 'D', '3', 4, 0, 0x10, 0x7F, 0x7F, 0x7F, 0x7F};
+  CHECK(mpeg::ParseTag(v4, &tag));
+  CHECK(tag.end == 10 + 0x0FFFFFFF);
+  CHECK(tag.audio_start == tag.end + 10);
+  const uint8_t v5[10] = {'I', 'D', '3', 5, 0, 0, 0, 0, 0, 0};
+  CHECK(!mpeg::ParseTag(v5, &tag));
+  const uint8_t none[10] = {0xFF, 0xFB, 0x90, 0x00, 0, 0, 0, 0, 0, 0};
+  CHECK(!mpeg::ParseTag(none, &tag));
+}
+
+TEST(Id3FrameSizes){
+  const uint8_t v2[6] = {'T', 'T', '2', 0x00, 0x01, 0x02};
+  CHECK(mpeg::TagFrameSize(v2, 2) == 0x0102);
+  //v2.3 sizes are plain, v2.4 sizes are sync safe
+  const uint8_t v3[10] = {'A', 'P', 'I', 'C', 0x00, 0x01, 0x80, 0x00, 0, 0};
+  CHECK(mpeg::TagFrameSize(v3, 3) == 0x018000);
+  const uint8_t v4[10] = {'A', 'P', 'I', 'C', 0x00, 0x01, 0x7F, 0x00, 0, 0};
+  CHECK(mpeg::TagFrameSize(v4, 4) == (1 << 14) + (0x7F << 7));
+}
+
+TEST(Id3TextEncodings){
+  char text[32];
+  const uint8_t latin[] = {0, 'S', 'o', 'n', 'g', 0xE9};
+  mpeg::CopyTagText(text, sizeof(text), latin, sizeof(latin));
+  CHECK(!strcmp(text, "Song?"));
+  //UTF-16 with a byte order mark, either way round
+  const uint8_t le[] = {1, 0xFF, 0xFE, 'H', 0, 'i', 0, 0xE9, 0x00};
+  mpeg::CopyTagText(text, sizeof(text), le, sizeof(le));
+  CHECK(!strcmp(text, "Hi?"));
+  const uint8_t be[] = {1, 0xFE, 0xFF, 0, 'H', 0, 'i'};
+  mpeg::CopyTagText(text, sizeof(text), be, sizeof(be));
+  CHECK(!strcmp(text, "Hi"));
+  //UTF-16 big endian with no byte order mark, up to the terminator
+  const uint8_t be_bare[] = {2, 0, 'O', 0, 'K', 0, 0, 0, 'X'};
+  mpeg::CopyTagText(text, sizeof(text), be_bare, sizeof(be_bare));
+  CHECK(!strcmp(text, "OK"));
+  //UTF-8 characters come out as one '?' each
+  const uint8_t utf8[] = {3, 'C', 'a', 'f', 0xC3, 0xA9, '!'};
+  mpeg::CopyTagText(text, sizeof(text), utf8, sizeof(utf8));
+  CHECK(!strcmp(text, "Caf?!"));
+  mpeg::CopyTagText(text, sizeof(text), utf8, 0);
+  CHECK(!strcmp(text, ""));
+}
+
+TEST(Id3TextFitsTheField){
+  char text[4];
+  const uint8_t latin[] = {0, 'L', 'o', 'n', 'g', 'e', 'r'};
+  mpeg::CopyTagText(text, sizeof(text), latin, sizeof(latin));
+  CHECK(!strcmp(text, "Lon"));
+  const uint8_t utf16[] = {1, 0xFF, 0xFE, 'L', 0, 'o', 0, 'n', 0, 'g', 0};
+  mpeg::CopyTagText(text, sizeof(text), utf16, sizeof(utf16));
+  CHECK(!strcmp(text, "Lon"));
+}
+
+TEST(Id3v1Fields){
+  char text[8];
+  uint8_t field[30];
+  memset(field, ' ', sizeof(field));
+  memcpy(field, "Album", 5);
+  mpeg::CopyFixedText(text, sizeof(text), field, sizeof(field));
+  CHECK(!strcmp(text, "Album"));
+  memset(field, 0, sizeof(field));
+  memcpy(field, "Long album\xE9", 11);
+  mpeg::CopyFixedText(text, sizeof(text), field, sizeof(field));
+  CHECK(!strcmp(text, "Long al"));
+  memset(field, 0, sizeof(field));
+  mpeg::CopyFixedText(text, sizeof(text), field, sizeof(field));
+  CHECK(!strcmp(text, ""));
+  memcpy(field, "A\x01", 2);
+  mpeg::CopyFixedText(text, sizeof(text), field, sizeof(field));
+  CHECK(!strcmp(text, "A?"));
+}
@@ -0,0 +1,134 @@
+#include "check.hpp"
+
+#include "player/ngplayerfsm.hpp"
+
+//Start a state machine in the menu
+static PlayerFsm InMenu(){
+  PlayerFsm fsm;
+  fsm.Handle(PlayerFsm::kLibraryReady);
+  return fsm;
+}
+
+//Start a state machine playing a song, in one of the playing states
+static PlayerFsm Reach(PlayerFsm::State state){
+  PlayerFsm fsm = InMenu();
+  fsm.Handle(PlayerFsm::kSel);
+  if(state == PlayerFsm::kPaused || state == PlayerFsm::kFuncPaused){
+    fsm.Handle(PlayerFsm::kPause);
+  }
+  if(state == PlayerFsm::kFuncPlaying || state == PlayerFsm::kFuncPaused){
+    fsm.Handle(PlayerFsm::kSel);
+  }
+  return fsm;
+}
+
+TEST(FsmButtonEvents){
+  CHECK(PlayerFsm::ButtonEvent(0, 0) == PlayerFsm::kPrev);
+  CHECK(PlayerFsm::ButtonEvent(1, 1) == PlayerFsm::kSelLong);
+  CHECK(PlayerFsm::ButtonEvent(2, 2) == PlayerFsm::kPauseDouble);
+  CHECK(PlayerFsm::ButtonEvent(3, 0) == PlayerFsm::kNext);
+}
+
+TEST(FsmStartsScanning){
+  PlayerFsm fsm;
+  CHECK(fsm.GetState() == PlayerFsm::kScanning);
+  //Buttons mean nothing until the library is ready
+  CHECK(fsm.Handle(PlayerFsm::kSel) == PlayerFsm::kNone);
+  CHECK(fsm.Handle(PlayerFsm::kRemotePlay) == PlayerFsm::kNone);
+  CHECK(fsm.GetState() == PlayerFsm::kScanning);
+  CHECK(fsm.Handle(PlayerFsm::kLibraryReady) == PlayerFsm::kShowMenu);
+  CHECK(fsm.GetState() == PlayerFsm::kMenu);
+}
+
+TEST(FsmResumeSkipsTheMenu){
+  PlayerFsm fsm;
+  CHECK(fsm.Handle(PlayerFsm::kResumeReady) == PlayerFsm::kResumePlayback);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+}
+
+TEST(FsmPlayPauseAndStop){
+  PlayerFsm fsm = InMenu();
+  CHECK(fsm.Handle(PlayerFsm::kNext) == PlayerFsm::kMenuNext);
+  CHECK(fsm.Handle(PlayerFsm::kSel) == PlayerFsm::kPlaySelected);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+  CHECK(fsm.Handle(PlayerFsm::kPause) == PlayerFsm::kPauseSong);
+  CHECK(fsm.GetState() == PlayerFsm::kPaused);
+  //Skipping while paused carries on playing
+  CHECK(fsm.Handle(PlayerFsm::kNext) == PlayerFsm::kNextTrack);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+  CHECK(fsm.Handle(PlayerFsm::kPauseLong) == PlayerFsm::kStopSong);
+  CHECK(fsm.GetState() == PlayerFsm::kScanning);
+}
+
+TEST(FsmFunctionKey){
+  PlayerFsm fsm = InMenu();
+  fsm.Handle(PlayerFsm::kSel);
+  CHECK(!fsm.CheckFunc());
+  CHECK(fsm.Handle(PlayerFsm::kSel) == PlayerFsm::kFuncOn);
+  CHECK(fsm.CheckFunc());
+  CHECK(fsm.Handle(PlayerFsm::kNext) == PlayerFsm::kBassUp);
+  CHECK(fsm.Handle(PlayerFsm::kPrev) == PlayerFsm::kBassDown);
+  CHECK(fsm.GetState() == PlayerFsm::kFuncPlaying);
+  CHECK(fsm.Handle(PlayerFsm::kSel) == PlayerFsm::kFuncOff);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+  //Pause and the function key goes back to the menu
+  fsm.Handle(PlayerFsm::kSel);
+  CHECK(fsm.Handle(PlayerFsm::kPause) == PlayerFsm::kStopSong);
+  CHECK(!fsm.CheckFunc());
+}
+
+TEST(FsmTrackEndInEveryPlayingState){
+  const PlayerFsm::State kStates[] = {PlayerFsm::kPlaying, PlayerFsm::kPaused,
+                                      PlayerFsm::kFuncPlaying, PlayerFsm::kFuncPaused};
+  for(PlayerFsm::State state : kStates){
+    PlayerFsm fsm = Reach(state);
+    CHECK(fsm.GetState() == state);
+    PlayerFsm ended = fsm;
+    CHECK(ended.Handle(PlayerFsm::kTrackEnd) == PlayerFsm::kStopSong);
+    CHECK(ended.GetState() == PlayerFsm::kScanning);
+    PlayerFsm failed = fsm;
+    CHECK(failed.Handle(PlayerFsm::kTrackFailed) == PlayerFsm::kStopSong);
+    CHECK(failed.GetState() == PlayerFsm::kScanning);
+    //The queue going on keeps the function key, and always plays
+    PlayerFsm next = fsm;
+    CHECK(next.Handle(PlayerFsm::kQueueNext) == PlayerFsm::kPlayNext);
+    CHECK(next.GetState() == (fsm.CheckFunc() ? PlayerFsm::kFuncPlaying : PlayerFsm::kPlaying));
+  }
+}
+
+TEST(FsmQueueNextOnlyWhilePlaying){
+  PlayerFsm fsm = InMenu();
+  CHECK(fsm.Handle(PlayerFsm::kQueueNext) == PlayerFsm::kNone);
+  CHECK(fsm.Handle(PlayerFsm::kTrackEnd) == PlayerFsm::kNone);
+  CHECK(fsm.GetState() == PlayerFsm::kMenu);
+}
+
+TEST(FsmRemote){
+  PlayerFsm fsm = InMenu();
+  CHECK(fsm.Handle(PlayerFsm::kRemoteSeek) == PlayerFsm::kNone);
+  CHECK(fsm.Handle(PlayerFsm::kRemotePlay) == PlayerFsm::kPlayRemote);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+  CHECK(fsm.Handle(PlayerFsm::kRemoteSeek) == PlayerFsm::kSeekBy);
+  //Resuming something that's playing does nothing
+  CHECK(fsm.Handle(PlayerFsm::kRemoteResume) == PlayerFsm::kNone);
+  CHECK(fsm.Handle(PlayerFsm::kRemotePause) == PlayerFsm::kPauseSong);
+  CHECK(fsm.GetState() == PlayerFsm::kPaused);
+  CHECK(fsm.Handle(PlayerFsm::kRemotePause) == PlayerFsm::kNone);
+  CHECK(fsm.Handle(PlayerFsm::kRemoteResume) == PlayerFsm::kResumeSong);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+  //A remote play drops the function key
+  fsm.Handle(PlayerFsm::kSel);
+  CHECK(fsm.Handle(PlayerFsm::kRemotePlay) == PlayerFsm::kPlayRemote);
+  CHECK(fsm.GetState() == PlayerFsm::kPlaying);
+}
+
+TEST(FsmVolumeAndBassAnywhere){
+  PlayerFsm fsm;
+  CHECK(fsm.Handle(PlayerFsm::kRemoteVolume) == PlayerFsm::kSetVolume);
+  CHECK(fsm.GetState() == PlayerFsm::kScanning);
+  fsm.Handle(PlayerFsm::kLibraryReady);
+  fsm.Handle(PlayerFsm::kSel);
+  fsm.Handle(PlayerFsm::kSel);
+  CHECK(fsm.Handle(PlayerFsm::kRemoteBass) == PlayerFsm::kSetBass);
+  CHECK(fsm.GetState() == PlayerFsm::kFuncPlaying);
+}
@@ -0,0 +1,329 @@
+#include "check.hpp"
+#include "fakes.hpp"
+
+#include "player/ngplaylist.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+//The playlist only asks the library for its size, its song names and its
+//key, so these stand in for the real thing and nglibrary.cpp stays out of
+//the build. Song n is /Music/n.mp3
+static uint16_t library_count;
+static uint32_t library_key;
+
+uint16_t SongLibrary::GetCount(){
+  return library_count;
+}
+
+bool SongLibrary::GetName(uint16_t id, char *name){
+  if(id >= library_count){
+    return 0;
+  }
+  snprintf(name, LIBRARY_NAME_SIZE, "/Music/%u.mp3", id);
+  return 1;
+}
+
+uint32_t SongLibrary::GetKey(){
+  return library_key;
+}
+
+static SongLibrary library;
+static int bus;
+
+//Start a playlist on a fresh card with a library of some size
+static void Fresh(Playlist *playlist, uint16_t count){
+  FakeClearFiles();
+  library_count = count;
+  library_key = 0x1234;
+  *playlist = Playlist();
+  playlist->Init(&library, &bus);
+}
+
+//Get the library song at a position in the queue
+static int32_t SongAt(Playlist *playlist, uint16_t pos){
+  char path[LIBRARY_NAME_SIZE];
+  unsigned id;
+  if(!playlist->GetPath(pos, path) || sscanf(path, "/Music/%u.mp3", &id) != 1){
+    return -1;
+  }
+  return id;
+}
+
+//Check every song shows up exactly once in the queue
+static bool IsWholeLibrary(Playlist *playlist){
+  std::vector<bool> seen(library_count);
+  for(uint16_t pos = 0; pos < playlist->GetCount(); pos++){
+    int32_t id = SongAt(playlist, pos);
+    if(id < 0 || id >= library_count || seen[id]){
+      return 0;
+    }
+    seen[id] = 1;
+  }
+  return playlist->GetCount() == library_count;
+}
+
+TEST(PlaylistLibraryInOrder){
+  static Playlist playlist;
+  Fresh(&playlist, 5);
+  playlist.UseLibrary(3);
+  CHECK(playlist.FromLibrary());
+  CHECK(playlist.GetCount() == 5);
+  CHECK(playlist.GetPosition() == 3);
+  CHECK(SongAt(&playlist, 3) == 3);
+  playlist.Next();
+  playlist.Next();
+  CHECK(playlist.GetPosition() == 0);
+  playlist.Prev();
+  CHECK(playlist.GetPosition() == 4);
+  char path[LIBRARY_NAME_SIZE];
+  CHECK(!playlist.GetPath(5, path));
+  //A song that isn't there starts at the top
+  playlist.UseLibrary(5);
+  CHECK(playlist.GetPosition() == 0);
+}
+
+TEST(PlaylistRepeatModes){
+  static Playlist playlist;
+  Fresh(&playlist, 3);
+  playlist.UseLibrary(0);
+  uint16_t pos = 1;
+  playlist.SetRepeat(Playlist::kRepeatOff);
+  CHECK(playlist.Peek(&pos) && pos == 2);
+  CHECK(!playlist.Peek(&pos));
+  playlist.SetRepeat(Playlist::kRepeatAll);
+  CHECK(playlist.Peek(&pos) && pos == 0);
+  playlist.SetRepeat(Playlist::kRepeatOne);
+  CHECK(playlist.Peek(&pos) && pos == 0);
+  //An empty queue never goes on
+  Fresh(&playlist, 0);
+  playlist.UseLibrary(0);
+  pos = 0;
+  playlist.SetRepeat(Playlist::kRepeatAll);
+  CHECK(!playlist.Peek(&pos));
+  playlist.SetShuffle(1);
+  CHECK(playlist.GetCount() == 0);
+}
+
+TEST(PlaylistShuffleCoversTheLibrary){
+  //Sizes on and around the permutation's powers of 4, and the largest
+  //library there can be
+  const uint16_t kCounts[] = {1, 2, 3, 4, 5, 16, 17, 63, 64, 65, 1000, 5121, 65535};
+  static Playlist playlist;
+  for(uint16_t count : kCounts){
+    Fresh(&playlist, count);
+    playlist.UseLibrary(count / 2);
+    FakeTicks(count);
+    playlist.SetShuffle(1);
+    CHECK(playlist.GetShuffle());
+    //The song that was playing moves to the front
+    CHECK(playlist.GetPosition() == 0);
+    CHECK(SongAt(&playlist, 0) == count / 2);
+    CHECK(IsWholeLibrary(&playlist));
+    //Going back to the library's order stays on the same song
+    playlist.Next();
+    int32_t song = SongAt(&playlist, playlist.GetPosition());
+    playlist.SetShuffle(0);
+    CHECK(playlist.GetPosition() == song);
+  }
+}
+
+TEST(PlaylistShufflesDiffer){
+  static Playlist playlist;
+  Fresh(&playlist, 100);
+  playlist.UseLibrary(0);
+  playlist.SetShuffle(1);
+  std::vector<int32_t> first;
+  for(uint16_t pos = 0; pos < 100; pos++){
+    first.push_back(SongAt(&playlist, pos));
+  }
+  playlist.SetShuffle(0);
+  FakeTicks(1);
+  playlist.SetShuffle(1);
+  uint16_t same = 0;
+  for(uint16_t pos = 0; pos < 100; pos++){
+    same += SongAt(&playlist, pos) == first[pos];
+  }
+  CHECK(same < 20);
+}
+
+TEST(PlaylistSaveAndRestore){
+  static Playlist playlist;
+  Fresh(&playlist, 500);
+  playlist.UseLibrary(42);
+  FakeTicks(7);
+  playlist.SetShuffle(1);
+  playlist.SetRepeat(Playlist::kRepeatOne);
+  playlist.SetPosition(123);
+  CHECK(playlist.Save());
+  CHECK(FakeWriteCount() == 1);
+  //Nothing changed, nothing written
+  CHECK(playlist.Save());
+  CHECK(FakeWriteCount() == 1);
+  std::vector<int32_t> order;
+  for(uint16_t pos = 0; pos < 500; pos++){
+    order.push_back(SongAt(&playlist, pos));
+  }
+  //A new playlist rebuilds the same queue from the card
+  static Playlist restored;
+  restored = Playlist();
+  restored.Init(&library, &bus);
+  CHECK(restored.Restore());
+  CHECK(restored.GetShuffle());
+  CHECK(restored.GetRepeat() == Playlist::kRepeatOne);
+  CHECK(restored.GetPosition() == 123);
+  bool same = 1;
+  for(uint16_t pos = 0; pos < 500; pos++){
+    same = same && SongAt(&restored, pos) == order[pos];
+  }
+  CHECK(same);
+  //Restoring counts as saved, so only a real change writes
+  CHECK(restored.Save());
+  CHECK(FakeWriteCount() == 1);
+  restored.Next();
+  CHECK(restored.Save());
+  CHECK(FakeWriteCount() == 2);
+}
+
+TEST(PlaylistRestoreNeedsTheSameLibrary){
+  static Playlist playlist;
+  Fresh(&playlist, 50);
+  playlist.UseLibrary(10);
+  CHECK(playlist.Save());
+  library_key++;
+  playlist = Playlist();
+  playlist.Init(&library, &bus);
+  CHECK(!playlist.Restore());
+  CHECK(playlist.FromLibrary());
+  CHECK(playlist.GetPosition() == 0);
+  //Nothing saved at all
+  Fresh(&playlist, 50);
+  CHECK(!playlist.Restore());
+  //Half a file
+  std::string state;
+  playlist.UseLibrary(0);
+  playlist.Save();
+  FakeGetFile(PLAYLIST_STATE_PATH, &state);
+  FakeFile(PLAYLIST_STATE_PATH, state.substr(0, 10));
+  CHECK(!playlist.Restore());
+}
+
+TEST(PlaylistM3u){
+  static Playlist playlist;
+  Fresh(&playlist, 10);
+  //A byte order mark, comments, blank lines, Windows line endings, relative
+  //and absolute paths, and no new line at the end
+  FakeFile("/Lists/mix.m3u",
+           "\xEF\xBB\xBF#EXTM3U\r\n"
+           "#EXTINF:123,Artist - Title\r\n"
+           "one.mp3\r\n"
+           "\r\n"
+           "  sub\\two.mp3\r\n"
+           "/Music/three.mp3\n"
+           "\\Music\\four.mp3\n"
+           "# the end\n"
+           "five.mp3");
+  CHECK(playlist.LoadM3u("/Lists/mix.m3u"));
+  CHECK(!playlist.FromLibrary());
+  CHECK(playlist.GetCount() == 5);
+  const char *kPaths[] = {"/Lists/one.mp3", "/Lists/sub/two.mp3", "/Music/three.mp3",
+                          "/Music/four.mp3", "/Lists/five.mp3"};
+  char path[LIBRARY_NAME_SIZE];
+  for(uint16_t pos = 0; pos < 5; pos++){
+    CHECK(playlist.GetPath(pos, path) && !strcmp(path, kPaths[pos]));
+  }
+  //An M3U in the root
+  FakeFile("/root.m3u", "a.mp3\nb.mp3\n");
+  CHECK(playlist.LoadM3u("/root.m3u"));
+  CHECK(playlist.GetPath(1, path) && !strcmp(path, "/b.mp3"));
+}
+
+TEST(PlaylistLongM3u){
+  //Entries of every length, so checkpoints and reads land all over the place
+  static Playlist playlist;
+  Fresh(&playlist, 10);
+  std::string m3u;
+  std::vector<std::string> paths;
+  for(uint16_t i = 0; i < 700; i++){
+    std::string name = "/Music/" + std::string(i % 97, 'a' + i % 26) + std::to_string(i) + ".mp3";
+    paths.push_back(name);
+    if(i % 50 == 0){
+      m3u += "#comment " + std::to_string(i) + "\n";
+    }
+    m3u += name + "\n";
+  }
+  FakeFile("/long.m3u", m3u);
+  CHECK(playlist.LoadM3u("/long.m3u"));
+  CHECK(playlist.GetCount() == 700);
+  char path[LIBRARY_NAME_SIZE];
+  uint16_t wrong = 0;
+  for(uint16_t pos = 0; pos < 700; pos++){
+    wrong += !playlist.GetPath(pos, path) || paths[pos] != path;
+  }
+  CHECK(wrong == 0);
+  //Shuffled, it's still every entry once
+  playlist.SetShuffle(1);
+  std::vector<bool> seen(700);
+  uint16_t found = 0;
+  for(uint16_t pos = 0; pos < 700; pos++){
+    playlist.GetPath(pos, path);
+    for(uint16_t i = 0; i < 700; i++){
+      if(paths[i] == path && !seen[i]){
+        seen[i] = 1;
+        found++;
+        break;
+      }
+    }
+  }
+  CHECK(found == 700);
+}
+
+TEST(PlaylistM3uLimits){
+  static Playlist playlist;
+  Fresh(&playlist, 10);
+  //Only the first PLAYLIST_MAX entries are used
+  std::string m3u;
+  for(uint16_t i = 0; i < PLAYLIST_MAX + 10; i++){
+    m3u += std::to_string(i) + ".mp3\n";
+  }
+  FakeFile("/big.m3u", m3u);
+  CHECK(playlist.LoadM3u("/big.m3u"));
+  CHECK(playlist.GetCount() == PLAYLIST_MAX);
+  char path[LIBRARY_NAME_SIZE];
+  CHECK(playlist.GetPath(PLAYLIST_MAX - 1, path) && !strcmp(path, ("/" + std::to_string(PLAYLIST_MAX - 1) + ".mp3").c_str()));
+  //A path too long for the library's names
+  FakeFile("/toolong.m3u", "ok.mp3\n/" + std::string(LIBRARY_NAME_SIZE, 'x') + ".mp3\n");
+  CHECK(playlist.LoadM3u("/toolong.m3u"));
+  CHECK(playlist.GetPath(0, path));
+  CHECK(!playlist.GetPath(1, path));
+  //Nothing in it, or not there at all, falls back to the library
+  FakeFile("/empty.m3u", "#EXTM3U\n\n");
+  CHECK(!playlist.LoadM3u("/empty.m3u"));
+  CHECK(playlist.FromLibrary());
+  CHECK(playlist.GetCount() == 10);
+  CHECK(!playlist.LoadM3u("/missing.m3u"));
+  CHECK(playlist.FromLibrary());
+}
+
+TEST(PlaylistRestoresAnM3u){
+  static Playlist playlist;
+  Fresh(&playlist, 10);
+  FakeFile("/list.m3u", "a.mp3\nb.mp3\nc.mp3\n");
+  playlist.LoadM3u("/list.m3u");
+  playlist.SetPosition(2);
+  CHECK(playlist.Save());
+  playlist = Playlist();
+  playlist.Init(&library, &bus);
+  CHECK(playlist.Restore());
+  CHECK(!playlist.FromLibrary());
+  char path[LIBRARY_NAME_SIZE];
+  CHECK(playlist.GetPath(playlist.GetPosition(), path) && !strcmp(path, "/c.mp3"));
+  //The M3U got shorter, so the position is gone
+  FakeFile("/list.m3u", "a.mp3\n");
+  playlist = Playlist();
+  playlist.Init(&library, &bus);
+  CHECK(!playlist.Restore());
+  CHECK(playlist.FromLibrary());
+}
@@ -0,0 +1,226 @@
+#include "check.hpp"
+
+#include "nxp/ngregfile.hpp"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+
+//Plays the part of an I2C master. Each transfer makes the same calls into the
+//register file, in the same order, as the I2C ISR does for the bus states
+//the master causes
+class FakeMaster{
+public:
+  FakeMaster(RegisterFile *regs) : _regs(regs){}
+
+  //SLA+W, the register, the data, then a stop
+  void Write(uint8_t reg, const uint8_t *data, uint8_t len){
+    _regs->StartWrite();
+    _regs->WriteByte(reg);
+    for(uint8_t i = 0; i < len; i++){
+      _regs->WriteByte(data[i]);
+    }
+    _regs->Stop();
+  }
+
+  //SLA+W and the register, then a repeated start into a read
+  void Read(uint8_t reg, uint8_t *data, uint8_t len){
+    Write(reg, NULL, 0);
+    ReadOn(data, len);
+  }
+
+  //SLA+R with no register, so the read carries on from the last one. The
+  //master acks every byte but the last, and each ack asks for another
+  void ReadOn(uint8_t *data, uint8_t len){
+    BeginRead(data);
+    for(uint8_t i = 1; i < len; i++){
+      data[i] = _regs->ReadByte();
+    }
+  }
+
+  //Just the first byte of a read, so the test can step in part way through
+  void BeginRead(uint8_t *data){
+    data[0] = _regs->StartRead();
+  }
+
+  uint8_t ReadByte(){
+    return _regs->ReadByte();
+  }
+
+private:
+  RegisterFile *_regs;
+};
+
+//What the last write callback was handed
+static uint8_t written_reg;
+static uint8_t written[32];
+static uint8_t written_len;
+static uint8_t writes;
+
+static void OnWrite(uint8_t reg, const uint8_t *data, uint8_t len){
+  written_reg = reg;
+  memcpy(written, data, len);
+  written_len = len;
+  writes++;
+}
+
+TEST(RegfilePublish){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  const uint32_t value = 0x12345678;
+  regs.Set(0x10, &value, sizeof(value));
+  uint32_t got = 0;
+  regs.Get(0x10, &got, sizeof(got));
+  CHECK(got == value);
+  //Masters don't see it until it's published
+  master.Read(0x10, (uint8_t*)&got, sizeof(got));
+  CHECK(got == 0);
+  regs.Publish();
+  master.Read(0x10, (uint8_t*)&got, sizeof(got));
+  CHECK(got == value);
+  //Later Sets start from what's published
+  const uint8_t other = 0xAB;
+  regs.Set(0x20, &other, 1);
+  regs.Publish();
+  master.Read(0x10, (uint8_t*)&got, sizeof(got));
+  CHECK(got == value);
+}
+
+TEST(RegfileReadsAreSnapshots){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  uint32_t value = 0x11111111;
+  regs.Set(0, &value, sizeof(value));
+  regs.Publish();
+  uint8_t got[4];
+  master.Write(0, NULL, 0);
+  master.BeginRead(got);
+  //Two publishes land in the middle of the read. Neither shows up in it
+  value = 0x22222222;
+  regs.Set(0, &value, sizeof(value));
+  regs.Publish();
+  got[1] = master.ReadByte();
+  value = 0x33333333;
+  regs.Set(0, &value, sizeof(value));
+  regs.Publish();
+  got[2] = master.ReadByte();
+  got[3] = master.ReadByte();
+  CHECK(!memcmp(got, "\x11\x11\x11\x11", 4));
+  //The next read gets the newest
+  master.Read(0, got, sizeof(got));
+  CHECK(!memcmp(got, "\x33\x33\x33\x33", 4));
+}
+
+TEST(RegfileBanksRotate){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  //Every mix of publishes and reads, many times over, so each bank takes
+  //every role
+  for(uint32_t round = 1; round < 300; round++){
+    uint32_t value = round * 0x01010101;
+    regs.Set(0x40, &value, sizeof(value));
+    regs.Publish();
+    uint32_t got = 0;
+    if(round % 3){
+      master.Read(0x40, (uint8_t*)&got, sizeof(got));
+      CHECK(got == value);
+    }
+    if(round % 5 == 0){
+      regs.Publish();
+      master.Read(0x40, (uint8_t*)&got, sizeof(got));
+      CHECK(got == value);
+    }
+  }
+}
+
+TEST(RegfileAddressesWrap){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  const uint8_t value[4] = {1, 2, 3, 4};
+  regs.Set(0xFE, value, sizeof(value));
+  regs.Publish();
+  uint8_t got[4];
+  master.Read(0xFE, got, sizeof(got));
+  CHECK(!memcmp(got, value, sizeof(value)));
+  master.Read(0x00, got, 2);
+  CHECK(got[0] == 3 && got[1] == 4);
+}
+
+TEST(RegfileReadsCarryOn){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  const uint8_t value[4] = {5, 6, 7, 8};
+  regs.Set(0x30, value, sizeof(value));
+  regs.Publish();
+  uint8_t got[2];
+  master.Read(0x30, got, 2);
+  master.ReadOn(got, 2);
+  CHECK(got[0] == 7 && got[1] == 8);
+}
+
+TEST(RegfileWrites){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  regs.SetCallback(0x50, OnWrite);
+  writes = 0;
+  const uint8_t data[3] = {9, 8, 7};
+  master.Write(0x50, data, sizeof(data));
+  CHECK(writes == 1);
+  CHECK(written_reg == 0x50);
+  CHECK(written_len == 3 && !memcmp(written, data, 3));
+  //Writes never land in the registers themselves
+  uint8_t got[3];
+  master.Read(0x50, got, sizeof(got));
+  CHECK(!memcmp(got, "\0\0\0", 3));
+  //Registers without a callback are read only
+  master.Write(0x51, data, sizeof(data));
+  CHECK(writes == 1);
+  //Just the register byte only moves the pointer
+  master.Write(0x50, NULL, 0);
+  CHECK(writes == 1);
+}
+
+TEST(RegfileLongWritesAreCut){
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  regs.SetCallback(0x60, OnWrite);
+  writes = 0;
+  uint8_t data[REGFILE_MAX_WRITE + 4];
+  for(uint8_t i = 0; i < sizeof(data); i++){
+    data[i] = i;
+  }
+  master.Write(0x60, data, sizeof(data));
+  CHECK(writes == 1);
+  CHECK(written_len == REGFILE_MAX_WRITE);
+  CHECK(!memcmp(written, data, REGFILE_MAX_WRITE));
+}
+
+TEST(RegfileNoTornReadsUnderLoad){
+  //The application publishes from its own thread while the master reads as
+  //fast as it can. Every read has to be one whole value, and never older
+  //than the last one
+  static RegisterFile regs;
+  FakeMaster master(&regs);
+  std::atomic<bool> done{0};
+  std::thread app([&]{
+    for(uint32_t n = 1; n <= 200000; n++){
+      uint32_t value[2] = {n, ~n};
+      regs.Set(0x80, value, sizeof(value));
+      regs.Publish();
+    }
+    done = 1;
+  });
+  uint32_t last = 0;
+  uint32_t torn = 0;
+  uint32_t backwards = 0;
+  while(!done){
+    uint32_t got[2];
+    master.Read(0x80, (uint8_t*)got, sizeof(got));
+    torn += (got[0] != ~got[1]) && got[0];
+    backwards += got[0] < last;
+    last = got[0];
+  }
+  app.join();
+  CHECK(torn == 0);
+  CHECK(backwards == 0);
+}
@@ -0,0 +1,122 @@
+#include "check.hpp"
+
+#include "player/ngremoteproto.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+//Encode a payload, check the frame is well formed, and decode it back
+//@return bool: True if it came back unchanged
+static bool RoundTrip(const uint8_t *payload, uint16_t len){
+  uint8_t frame[512];
+  uint16_t size = remote::Encode(payload, len, frame);
+  //COBS adds a code byte every 254 bytes, then the delimiter goes on the end
+  if(size != len + 2 + (len + 2) / 254 + 2 || frame[size - 1] != 0){
+    return 0;
+  }
+  //Nothing but the delimiter is ever 0
+  if(memchr(frame, 0, size - 1) != NULL){
+    return 0;
+  }
+  int16_t decoded = remote::Decode(frame, size - 1);
+  return decoded == len && !memcmp(frame, payload, len);
+}
+
+TEST(Crc16CheckValue){
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  CHECK(Crc16(check, sizeof(check)) == 0x29B1);
+  //Picking up where it left off gives the same answer
+  CHECK(Crc16(&check[4], 5, Crc16(check, 4)) == 0x29B1);
+  CHECK(Crc16(check, 0) == 0xFFFF);
+}
+
+TEST(CobsRoundTrips){
+  uint8_t payload[300];
+  memset(payload, 0, sizeof(payload));
+  CHECK(RoundTrip(payload, 0));
+  CHECK(RoundTrip(payload, 1));
+  CHECK(RoundTrip(payload, REMOTE_MAX_PAYLOAD));
+  //Long runs without a zero fill whole COBS blocks, each length around the
+  //254 byte block size
+  memset(payload, 0x55, sizeof(payload));
+  for(uint16_t len = 248; len <= 300; len++){
+    CHECK(RoundTrip(payload, len));
+  }
+  srand(1);
+  for(uint16_t i = 0; i < 200; i++){
+    uint16_t len = rand() % (REMOTE_MAX_PAYLOAD + 1);
+    for(uint16_t j = 0; j < len; j++){
+      //Plenty of zeroes
+      payload[j] = (rand() % 4) ? rand() : 0;
+    }
+    CHECK(RoundTrip(payload, len));
+  }
+}
+
+TEST(CobsFitsTheFrameBuffer){
+  uint8_t payload[REMOTE_MAX_PAYLOAD];
+  uint8_t frame[REMOTE_MAX_FRAME + 16];
+  memset(payload, 0x55, sizeof(payload));
+  memset(frame, 0xEE, sizeof(frame));
+  CHECK(remote::Encode(payload, sizeof(payload), frame) <= REMOTE_MAX_FRAME);
+  CHECK(frame[REMOTE_MAX_FRAME] == 0xEE);
+}
+
+TEST(CobsRejectsBadFrames){
+  const uint8_t payload[] = {remote::kOpVolume, 1, 20};
+  uint8_t frame[32];
+  uint8_t copy[32];
+  uint16_t size = remote::Encode(payload, sizeof(payload), frame) - 1;
+  //Any single flipped bit is caught
+  for(uint16_t byte = 0; byte < size; byte++){
+    for(uint8_t bit = 0; bit < 8; bit++){
+      memcpy(copy, frame, size);
+      copy[byte] ^= 1 << bit;
+      CHECK(remote::Decode(copy, size) != sizeof(payload) || memcmp(copy, payload, sizeof(payload)));
+    }
+  }
+  //Cut short, or too short to hold a CRC
+  memcpy(copy, frame, size);
+  CHECK(remote::Decode(copy, size - 1) == -1);
+  uint8_t tiny[] = {0x02, 0x41};
+  CHECK(remote::Decode(tiny, sizeof(tiny)) == -1);
+  uint8_t zero[] = {0x00, 0x41, 0x42};
+  CHECK(remote::Decode(zero, sizeof(zero)) == -1);
+}
+
+TEST(RemoteRecordBatches){
+  uint8_t payload[REMOTE_MAX_PAYLOAD];
+  uint16_t used = 0;
+  uint8_t volume = 30;
+  int16_t seek = -10;
+  CHECK(remote::AddRecord(payload, &used, remote::kOpVolume, &volume, 1));
+  CHECK(remote::AddRecord(payload, &used, remote::kOpStatus, NULL, 0));
+  CHECK(remote::AddRecord(payload, &used, remote::kOpSeek, &seek, 2));
+  CHECK(used == 3 + 2 + 4);
+  uint16_t pos = 0;
+  uint8_t op;
+  const uint8_t *args;
+  uint8_t len;
+  CHECK(remote::NextRecord(payload, used, &pos, &op, &args, &len));
+  CHECK(op == remote::kOpVolume && len == 1 && args[0] == 30);
+  CHECK(remote::NextRecord(payload, used, &pos, &op, &args, &len));
+  CHECK(op == remote::kOpStatus && len == 0);
+  CHECK(remote::NextRecord(payload, used, &pos, &op, &args, &len));
+  CHECK(op == remote::kOpSeek && len == 2 && (int16_t)(args[0] | (args[1] << 8)) == -10);
+  CHECK(!remote::NextRecord(payload, used, &pos, &op, &args, &len));
+  //A record that runs off the end isn't handed out
+  pos = 0;
+  CHECK(!remote::NextRecord(payload, 2, &pos, &op, &args, &len));
+}
+
+TEST(RemoteRecordsStopAtTheLimit){
+  uint8_t payload[REMOTE_MAX_PAYLOAD];
+  uint8_t args[255];
+  memset(args, 0, sizeof(args));
+  uint16_t used = 0;
+  CHECK(remote::AddRecord(payload, &used, remote::kOpPlay, args, REMOTE_MAX_PAYLOAD - 4));
+  CHECK(!remote::AddRecord(payload, &used, remote::kOpPlay, args, 1));
+  CHECK(remote::AddRecord(payload, &used, remote::kOpStatus, NULL, 0));
+  CHECK(used == REMOTE_MAX_PAYLOAD);
+  CHECK(!remote::AddRecord(payload, &used, remote::kOpStatus, NULL, 0));
+}
@@ -0,0 +1,197 @@
+#include "check.hpp"
+
+#include "player/ngresume.hpp"
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+//A simulated NOR flash stands in for the Adesto, so ngadesto.cpp and its SSP
+//stay out of the build. Like the real chip, programming can only clear bits
+//and erasing sets a whole block back to ones. A page can be made to ignore
+//writes, like a worn out one
+static std::vector<uint8_t> flash_mem;
+static uint32_t flash_size;
+static std::vector<uint32_t> erases;
+static uint32_t page_writes;
+static int32_t dead_page = -1;
+
+//Start over with a blank flash
+static void BlankFlash(uint32_t size){
+  flash_size = size;
+  flash_mem.assign(size, 0xFF);
+  erases.assign(size / ADESTO_SECTOR_SIZE, 0);
+  page_writes = 0;
+  dead_page = -1;
+}
+
+Adesto::Adesto(){
+}
+
+Adesto::~Adesto(){
+}
+
+uint32_t Adesto::GetSize(){
+  return flash_size;
+}
+
+void Adesto::Write(const uint8_t *buf, uint32_t addr, uint32_t len){
+  page_writes++;
+  for(uint32_t i = 0; i < len; i++){
+    uint32_t at = addr + i;
+    if((int32_t)(at / ADESTO_PAGE_SIZE) != dead_page){
+      flash_mem[at % flash_size] &= buf[i];
+    }
+  }
+}
+
+void Adesto::Erase(uint32_t addr, EraseSize size){
+  uint32_t block = (size == k4K) ? 4096 : (size == k32K) ? 32768 : 65536;
+  addr &= ~(block - 1);
+  memset(&flash_mem[addr], 0xFF, block);
+  for(uint32_t i = 0; i < block; i += ADESTO_SECTOR_SIZE){
+    erases[(addr + i) / ADESTO_SECTOR_SIZE]++;
+  }
+}
+
+void Adesto::Read(uint8_t *buf, uint32_t addr, uint32_t len){
+  for(uint32_t i = 0; i < len; i++){
+    buf[i] = flash_mem[(addr + i) % flash_size];
+  }
+}
+
+void Adesto::WaitReady(SemaphoreHandle_t bus){
+}
+
+static Adesto flash;
+static int bus;
+
+//A checkpoint for a song, with everything but the CRC and sequence number
+static ResumeLog::Record Checkpoint(uint16_t position, uint32_t offset){
+  ResumeLog::Record record;
+  memset(&record, 0, sizeof(record));
+  record.flags = ResumeLog::kPlaying;
+  record.volume = 40;
+  record.bass = 3;
+  record.position = position;
+  record.offset = offset;
+  record.ms = offset / 16;
+  strcpy(record.path, "/Music/song.mp3");
+  return record;
+}
+
+//Boot up: a new log reading whatever is in the flash
+static ResumeLog* Boot(){
+  static ResumeLog log;
+  log = ResumeLog();
+  log.Init(&flash, &bus);
+  return &log;
+}
+
+TEST(ResumeBlankFlash){
+  BlankFlash(ADESTO_SIZE);
+  ResumeLog *log = Boot();
+  ResumeLog::Record got;
+  CHECK(!log->GetLatest(&got));
+  ResumeLog::Record record = Checkpoint(7, 1000);
+  CHECK(log->Append(&record));
+  CHECK(log->GetLatest(&got) && got.seq == 0 && got.offset == 1000);
+  //It's still there after a power cycle
+  log = Boot();
+  CHECK(log->GetLatest(&got) && got.position == 7 && got.offset == 1000);
+  CHECK(!strcmp(got.path, "/Music/song.mp3"));
+}
+
+TEST(ResumeSkipsUnchanged){
+  BlankFlash(ADESTO_SIZE);
+  ResumeLog *log = Boot();
+  ResumeLog::Record record = Checkpoint(1, 2048);
+  CHECK(log->Append(&record));
+  uint32_t writes = page_writes;
+  record = Checkpoint(1, 2048);
+  CHECK(log->Append(&record));
+  CHECK(page_writes == writes);
+  //Any field changing is worth a write, volume included
+  record = Checkpoint(1, 2048);
+  record.volume = 41;
+  CHECK(log->Append(&record));
+  CHECK(page_writes == writes + 1);
+}
+
+TEST(ResumeWearsEvenly){
+  BlankFlash(ADESTO_SIZE);
+  ResumeLog *log = Boot();
+  //Three times round the log and a bit, rebooting now and then
+  const uint32_t kAppends = RESUME_RECORDS * 3 + 5;
+  for(uint32_t i = 0; i < kAppends; i++){
+    ResumeLog::Record record = Checkpoint(i % 100, i * 512);
+    CHECK(log->Append(&record));
+    if(i % 37 == 0){
+      log = Boot();
+    }
+  }
+  ResumeLog::Record got;
+  log = Boot();
+  CHECK(log->GetLatest(&got));
+  CHECK(got.seq == kAppends - 1);
+  CHECK(got.offset == (kAppends - 1) * 512);
+  //Only the log's sectors were touched, each one three or four times
+  uint32_t first = RESUME_BASE / ADESTO_SECTOR_SIZE;
+  uint32_t outside = 0;
+  for(uint32_t i = 0; i < first; i++){
+    outside += erases[i];
+  }
+  CHECK(outside == 0);
+  for(uint32_t i = first; i < erases.size(); i++){
+    CHECK(erases[i] == 3 || erases[i] == 4);
+  }
+}
+
+TEST(ResumeSkipsBadCheckpoints){
+  BlankFlash(ADESTO_SIZE);
+  ResumeLog *log = Boot();
+  for(uint32_t i = 0; i < 5; i++){
+    ResumeLog::Record record = Checkpoint(i, i * 100);
+    log->Append(&record);
+  }
+  //Power went out part way through programming the newest page
+  flash_mem[RESUME_BASE + 4 * RESUME_RECORD_SIZE + offsetof(ResumeLog::Record, bass)] = 0;
+  log = Boot();
+  ResumeLog::Record got;
+  CHECK(log->GetLatest(&got) && got.seq == 3 && got.offset == 300);
+  //The next one goes after the bad page, and wins
+  ResumeLog::Record record = Checkpoint(9, 900);
+  CHECK(log->Append(&record));
+  log = Boot();
+  CHECK(log->GetLatest(&got) && got.offset == 900);
+}
+
+TEST(ResumeSurvivesADeadPage){
+  BlankFlash(ADESTO_SIZE);
+  ResumeLog *log = Boot();
+  ResumeLog::Record record = Checkpoint(0, 0);
+  log->Append(&record);
+  dead_page = RESUME_BASE / ADESTO_PAGE_SIZE + 1;
+  //The write is read back, so the failure is caught
+  record = Checkpoint(1, 100);
+  CHECK(!log->Append(&record));
+  ResumeLog::Record got;
+  CHECK(log->GetLatest(&got) && got.offset == 0);
+  //and the next checkpoint steps over the page
+  record = Checkpoint(2, 200);
+  CHECK(log->Append(&record));
+  log = Boot();
+  CHECK(log->GetLatest(&got) && got.offset == 200);
+}
+
+TEST(ResumeOffOnASmallFlash){
+  //The log lives at the top of a 4 MB part. Anything smaller has no room for
+  //it, so it has to stay off rather than write past the end
+  BlankFlash(ADESTO_SIZE / 2);
+  ResumeLog *log = Boot();
+  ResumeLog::Record record = Checkpoint(1, 100);
+  CHECK(!log->Append(&record));
+  CHECK(page_writes == 0);
+  ResumeLog::Record got;
+  CHECK(!log->GetLatest(&got));
+}
@@ -0,0 +1,96 @@
+#include "check.hpp"
+
+#include "nxp/ngring.hpp"
+
+#include <thread>
+
+TEST(RingFillsAndEmpties){
+  Ring<8> ring;
+  CHECK(ring.IsEmpty());
+  CHECK(ring.GetFree() == 7);
+  //One byte always stays empty
+  for(uint8_t i = 0; i < 7; i++){
+    CHECK(ring.Push(i));
+  }
+  CHECK(!ring.Push(7));
+  CHECK(ring.GetCount() == 7);
+  CHECK(ring.GetFree() == 0);
+  uint8_t byte;
+  for(uint8_t i = 0; i < 7; i++){
+    CHECK(ring.Pop(&byte) && byte == i);
+  }
+  CHECK(!ring.Pop(&byte));
+  CHECK(ring.IsEmpty());
+}
+
+TEST(RingPeekAcrossTheWrap){
+  Ring<8> ring;
+  uint8_t byte;
+  //Move the tail to 6, then add 5 so the run wraps
+  for(uint8_t i = 0; i < 6; i++){
+    ring.Push(0);
+    ring.Pop(&byte);
+  }
+  for(uint8_t i = 1; i <= 5; i++){
+    ring.Push(i);
+  }
+  const uint8_t *data;
+  uint16_t run = ring.Peek(&data);
+  CHECK(run == 2 && data[0] == 1 && data[1] == 2);
+  ring.Skip(run);
+  run = ring.Peek(&data);
+  CHECK(run == 3 && data[0] == 3 && data[2] == 5);
+  ring.Skip(run);
+  CHECK(ring.IsEmpty());
+  CHECK(ring.Peek(&data) == 0);
+}
+
+TEST(RingReset){
+  Ring<4> ring;
+  ring.Push(1);
+  ring.Push(2);
+  ring.Reset();
+  CHECK(ring.IsEmpty());
+  CHECK(ring.GetFree() == 3);
+}
+
+TEST(RingAcrossThreads){
+  //Like an ISR and a task: one thread only pushes, the other only pops, and
+  //every byte has to come out once, in order
+  static Ring<64> ring;
+  const uint32_t kBytes = 1000000;
+  std::thread producer([]{
+    for(uint32_t i = 0; i < kBytes;){
+      if(ring.Push((uint8_t)(i * 7))){
+        i++;
+      }
+      else{
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint32_t out_of_order = 0;
+  uint8_t byte;
+  for(uint32_t i = 0; i < kBytes;){
+    //Take bytes both ways so Peek and Skip race the producer too
+    const uint8_t *data;
+    uint16_t run = (i & 1) ? ring.Peek(&data) : 0;
+    if(run){
+      for(uint16_t j = 0; j < run; j++){
+        out_of_order += data[j] != (uint8_t)((i + j) * 7);
+      }
+      ring.Skip(run);
+      i += run;
+    }
+    else if(ring.Pop(&byte)){
+      out_of_order += byte != (uint8_t)(i * 7);
+      i++;
+    }
+    else{
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  CHECK(out_of_order == 0);
+  CHECK(ring.IsEmpty());
+}
@@ -0,0 +1,81 @@
+#include "check.hpp"
+
+#include "nxp/nguart.hpp"
+
+#include <math.h>
+
+//The baud rate the datasheet's formula gives for a set of divisors, worked
+//out in floating point so it doesn't share any rounding with RateOf
+static double DatasheetRate(uint16_t dl, uint8_t divaddval, uint8_t mulval, uint32_t pclk){
+  return pclk / (16.0 * dl * (1.0 + (double)divaddval / mulval));
+}
+
+//The lowest error any legal setting can get, by trying every one
+static uint32_t BestErrorPpm(uint32_t baud, uint32_t pclk){
+  uint32_t best = 0xFFFFFFFF;
+  for(uint8_t mulval = 1; mulval <= 15; mulval++){
+    for(uint8_t divaddval = 0; divaddval < mulval; divaddval++){
+      for(uint32_t dl = divaddval ? 3 : 1; dl <= 0xFFFF; dl++){
+        UART::Divisor d = {baud, UART::RateOf(dl, divaddval, mulval, pclk), (uint16_t)dl, divaddval, mulval};
+        if(d.GetErrorPpm() < best){
+          best = d.GetErrorPpm();
+        }
+      }
+    }
+  }
+  return best;
+}
+
+//Check a result is a setting the hardware takes, and that it does what it says
+static bool Legal(const UART::Divisor &d, uint32_t pclk){
+  if(d.mulval < 1 || d.mulval > 15 || d.divaddval >= d.mulval || d.dl == 0){
+    return 0;
+  }
+  if(d.divaddval && d.dl < 3){
+    return 0;
+  }
+  return fabs(DatasheetRate(d.dl, d.divaddval, d.mulval, pclk) - d.rate) < 1.0;
+}
+
+TEST(UartDivisorAtCompileTime){
+  constexpr UART::Divisor d = UART::FindDivisor(921600);
+  static_assert(d.baud == 921600, "FindDivisor has to run at compile time");
+  CHECK(Legal(d, UART_PCLK));
+  //1.6 ppt fast, with the fractional divider on
+  CHECK(d.rate > 921600 && d.GetErrorPpm() < 2000);
+  CHECK(d.divaddval != 0);
+}
+
+TEST(UartDivisorExactRates){
+  const uint32_t kExact[] = {3000000, 1500000, 1000000, 500000, 250000};
+  for(uint32_t baud : kExact){
+    UART::Divisor d = UART::FindDivisor(baud);
+    CHECK(Legal(d, UART_PCLK));
+    CHECK(d.rate == baud);
+  }
+}
+
+TEST(UartDivisorIsTheBest){
+  //Nothing legal gets any closer, at the board's clock and at another
+  const uint32_t kRates[] = {9600, 57600, 115200, 460800, 921600};
+  for(uint32_t baud : kRates){
+    UART::Divisor d = UART::FindDivisor(baud);
+    CHECK(Legal(d, UART_PCLK));
+    CHECK(d.GetErrorPpm() == BestErrorPpm(baud, UART_PCLK));
+  }
+  UART::Divisor d = UART::FindDivisor(115200, 12000000);
+  CHECK(Legal(d, 12000000));
+  CHECK(d.GetErrorPpm() == BestErrorPpm(115200, 12000000));
+}
+
+TEST(UartDivisorOutOfRange){
+  //Too slow for the divisor latch, so it gets as close as it can
+  UART::Divisor slow = UART::FindDivisor(10);
+  CHECK(Legal(slow, UART_PCLK));
+  CHECK(slow.dl == 0xFFFF);
+  CHECK(slow.rate > 10);
+  //Too fast for any setting
+  UART::Divisor fast = UART::FindDivisor(6000000);
+  CHECK(Legal(fast, UART_PCLK));
+  CHECK(fast.rate == 3000000);
+}
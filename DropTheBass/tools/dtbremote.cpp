@@ -0,0 +1,159 @@
+//A reference client for the player's remote control protocol, for Linux.
+//Every command on the command line goes out in one frame, then the answer is
+//printed. Build with:
+//  g++ -O2 -o dtbremote dtbremote.cpp
+//Usage:
+//  dtbremote /dev/ttyUSB0 play /Music/song.mp3 volume 20 status
+//  dtbremote /dev/ttyUSB0 watch 500
+//Commands: play <path>, seek <seconds>, volume <0-254>, bass <0-15>, status,
+//watch <ms> (subscribe, then print status until killed)
+
+#include "../source/player/ngremoteproto.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+static const char* const kStates[] = {"scanning", "menu", "playing", "paused", "func playing", "func paused"};
+static const char* const kResults[] = {"ok", "bad args", "not found", "unknown op", "busy"};
+
+//Open the serial port raw at the player's baud rate
+//@return int: The file descriptor, or -1
+static int OpenPort(const char *path){
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if(fd < 0){
+    perror(path);
+    return -1;
+  }
+  struct termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  cfsetspeed(&tio, B115200);
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  tcsetattr(fd, TCSANOW, &tio);
+  return fd;
+}
+
+//Read up to the next delimiter and decode the frame
+//@return int: The payload size, or -1 if the frame was bad
+static int ReadFrame(int fd, uint8_t *frame){
+  uint16_t len = 0;
+  uint8_t byte;
+  while(read(fd, &byte, 1) == 1){
+    if(byte == 0){
+      return len ? remote::Decode(frame, len) : -1;
+    }
+    if(len < REMOTE_MAX_FRAME){
+      frame[len++] = byte;
+    }
+  }
+  return -1;
+}
+
+static void PrintStatus(const uint8_t *args, uint8_t len){
+  remote::Status status;
+  if(len != sizeof(status)){
+    printf("status: bad size %d\n", len);
+    return;
+  }
+  memcpy(&status, args, sizeof(status));
+  printf("status: %s%s, song %d of %d, %d s, volume %d, bass %d, %d underruns\n",
+         status.state < 6 ? kStates[status.state] : "?", status.paused ? " (paused)" : "",
+         status.position + 1, status.count, status.play_time, status.volume, status.bass, status.underruns);
+}
+
+//Print every record in an answer
+static void PrintPayload(const uint8_t *payload, uint16_t len){
+  uint16_t pos = 0;
+  uint8_t op;
+  const uint8_t *args;
+  uint8_t args_len;
+  while(remote::NextRecord(payload, len, &pos, &op, &args, &args_len)){
+    if(op == remote::kOpAck && args_len == 2){
+      printf("op %02x: %s\n", args[0], args[1] < 5 ? kResults[args[1]] : "?");
+    }
+    else if(op == remote::kOpStatusReport){
+      PrintStatus(args, args_len);
+    }
+    else{
+      printf("op %02x: %d bytes\n", op, args_len);
+    }
+  }
+}
+
+int main(int argc, char **argv){
+  if(argc < 3){
+    fprintf(stderr, "usage: %s <port> <command> [args] ...\n", argv[0]);
+    return 1;
+  }
+  uint8_t payload[REMOTE_MAX_PAYLOAD];
+  uint16_t used = 0;
+  bool watch = 0;
+  bool ok = 1;
+  for(int i = 2; i < argc && ok; i++){
+    const char *cmd = argv[i];
+    const char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+    if(!strcmp(cmd, "status")){
+      ok = remote::AddRecord(payload, &used, remote::kOpStatus, NULL, 0);
+      continue;
+    }
+    if(arg == NULL){
+      fprintf(stderr, "%s needs an argument\n", cmd);
+      return 1;
+    }
+    i++;
+    if(!strcmp(cmd, "play")){
+      size_t len = strlen(arg);
+      ok = len < 256 && remote::AddRecord(payload, &used, remote::kOpPlay, arg, len);
+    }
+    else if(!strcmp(cmd, "seek")){
+      int16_t jump = atoi(arg);
+      ok = remote::AddRecord(payload, &used, remote::kOpSeek, &jump, sizeof(jump));
+    }
+    else if(!strcmp(cmd, "volume") || !strcmp(cmd, "bass")){
+      uint8_t value = atoi(arg);
+      ok = remote::AddRecord(payload, &used, cmd[0] == 'v' ? remote::kOpVolume : remote::kOpBass, &value, 1);
+    }
+    else if(!strcmp(cmd, "watch")){
+      uint16_t ms = atoi(arg);
+      ok = remote::AddRecord(payload, &used, remote::kOpSubscribe, &ms, sizeof(ms));
+      watch = 1;
+    }
+    else{
+      fprintf(stderr, "unknown command %s\n", cmd);
+      return 1;
+    }
+  }
+  if(!ok){
+    fprintf(stderr, "too much for one frame\n");
+    return 1;
+  }
+
+  int fd = OpenPort(argv[1]);
+  if(fd < 0){
+    return 1;
+  }
+  uint8_t frame[REMOTE_MAX_FRAME + 1];
+  //Lead with a delimiter so the player drops anything half sent before us
+  uint16_t len = remote::Encode(payload, used, &frame[1]);
+  frame[0] = 0;
+  if(write(fd, frame, len + 1) != len + 1){
+    perror("write");
+    return 1;
+  }
+  //The first frame back is the answer, anything after that is status
+  do{
+    int got = ReadFrame(fd, frame);
+    if(got < 0){
+      printf("bad frame\n");
+      continue;
+    }
+    PrintPayload(frame, got);
+  } while(watch);
+  close(fd);
+  return 0;
+}